@@ -46,6 +46,9 @@ SPINLOCK_INLINE
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 SPINLOCK_INLINE
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+bool spinlock_data_compareandswap(volatile spinlock_data_t *sd,
+				  spinlock_data_t old, spinlock_data_t new);
 
 ////////////////////////////////////////////////////////////
 
@@ -118,5 +121,42 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+/*
+ * Compare-and-swap a spinlock_data_t: if it holds OLD, replace it
+ * with NEW and return true; otherwise leave it alone and return
+ * false. Also uses LL/SC; see above.
+ *
+ * The branch between the LL and the SC is allowed (it's not a memory
+ * access). Its delay slot clears Y, so Y ends up nonzero only if the
+ * SC was reached and succeeded. Like testandset, this can fail
+ * spuriously if the SC does; callers retry.
+ */
+SPINLOCK_INLINE
+bool
+spinlock_data_compareandswap(volatile spinlock_data_t *sd,
+			     spinlock_data_t old, spinlock_data_t new)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slot */
+		"ll %0, 0(%2);"		/*   x = *sd */
+		"nop;"			/*   (load delay) */
+		"bne %0, %3, 1f;"	/*   if (x != old) goto 1 */
+		"move %1, $0;"		/*   y = 0 (delay slot) */
+		"move %1, %4;"		/*   y = new */
+		"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+		"1:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (sd), "r" (old), "r" (new)
+		: "memory");
+	return y != 0;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -117,10 +117,8 @@ paddr_t ram_getfirstfree(void);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	vaddr_t ts_vaddr;		/* page to invalidate */
+	struct semaphore *ts_done;	/* V'd once it's gone */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -213,6 +213,7 @@ mips_trap(struct trapframe *tf)
 			doadjust = false;
 		}
 
+		curcpu->c_intrs++;
 		mainbus_interrupt(tf);
 
 		if (doadjust) {
@@ -58,7 +58,8 @@
  *
  * The c0_count register increments on every cycle; when the value
  * matches the c0_compare register, the timer interrupt line is
- * asserted. Writing to c0_compare again clears the interrupt.
+ * asserted and c0_count starts again from zero. Writing to c0_compare
+ * again clears the interrupt.
  */
 static
 void
@@ -76,6 +77,31 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Read c0_count: cycles since the last timer interrupt.
+ */
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+/*
+ * Fewest cycles ahead of c0_count to set c0_compare, so that the count
+ * can't pass it before the write lands.
+ */
+#define MIPS_TIMER_MINDELAY 256
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -119,6 +145,30 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Move the next hardclock on this cpu to NTICKS ticks after the last
+ * one. c0_compare is compared against c0_count, which has been counting
+ * since that interrupt; if the count is already past the new deadline
+ * (a kick back to one tick, late) the compare value would not come
+ * round again until the count wrapped, so fire as soon as we can
+ * instead. The interrupt handler below reprograms the timer for a
+ * single tick each time it fires.
+ */
+void
+mainbus_set_hardclock(unsigned nticks)
+{
+	uint32_t count, compare;
+
+	KASSERT(nticks > 0 && nticks <= HARDCLOCK_MAXDEFER);
+
+	count = mips_timer_get();
+	compare = CPU_FREQUENCY / HZ * nticks;
+	if (compare < count + MIPS_TIMER_MINDELAY) {
+		compare = count + MIPS_TIMER_MINDELAY;
+	}
+	mips_timer_set(compare);
+}
+
 /*
  * Start all secondary CPUs.
  */
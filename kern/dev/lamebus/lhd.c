@@ -36,7 +36,8 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <wchan.h>
+#include <clock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +61,14 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Sectors per transfer for I/O to user memory */
+#define LHD_BOUNCESECTS 16
+
+/* Request scheduling */
+#define LHD_MAXMERGE        256  /* Most sectors in one merged chain */
+#define LHD_SYNC_EXPIRE     50   /* Deadline for sync requests, msecs */
+#define LHD_ASYNC_EXPIRE    500  /* Deadline for async requests, msecs */
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,28 +105,235 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Copy one sector between the on-card buffer and the current position
+ * in REQ's iovecs, and advance the position.
+ */
+static
+void
+lhd_copysect(struct lhd_softc *lh, struct lhd_req *req)
+{
+	struct iovec *iov;
+	char *buf = lh->lh_buf;
+	size_t done, amt;
+
+	for (done = 0; done < LHD_SECTSIZE; done += amt) {
+		KASSERT(req->lr_curiov < req->lr_iovcnt);
+		iov = &req->lr_iov[req->lr_curiov];
+		amt = iov->iov_len - req->lr_curoff;
+		if (amt > LHD_SECTSIZE - done) {
+			amt = LHD_SECTSIZE - done;
+		}
+		if (req->lr_write) {
+			memcpy(buf + done,
+			       (char *)iov->iov_kbase + req->lr_curoff, amt);
+		}
+		else {
+			memcpy((char *)iov->iov_kbase + req->lr_curoff,
+			       buf + done, amt);
+		}
+		req->lr_curoff += amt;
+		if (req->lr_curoff == iov->iov_len) {
+			req->lr_curiov++;
+			req->lr_curoff = 0;
+		}
+	}
+}
+
+/*
+ * Current time in microseconds.
+ */
+static
+uint64_t
+lhd_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Count VAL in histogram HIST.
+ */
+static
+void
+lhd_histadd(unsigned *hist, uint64_t val)
+{
+	unsigned bucket = 0;
+
+	while (val > 0 && bucket < LHD_NHIST - 1) {
+		val >>= 1;
+		bucket++;
+	}
+	hist[bucket]++;
+}
+
+/*
+ * Start the next sector of the active request, if there is one.
  */
 static
 void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_req *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (req == NULL) {
+		return;
+	}
+	KASSERT(req->lr_nxfer < req->lr_nsect);
+
+	/* If writing, transfer the data to the on-card buffer. */
+	if (req->lr_write) {
+		lhd_copysect(lh, req);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want, and start the operation. */
+	lhd_wreg(lh, LHD_REG_SECT, req->lr_sector + req->lr_nxfer);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Pick the next chain of requests to run and start it.
+ *
+ * Anything past its deadline goes first, oldest deadline first.
+ * Otherwise take the synchronous queue if it has anything in it, and
+ * from that queue the first chain at or after the head position,
+ * wrapping around to the lowest sector if there's none (C-LOOK).
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh)
+{
+	struct lhd_req *req, *pick, **pickp, **rp;
+	uint64_t now;
+	unsigned c;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lh->lh_active == NULL);
+
+	if (lh->lh_queue[LHD_SYNC] == NULL && lh->lh_queue[LHD_ASYNC] == NULL) {
+		return;
+	}
+
+	pick = NULL;
+	pickp = NULL;
+	now = lhd_now();
+	for (c = 0; c < LHD_NCLASSES; c++) {
+		for (rp = &lh->lh_queue[c]; *rp != NULL; rp = &(*rp)->lr_next) {
+			req = *rp;
+			if (req->lr_deadline <= now &&
+			    (pick == NULL ||
+			     req->lr_deadline < pick->lr_deadline)) {
+				pick = req;
+				pickp = rp;
+			}
+		}
+	}
+	if (pick != NULL) {
+		lh->lh_stats.ls_expired++;
+	}
+	else {
+		c = lh->lh_queue[LHD_SYNC] != NULL ? LHD_SYNC : LHD_ASYNC;
+		for (rp = &lh->lh_queue[c]; *rp != NULL; rp = &(*rp)->lr_next) {
+			if ((*rp)->lr_sector >= lh->lh_headpos) {
+				break;
+			}
+		}
+		if (*rp == NULL) {
+			rp = &lh->lh_queue[c];
+		}
+		pick = *rp;
+		pickp = rp;
+	}
+
+	*pickp = pick->lr_next;
+	pick->lr_next = NULL;
+	lh->lh_active = pick;
+	lhd_start(lh);
+}
+
+/*
+ * Record that the sector in progress has completed with result ERR,
+ * and keep the disk busy. Returns the request if that finished it
+ * and it has a completion function to call; the caller calls it
+ * after releasing the lock.
+ */
+static
+struct lhd_req *
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_req *req = lh->lh_active;
+	unsigned class;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (req == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		return NULL;
+	}
+	lh->lh_headpos = req->lr_sector + req->lr_nxfer + 1;
+
+	/* If reading, transfer the data out of the on-card buffer. */
+	if (err == 0) {
+		if (!req->lr_write) {
+			membar_load_load();
+			lhd_copysect(lh, req);
+		}
+		req->lr_nxfer++;
+		if (req->lr_nxfer < req->lr_nsect) {
+			lhd_start(lh);
+			return NULL;
+		}
+	}
+
+	/*
+	 * This request is finished; go on with the rest of its chain,
+	 * or pick something else. Get everything we need out of REQ
+	 * first: once it's marked finished its owner may free it.
+	 */
+	class = req->lr_async ? LHD_ASYNC : LHD_SYNC;
+	lhd_histadd(lh->lh_stats.ls_latency[class],
+		    lhd_now() - req->lr_startus);
+	KASSERT(lh->lh_nqueued > 0);
+	lh->lh_nqueued--;
+
+	lh->lh_active = req->lr_chain;
+	req->lr_chain = NULL;
+	req->lr_result = err;
+	if (lh->lh_active != NULL) {
+		lhd_start(lh);
+	}
+	else {
+		lhd_dispatch(lh);
+	}
+
+	if (req->lr_done != NULL) {
+		return req;
+	}
+	req->lr_finished = true;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+	return NULL;
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, report completion, and start the next sector.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct lhd_req *done = NULL;
 	uint32_t val;
 
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -128,9 +344,134 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		done = lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
+
+	if (done != NULL) {
+		done->lr_done(done, done->lr_result);
+	}
+}
+
+/*
+ * Try to merge REQ into a queued chain of class CLASS that ends
+ * where it starts, or make it the head of one that starts where it
+ * ends. Returns true if it was merged.
+ */
+static
+bool
+lhd_merge(struct lhd_softc *lh, struct lhd_req *req, unsigned class)
+{
+	struct lhd_req *head, **hp;
+
+	for (hp = &lh->lh_queue[class]; *hp != NULL; hp = &(*hp)->lr_next) {
+		head = *hp;
+		if (head->lr_write != req->lr_write ||
+		    head->lr_chainnsect + req->lr_nsect > LHD_MAXMERGE) {
+			continue;
+		}
+		if (head->lr_sector + head->lr_chainnsect == req->lr_sector) {
+			/* Back merge: add REQ to the end of the chain */
+			head->lr_chaintail->lr_chain = req;
+			head->lr_chaintail = req;
+			head->lr_chainnsect += req->lr_nsect;
+			if (req->lr_deadline < head->lr_deadline) {
+				head->lr_deadline = req->lr_deadline;
+			}
+			return true;
+		}
+		if (req->lr_sector + req->lr_nsect == head->lr_sector) {
+			/* Front merge: REQ takes HEAD's place in the queue */
+			req->lr_chain = head;
+			req->lr_chaintail = head->lr_chaintail;
+			req->lr_chainnsect = req->lr_nsect + head->lr_chainnsect;
+			if (head->lr_deadline < req->lr_deadline) {
+				req->lr_deadline = head->lr_deadline;
+			}
+			req->lr_next = head->lr_next;
+			head->lr_next = NULL;
+			*hp = req;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Queue a request. Fails with EINVAL if it runs off the end of the
+ * disk; otherwise completion is reported through the request.
+ */
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_req *req)
+{
+	struct lhd_req **rp;
+	unsigned class;
+
+	if (req->lr_nsect == 0 || req->lr_nsect > lh->lh_dev.d_blocks ||
+	    req->lr_sector > lh->lh_dev.d_blocks - req->lr_nsect) {
+		return EINVAL;
+	}
+
+	class = req->lr_async ? LHD_ASYNC : LHD_SYNC;
+	req->lr_result = 0;
+	req->lr_nxfer = 0;
+	req->lr_finished = false;
+	req->lr_curiov = 0;
+	req->lr_curoff = 0;
+	req->lr_startus = lhd_now();
+	req->lr_deadline = req->lr_startus + 1000 *
+		(req->lr_async ? LHD_ASYNC_EXPIRE : LHD_SYNC_EXPIRE);
+	req->lr_next = NULL;
+	req->lr_chain = NULL;
+	req->lr_chaintail = req;
+	req->lr_chainnsect = req->lr_nsect;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	lh->lh_stats.ls_requests[class]++;
+	lhd_histadd(lh->lh_stats.ls_qdepth, lh->lh_nqueued);
+	lh->lh_nqueued++;
+
+	if (lhd_merge(lh, req, class)) {
+		lh->lh_stats.ls_merged++;
+	}
+	else {
+		/* Insert in sector order */
+		for (rp = &lh->lh_queue[class]; *rp != NULL;
+		     rp = &(*rp)->lr_next) {
+			if ((*rp)->lr_sector > req->lr_sector) {
+				break;
+			}
+		}
+		req->lr_next = *rp;
+		*rp = req;
+	}
+
+	if (lh->lh_active == NULL) {
+		/* Disk is idle; kick it */
+		lhd_dispatch(lh);
+	}
+
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
+}
+
+/*
+ * Sleep until REQ (which must have no lr_done) finishes.
+ */
+void
+lhd_wait(struct lhd_softc *lh, struct lhd_req *req)
+{
+	KASSERT(req->lr_done == NULL);
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!req->lr_finished) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -179,8 +520,79 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Advance UIO past LEN bytes that were transferred behind its back,
+ * the way uiomove would have.
+ */
+static
+void
+lhd_uioskip(struct uio *uio, size_t len)
+{
+	struct iovec *iov;
+	size_t amt;
+
+	KASSERT(len <= uio->uio_resid);
+
+	while (len > 0) {
+		KASSERT(uio->uio_iovcnt > 0);
+		iov = uio->uio_iov;
+		amt = iov->iov_len < len ? iov->iov_len : len;
+		iov->iov_kbase = (char *)iov->iov_kbase + amt;
+		iov->iov_len -= amt;
+		uio->uio_offset += amt;
+		uio->uio_resid -= amt;
+		len -= amt;
+		if (iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+		}
+	}
+}
+
+/*
+ * Run NSECT sectors starting at SECTOR through the kernel buffers
+ * IOV/IOVCNT and wait for them. Returns the number of sectors that
+ * were transferred in *NXFER.
+ *
+ * Reads are queued as synchronous and writes as asynchronous: reads
+ * (page faults, directory and inode lookups) have someone stalled on
+ * them, while writes are mostly write-back and swap-out, which can
+ * wait a little without holding anything else up.
+ */
+static
+int
+lhd_syncio(struct lhd_softc *lh, uint32_t sector, uint32_t nsect,
+	   bool write, struct iovec *iov, unsigned iovcnt, uint32_t *nxfer)
+{
+	struct lhd_req req;
+	int result;
+
+	req.lr_sector = sector;
+	req.lr_nsect = nsect;
+	req.lr_write = write;
+	req.lr_async = write;
+	req.lr_iov = iov;
+	req.lr_iovcnt = iovcnt;
+	req.lr_done = NULL;
+	req.lr_data = NULL;
+
+	result = lhd_submit(lh, &req);
+	if (result) {
+		*nxfer = 0;
+		return result;
+	}
+	lhd_wait(lh, &req);
+	*nxfer = req.lr_nxfer;
+	return req.lr_result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * Kernel buffers are handed to the disk as is, however many sectors
+ * and iovecs they cover. User buffers can't be touched from the
+ * interrupt handler, so they go through a bounce buffer up to
+ * LHD_BOUNCESECTS at a time.
  */
 static
 int
@@ -192,8 +604,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool write = uio->uio_rw == UIO_WRITE;
+	struct iovec iov;
+	uint32_t nsect, nxfer;
+	char *bounce;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -202,72 +616,190 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (len > lh->lh_dev.d_blocks || sector > lh->lh_dev.d_blocks - len) {
 		return EINVAL;
 	}
+	if (len == 0) {
+		return 0;
+	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		result = lhd_syncio(lh, sector, len, write,
+				   uio->uio_iov, uio->uio_iovcnt, &nxfer);
+		lhd_uioskip(uio, nxfer * LHD_SECTSIZE);
+		return result;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	bounce = kmalloc(LHD_BOUNCESECTS * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	result = 0;
+	while (len > 0) {
+		nsect = len < LHD_BOUNCESECTS ? len : LHD_BOUNCESECTS;
+		iov.iov_kbase = bounce;
+		iov.iov_len = nsect * LHD_SECTSIZE;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+		if (write) {
+			result = uiomove(bounce, nsect * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
+		result = lhd_syncio(lh, sector, nsect, write, &iov, 1, &nxfer);
+		if (!write) {
+			/* Hand back whatever did get read */
+			if (uiomove(bounce, nxfer * LHD_SECTSIZE, uio)) {
+				result = result ? result : EFAULT;
+			}
+		}
+		if (result) {
+			break;
+		}
+		sector += nsect;
+		len -= nsect;
+	}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
+	kfree(bounce);
+	return result;
+}
 
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
+/*
+ * Completion function for devop_aio requests. Called from the
+ * interrupt handler; frees the slot and passes the result on.
+ */
+static
+void
+lhd_aiodone(struct lhd_req *req, int result)
+{
+	struct lhd_aio *la = req->lr_data;
+	struct lhd_softc *lh = la->la_softc;
+	void (*done)(void *, int) = la->la_done;
+	void *data = la->la_data;
 
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+	spinlock_acquire(&lh->lh_lock);
+	la->la_inuse = false;
+	spinlock_release(&lh->lh_lock);
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	done(data, result);
+}
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+/*
+ * Asynchronous I/O function. The request goes in the asynchronous
+ * class and transfers straight to and from the caller's iovecs, so
+ * they have to be kernel memory. Fails with EAGAIN if LHD_NAIO
+ * requests are already in flight.
+ */
+static
+int
+lhd_aio(struct device *d, struct uio *uio,
+	void (*done)(void *, int), void *data)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_aio *la = NULL;
+	unsigned i;
+	int result;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return EINVAL;
+	}
+	if (uio->uio_offset % LHD_SECTSIZE != 0 ||
+	    uio->uio_resid % LHD_SECTSIZE != 0) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	for (i = 0; i < LHD_NAIO; i++) {
+		if (!lh->lh_aio[i].la_inuse) {
+			la = &lh->lh_aio[i];
+			la->la_inuse = true;
+			break;
 		}
+	}
+	spinlock_release(&lh->lh_lock);
+	if (la == NULL) {
+		return EAGAIN;
+	}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+	la->la_done = done;
+	la->la_data = data;
+	la->la_req.lr_sector = uio->uio_offset / LHD_SECTSIZE;
+	la->la_req.lr_nsect = uio->uio_resid / LHD_SECTSIZE;
+	la->la_req.lr_write = uio->uio_rw == UIO_WRITE;
+	la->la_req.lr_async = true;
+	la->la_req.lr_iov = uio->uio_iov;
+	la->la_req.lr_iovcnt = uio->uio_iovcnt;
+	la->la_req.lr_done = lhd_aiodone;
+	la->la_req.lr_data = la;
+
+	result = lhd_submit(lh, &la->la_req);
+	if (result) {
+		spinlock_acquire(&lh->lh_lock);
+		la->la_inuse = false;
+		spinlock_release(&lh->lh_lock);
+	}
+	return result;
+}
 
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+/*
+ * Print histogram HIST of WHAT, skipping empty buckets.
+ */
+static
+void
+lhd_printhist(const char *what, const unsigned *hist)
+{
+	unsigned i;
+
+	kprintf("    %s:", what);
+	for (i = 0; i < LHD_NHIST; i++) {
+		if (hist[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			kprintf(" 0:%u", hist[i]);
+		}
+		else if (i == LHD_NHIST - 1) {
+			kprintf(" %u+:%u", 1U << (i - 1), hist[i]);
+		}
+		else {
+			kprintf(" %u-%u:%u", 1U << (i - 1), (1U << i) - 1,
+				hist[i]);
 		}
 	}
+	kprintf("\n");
+}
 
-	return 0;
+/*
+ * Print the disk's queueing statistics.
+ */
+static
+void
+lhd_printstats(struct device *d)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_stats st;
+
+	/* Copy them out; kprintf can't be called under a spinlock */
+	spinlock_acquire(&lh->lh_lock);
+	st = lh->lh_stats;
+	spinlock_release(&lh->lh_lock);
+
+	kprintf("lhd%d: %u sync and %u async requests, %u merged, "
+		"%u past deadline\n", lh->lh_unit,
+		st.ls_requests[LHD_SYNC], st.ls_requests[LHD_ASYNC],
+		st.ls_merged, st.ls_expired);
+	lhd_printhist("queue depth", st.ls_qdepth);
+	lhd_printhist("sync latency (usecs)", st.ls_latency[LHD_SYNC]);
+	lhd_printhist("async latency (usecs)", st.ls_latency[LHD_ASYNC]);
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_printstats = lhd_printstats,
+	.devop_aio = lhd_aio,
 };
 
 /*
@@ -277,6 +809,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	unsigned i;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -284,16 +817,21 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	lh->lh_active = NULL;
+	lh->lh_queue[LHD_SYNC] = lh->lh_queue[LHD_ASYNC] = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_nqueued = 0;
+	bzero(&lh->lh_stats, sizeof(lh->lh_stats));
+	for (i = 0; i < LHD_NAIO; i++) {
+		lh->lh_aio[i].la_softc = lh;
+		lh->lh_aio[i].la_inuse = false;
 	}
 
 	/* Set up the VFS device structure. */
@@ -30,13 +30,95 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
+struct iovec;
+struct wchan;
+
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * A transfer of one or more consecutive sectors to or from a list of
+ * kernel buffers. Requests are queued and run back to back: the
+ * interrupt handler copies each sector and starts the next one, so
+ * the submitter doesn't run again until the whole request is done.
+ *
+ * Queued requests are served in C-LOOK (one-way elevator) order,
+ * synchronous ones ahead of asynchronous ones, except that anything
+ * past its deadline goes first. A request that continues where a
+ * queued one of the same kind leaves off is merged with it, and the
+ * two run as a single sweep.
+ *
+ * The caller fills in the first group of fields. The iovecs must
+ * describe at least lr_nsect * LHD_SECTSIZE bytes of kernel memory
+ * and stay valid until the request completes.
+ *
+ * If lr_done is NULL, lhd_wait can be used to sleep until the
+ * request finishes. Otherwise lr_done is called when it finishes,
+ * from the interrupt handler, so it must not sleep.
+ */
+struct lhd_req {
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	bool lr_write;			/* Direction */
+	bool lr_async;			/* Nobody is waiting on it right away */
+	struct iovec *lr_iov;		/* Memory to transfer */
+	unsigned lr_iovcnt;
+	void (*lr_done)(struct lhd_req *, int result);
+	void *lr_data;			/* For lr_done's use */
+
+	/* Filled in by the driver */
+	int lr_result;			/* Error code, once finished */
+	uint32_t lr_nxfer;		/* Sectors transferred so far */
+	bool lr_finished;		/* Set when done (lr_done == NULL) */
+	unsigned lr_curiov;		/* Position in the iovecs */
+	size_t lr_curoff;
+	uint64_t lr_startus;		/* Submit time, usecs */
+	uint64_t lr_deadline;		/* Serve by this time, usecs */
+	struct lhd_req *lr_next;	/* Queue link */
+	struct lhd_req *lr_chain;	/* Next request merged with this one */
+	struct lhd_req *lr_chaintail;	/* Last request in the chain */
+	uint32_t lr_chainnsect;		/* Sectors in the whole chain */
+};
+
+/* Most devop_aio requests in flight at once */
+#define LHD_NAIO	8
+
+/*
+ * A devop_aio request.
+ */
+struct lhd_aio {
+	struct lhd_req la_req;
+	struct lhd_softc *la_softc;
+	void (*la_done)(void *, int);	/* The caller's completion */
+	void *la_data;
+	bool la_inuse;			/* Under lh_lock */
+};
+
+/* Request classes */
+#define LHD_SYNC	0
+#define LHD_ASYNC	1
+#define LHD_NCLASSES	2
+
+/*
+ * Histograms have power-of-two buckets: bucket 0 counts 0, bucket N
+ * counts values from 2^(N-1) to 2^N - 1, and the last bucket counts
+ * everything bigger.
+ */
+#define LHD_NHIST	20
+
+struct lhd_stats {
+	unsigned ls_requests[LHD_NCLASSES];	/* Requests submitted */
+	unsigned ls_merged;			/* ...merged with another */
+	unsigned ls_expired;			/* ...served by deadline */
+	unsigned ls_qdepth[LHD_NHIST];		/* Requests queued ahead */
+	unsigned ls_latency[LHD_NCLASSES][LHD_NHIST]; /* Usecs to finish */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,13 +133,22 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct wchan *lh_wchan;		/* For waiting on requests */
+	struct lhd_req *lh_active;	/* Request in progress */
+	struct lhd_req *lh_queue[LHD_NCLASSES];	/* Waiting, by sector */
+	uint32_t lh_headpos;		/* Sector after the last one done */
+	unsigned lh_nqueued;		/* Requests not yet finished */
+	struct lhd_stats lh_stats;	/* Under lh_lock */
+	struct lhd_aio lh_aio[LHD_NAIO];	/* For devop_aio */
 
 	struct device lh_dev;		/* VFS device structure */
 };
 
+/* Queue a request; wait for one that has no lr_done */
+int lhd_submit(struct lhd_softc *lh, struct lhd_req *req);
+void lhd_wait(struct lhd_softc *lh, struct lhd_req *req);
+
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
@@ -33,11 +33,29 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
+#include <vnode.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* Most blocks reserved ahead for a file being written sequentially */
+#define SFS_PREALLOC 16
+
+/* Most blocks a file may have waiting for delayed allocation */
+#define SFS_DELAYMAX SFS_MAXCLUSTER
+
+/*
+ * A file block that has been written but has no disk block yet.
+ */
+struct sfs_dblock {
+	uint32_t db_fileblock;
+	struct sfs_dblock *db_next;	/* sv_delayed, by db_fileblock */
+	char db_data[SFS_BLOCKSIZE];
+};
+
 /*
  * Zero out a disk block.
  */
@@ -52,40 +70,302 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 }
 
 /*
- * Allocate a block.
+ * Mark up to MAX free blocks in a row, starting at GOAL if it's free
+ * and otherwise at the next free block after it. Hands back the
+ * first block and how many were taken. The blocks are not cleared.
  */
+static
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_ballocrun(struct sfs_fs *sfs, daddr_t goal, unsigned max,
+	      daddr_t *diskblock, unsigned *count)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_run(sfs->sfs_freemap, goal, max,
+				  diskblock, count);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
-	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
+	if (*diskblock + *count > sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
+	return 0;
+}
+
+/*
+ * Return COUNT blocks starting at DISKBLOCK, which were never used,
+ * to the freemap.
+ */
+static
+void
+sfs_bunrun(struct sfs_fs *sfs, daddr_t diskblock, unsigned count)
+{
+	unsigned i;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=0; i<count; i++) {
+		bitmap_unmark(sfs->sfs_freemap, diskblock + i);
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Allocate a block, as close after GOAL as possible. (Pass 0 for
+ * no preference.)
+ *
+ * The freemap lock is only held while the bitmap is touched; the
+ * block is ours once it's marked, so it can be cleared unlocked.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	unsigned count;
+	int result;
+
+	result = sfs_ballocrun(sfs, goal, 1, diskblock, &count);
+	if (result) {
+		return result;
+	}
 
 	/* Clear block before returning it */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs_bunrun(sfs, *diskblock, 1);
 	}
 	return result;
 }
 
+/*
+ * Allocate a block for block FILEBLOCK of file SV.
+ *
+ * Each file remembers where its last block went, and the next one
+ * goes right after it if that's free. When the file is being written
+ * in order, a run of blocks is taken at once and the rest are kept for
+ * the blocks that follow; so sequential writes end up contiguous on
+ * disk even with other files growing at the same time. The run is as
+ * long as the file already is, up to SFS_PREALLOC, so small files
+ * don't tie up space. The reserved blocks are given back when the
+ * pattern breaks or the file is truncated or reclaimed.
+ *
+ * The caller must hold sv_rwlock exclusively.
+ */
+int
+sfs_balloc_file(struct sfs_vnode *sv, uint32_t fileblock, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	bool sequential;
+	daddr_t goal;
+	unsigned want, count;
+	int result;
+
+	sequential = (fileblock == sv->sv_nextfileblock);
+	if (!sequential) {
+		sfs_prealloc_release(sv);
+	}
+
+	if (sv->sv_npreallocs > 0) {
+		*diskblock = sv->sv_prealloc++;
+		sv->sv_npreallocs--;
+	}
+	else {
+		/* Start new files just past their inode */
+		goal = sv->sv_goal != 0 ? sv->sv_goal : sv->sv_ino + 1;
+		want = 1;
+		if (sequential && fileblock > 1) {
+			want = fileblock < SFS_PREALLOC ?
+				fileblock : SFS_PREALLOC;
+		}
+		result = sfs_ballocrun(sfs, goal, want, diskblock, &count);
+		if (result) {
+			return result;
+		}
+		sv->sv_prealloc = *diskblock + 1;
+		sv->sv_npreallocs = count - 1;
+	}
+
+	/* Clear block before returning it */
+	result = sfs_clearblock(sfs, *diskblock);
+	if (result) {
+		sfs_bunrun(sfs, *diskblock, 1);
+		return result;
+	}
+
+	sv->sv_goal = *diskblock + 1;
+	sv->sv_nextfileblock = fileblock + 1;
+	return 0;
+}
+
+/*
+ * Give back the blocks reserved for SV's next writes. The caller
+ * must hold sv_rwlock exclusively (or, in reclaim, be the last user).
+ */
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sv->sv_npreallocs > 0) {
+		sfs_bunrun(sfs, sv->sv_prealloc, sv->sv_npreallocs);
+		sv->sv_npreallocs = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Delayed allocation
+
+/*
+ * Writes to file blocks that have no disk block don't allocate one
+ * right away. The data is kept with the vnode instead, and the blocks
+ * are allocated when the file is flushed: by sync (so the syncer gets
+ * to them every few seconds), fsync, reclaim, or when a file has
+ * SFS_DELAYMAX of them waiting. By then we know how many blocks in a
+ * row the file wants, and they're allocated in file order, so the
+ * placement logic above can lay them out contiguously; short-lived
+ * files that are removed before that never touch the freemap.
+ *
+ * Since no space is reserved up front, running out of disk shows up
+ * at flush time. All of these need sv_rwlock; exclusively except for
+ * sfs_delay_lookup.
+ */
+
+/*
+ * Return the data written to FILEBLOCK of SV if it is waiting for a
+ * disk block, or NULL.
+ */
+void *
+sfs_delay_lookup(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_dblock *db;
+
+	for (db = sv->sv_delayed; db != NULL; db = db->db_next) {
+		if (db->db_fileblock == fileblock) {
+			return db->db_data;
+		}
+		if (db->db_fileblock > fileblock) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get the data for FILEBLOCK of SV, which has no disk block, to write
+ * into: the waiting copy if there is one, otherwise a new zeroed one.
+ * If SV already has SFS_DELAYMAX blocks waiting, they're flushed
+ * first.
+ */
+int
+sfs_delay_get(struct sfs_vnode *sv, uint32_t fileblock, void **ret)
+{
+	struct sfs_dblock *db, **dbp;
+	int result;
+
+	*ret = sfs_delay_lookup(sv, fileblock);
+	if (*ret != NULL) {
+		return 0;
+	}
+
+	if (sv->sv_ndelayed >= SFS_DELAYMAX) {
+		result = sfs_delay_flush(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	db = kmalloc(sizeof(*db));
+	if (db == NULL) {
+		return ENOMEM;
+	}
+	db->db_fileblock = fileblock;
+	bzero(db->db_data, SFS_BLOCKSIZE);
+
+	for (dbp = &sv->sv_delayed; *dbp != NULL; dbp = &(*dbp)->db_next) {
+		if ((*dbp)->db_fileblock > fileblock) {
+			break;
+		}
+	}
+	db->db_next = *dbp;
+	*dbp = db;
+	sv->sv_ndelayed++;
+
+	*ret = db->db_data;
+	return 0;
+}
+
+/*
+ * Allocate disk blocks for everything SV has waiting and put the data
+ * in the buffer cache, dirty. On failure the blocks not yet done are
+ * still waiting.
+ */
+int
+sfs_delay_flush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dblock *db;
+	daddr_t block;
+	int result;
+
+	while ((db = sv->sv_delayed) != NULL) {
+		result = sfs_bmap(sv, db->db_fileblock, true, &block);
+		if (result) {
+			return result;
+		}
+		result = sfs_writeblock(sfs, block, db->db_data,
+					SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+		sv->sv_delayed = db->db_next;
+		sv->sv_ndelayed--;
+		kfree(db);
+	}
+	return 0;
+}
+
+/*
+ * Drop whatever SV has waiting at or past file block BLOCKLEN, for
+ * truncate.
+ */
+void
+sfs_delay_trunc(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_dblock *db, **dbp;
+
+	dbp = &sv->sv_delayed;
+	while (*dbp != NULL && (*dbp)->db_fileblock < blocklen) {
+		dbp = &(*dbp)->db_next;
+	}
+	while ((db = *dbp) != NULL) {
+		*dbp = db->db_next;
+		sv->sv_ndelayed--;
+		kfree(db);
+	}
+}
+
 /*
  * Free a block.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	/*
+	 * Don't bother writing back what's cached for it. This has to
+	 * happen before the block goes back in the freemap, or it
+	 * could be reallocated and lose its new contents.
+	 */
+	sfs_binval(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +374,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
@@ -44,30 +44,22 @@
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * The caller must hold sv_rwlock; exclusively if DOALLOC is set.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
 	daddr_t block;
 	daddr_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +74,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc_file(sv, fileblock, &block);
 			if (result) {
 				return result;
 			}
@@ -143,7 +135,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * the indirect block. Thus, we need to allocate an
 		 * indirect block.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		result = sfs_balloc(sfs, sv->sv_goal != 0 ?
+				    sv->sv_goal : sv->sv_ino + 1, &idblock);
 		if (result) {
 			return result;
 		}
@@ -154,38 +147,34 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* (sfs_balloc has already zeroed it) */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+
+	/* Load the indirect block; we work on it in the cache. */
+	result = sfs_bread(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
 	}
+	iddata = sfs_bdata(idbuf);
 
 	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	block = iddata[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = sfs_balloc_file(sv, SFS_NDIRECT + fileblock, &block);
 		if (result) {
+			sfs_brelse(sfs, idbuf);
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		iddata[idoff] = block;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+		/* The indirect block is now dirty */
+		sfs_bdirty(sfs, idbuf);
 	}
+	sfs_brelse(sfs, idbuf);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -198,34 +187,28 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate() and from sfs_reclaim. The caller must hold
+ * sv_rwlock exclusively (or, in reclaim, be the last user).
  */
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
 	uint32_t i, j;
 	daddr_t block, idblock;
 	uint32_t baseblock, highblock;
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
+	/* Any blocks reserved or waiting past the new end are no use now */
+	sfs_prealloc_release(sv);
+	sfs_delay_trunc(sv, blocklen);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -253,41 +236,40 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		/* We're past the proposed EOF; may need to free stuff */
 
 		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_bread(sfs, idblock, &idbuf);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+		iddata = sfs_bdata(idbuf);
 
 		hasnonzero = 0;
 		iddirty = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
 			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
+			if (blocklen < baseblock+j && iddata[j] != 0) {
+				sfs_bfree(sfs, iddata[j]);
+				iddata[j] = 0;
 				iddirty = 1;
 			}
 			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
+			if (iddata[j]!=0) {
 				hasnonzero=1;
 			}
 		}
 
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
+			sfs_brelse(sfs, idbuf);
 			sfs_bfree(sfs, idblock);
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
+		else {
+			if (iddirty) {
+				/* The indirect block is dirty */
+				sfs_bdirty(sfs, idbuf);
 			}
+			sfs_brelse(sfs, idbuf);
 		}
 	}
 
@@ -297,7 +279,6 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -0,0 +1,1029 @@
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ *
+ * Each volume caches up to SFS_CACHE_NBUFS blocks. Buffers are found
+ * by block number through a hash table. A buffer is referenced by
+ * whoever has it from sfs_bread/sfs_bget until sfs_brelse; buffers
+ * nobody references are kept on an LRU list and the least recently
+ * released one is reused when the cache is full. Writes only mark the
+ * buffer dirty and put it on the dirty list; dirty buffers go to disk
+ * when they're reused, when the volume is synced (which the VFS
+ * syncer does every few seconds), or when fsync asks for them.
+ * Flushes sort what they write and send adjacent blocks to the
+ * device as one request.
+ *
+ * The cache lock protects the hash table, the lists and the buffer
+ * headers, but not the data: that's up to the file system's own
+ * locking, as it is for the on-disk blocks. The lock is not held
+ * during I/O; a buffer being read or written is marked busy instead
+ * and anyone else wanting it waits on the cache's cv.
+ *
+ * Read-ahead doesn't wait for its reads. They finish in the device's
+ * interrupt handler, which can't take the cache lock, so completed
+ * reads are queued under a spinlock and finished off (the buffers
+ * made valid and not busy) by sfs_cache_reap the next time someone
+ * has the lock. Anyone wanting a buffer that's being read ahead waits
+ * on the read-ahead wchan rather than the cv.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+#define SFS_CACHE_NBUFS    256	/* most buffers per volume */
+#define SFS_CACHE_HASHSIZE 64	/* hash chains; a power of 2 */
+
+#define SFS_CACHE_HASH(block) ((block) & (SFS_CACHE_HASHSIZE - 1))
+
+struct sfs_buf {
+	daddr_t b_block;		/* disk block number */
+	unsigned b_refcount;		/* holders */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data newer than the disk */
+	bool b_busy;			/* I/O in progress */
+	bool b_async;			/* being read ahead; see sfs_raio */
+	bool b_writing;			/* being written back */
+	unsigned b_dirtygen;		/* sc_syncgen when it got dirty */
+	unsigned b_writegen;		/* b_dirtygen of what's being written */
+	struct sfs_buf *b_hashnext;	/* hash chain */
+	struct sfs_buf *b_lruprev;	/* LRU list, if unreferenced */
+	struct sfs_buf *b_lrunext;
+	struct sfs_buf *b_dirtyprev;	/* dirty list, if dirty */
+	struct sfs_buf *b_dirtynext;
+	char *b_data;			/* SFS_BLOCKSIZE bytes */
+};
+
+/*
+ * A read-ahead read of a run of adjacent blocks. Its buffers are
+ * referenced, busy and b_async until it is reaped. b_async is only
+ * cleared with sc_ralock held as well as the cache lock.
+ */
+struct sfs_raio {
+	struct sfs_cache *ra_cache;
+	struct sfs_buf *ra_bufs[SFS_RA_MAXBLOCKS];
+	unsigned ra_nbufs;
+	struct iovec ra_iov[SFS_RA_MAXBLOCKS];
+	struct uio ra_uio;
+	int ra_result;
+	struct sfs_raio *ra_next;	/* runs being set up; sc_radone */
+};
+
+struct sfs_cache {
+	struct lock *sc_lock;
+	struct cv *sc_cv;		/* a buffer stopped being busy */
+	struct spinlock sc_ralock;	/* protects the next three */
+	struct wchan *sc_rawchan;	/* a read-ahead read finished */
+	struct sfs_raio *sc_radone;	/* finished, not yet reaped */
+	unsigned sc_rapending;		/* started, not yet reaped */
+	struct sfs_buf *sc_hash[SFS_CACHE_HASHSIZE];
+	struct sfs_buf *sc_lruhead;	/* least recently released */
+	struct sfs_buf *sc_lrutail;
+	struct sfs_buf *sc_dirty;
+	unsigned sc_syncgen;		/* sfs_cache_sync passes begun */
+	unsigned sc_nbufs;		/* buffers allocated */
+	unsigned sc_hits;
+	unsigned sc_misses;
+	unsigned sc_readahead;		/* blocks read ahead */
+};
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+void
+sfs_cache_lru_remove(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(sc->sc_lruhead == b);
+		sc->sc_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(sc->sc_lrutail == b);
+		sc->sc_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+sfs_cache_lru_append(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = sc->sc_lrutail;
+	if (sc->sc_lrutail != NULL) {
+		sc->sc_lrutail->b_lrunext = b;
+	}
+	else {
+		sc->sc_lruhead = b;
+	}
+	sc->sc_lrutail = b;
+}
+
+static
+void
+sfs_cache_setdirty(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	if (b->b_dirty) {
+		return;
+	}
+	b->b_dirty = true;
+	b->b_dirtygen = sc->sc_syncgen;
+	b->b_dirtyprev = NULL;
+	b->b_dirtynext = sc->sc_dirty;
+	if (sc->sc_dirty != NULL) {
+		sc->sc_dirty->b_dirtyprev = b;
+	}
+	sc->sc_dirty = b;
+}
+
+static
+void
+sfs_cache_setclean(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	if (!b->b_dirty) {
+		return;
+	}
+	b->b_dirty = false;
+	if (b->b_dirtyprev != NULL) {
+		b->b_dirtyprev->b_dirtynext = b->b_dirtynext;
+	}
+	else {
+		sc->sc_dirty = b->b_dirtynext;
+	}
+	if (b->b_dirtynext != NULL) {
+		b->b_dirtynext->b_dirtyprev = b->b_dirtyprev;
+	}
+	b->b_dirtyprev = b->b_dirtynext = NULL;
+}
+
+/*
+ * Start writing back dirty buffer B: it's clean from here on unless
+ * the write fails, but sync and fsync still have to wait for it. The
+ * caller marks it busy.
+ */
+static
+void
+sfs_cache_startwrite(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	KASSERT(b->b_dirty);
+	KASSERT(!b->b_writing);
+
+	b->b_writing = true;
+	b->b_writegen = b->b_dirtygen;
+	sfs_cache_setclean(sc, b);
+}
+
+/*
+ * Finish writing back B; if the write failed, it's dirty again, as
+ * of when it first got dirty, so a sync pass already running still
+ * counts it as its own.
+ */
+static
+void
+sfs_cache_endwrite(struct sfs_cache *sc, struct sfs_buf *b, bool failed)
+{
+	KASSERT(b->b_writing);
+
+	b->b_writing = false;
+	if (failed) {
+		sfs_cache_setdirty(sc, b);
+		b->b_dirtygen = b->b_writegen;
+	}
+}
+
+static
+struct sfs_buf *
+sfs_cache_lookup(struct sfs_cache *sc, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = sc->sc_hash[SFS_CACHE_HASH(block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_cache_unhash(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	struct sfs_buf **bp;
+
+	for (bp = &sc->sc_hash[SFS_CACHE_HASH(b->b_block)]; *bp != b;
+	     bp = &(*bp)->b_hashnext) {
+		KASSERT(*bp != NULL);
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Buffers
+
+static
+void
+sfs_cache_unref(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		sfs_cache_lru_append(sc, b);
+	}
+}
+
+/*
+ * Finish off read-ahead reads that have completed: their buffers
+ * become valid (if the read worked) and stop being busy, and the
+ * read-ahead's references are dropped. Called with the cache lock
+ * held.
+ */
+static
+void
+sfs_cache_reap(struct sfs_cache *sc)
+{
+	struct sfs_raio *ra, *done;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sc->sc_lock));
+
+	spinlock_acquire(&sc->sc_ralock);
+	done = sc->sc_radone;
+	sc->sc_radone = NULL;
+	for (ra = done; ra != NULL; ra = ra->ra_next) {
+		for (i=0; i<ra->ra_nbufs; i++) {
+			ra->ra_bufs[i]->b_valid = (ra->ra_result == 0);
+			ra->ra_bufs[i]->b_async = false;
+			ra->ra_bufs[i]->b_busy = false;
+		}
+		KASSERT(sc->sc_rapending > 0);
+		sc->sc_rapending--;
+	}
+	if (done != NULL) {
+		wchan_wakeall(sc->sc_rawchan, &sc->sc_ralock);
+	}
+	spinlock_release(&sc->sc_ralock);
+
+	if (done == NULL) {
+		return;
+	}
+	while ((ra = done) != NULL) {
+		done = ra->ra_next;
+		for (i=0; i<ra->ra_nbufs; i++) {
+			sfs_cache_unref(sc, ra->ra_bufs[i]);
+		}
+		kfree(ra);
+	}
+	cv_broadcast(sc->sc_cv, sc->sc_lock);
+}
+
+/*
+ * Wait until the read-ahead B belongs to has finished, or at least
+ * until there's some finished read-ahead to reap, and reap it. B is
+ * referenced, so it stays put while the cache lock is dropped.
+ */
+static
+void
+sfs_cache_rawait(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	lock_release(sc->sc_lock);
+	spinlock_acquire(&sc->sc_ralock);
+	while (b->b_async && sc->sc_radone == NULL) {
+		wchan_sleep(sc->sc_rawchan, &sc->sc_ralock);
+	}
+	spinlock_release(&sc->sc_ralock);
+	lock_acquire(sc->sc_lock);
+	sfs_cache_reap(sc);
+}
+
+/*
+ * Take a reference to B, which must be in the cache, and wait for any
+ * I/O on it to finish.
+ */
+static
+void
+sfs_cache_ref(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	if (b->b_refcount == 0) {
+		sfs_cache_lru_remove(sc, b);
+	}
+	b->b_refcount++;
+	while (b->b_busy) {
+		if (b->b_async) {
+			sfs_cache_rawait(sc, b);
+		}
+		else {
+			cv_wait(sc->sc_cv, sc->sc_lock);
+		}
+	}
+}
+
+/*
+ * Do I/O on B, which the caller references, without the cache lock
+ * held.
+ */
+static
+int
+sfs_cache_io(struct sfs_fs *sfs, struct sfs_buf *b, enum uio_rw rw)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+	int result;
+
+	KASSERT(b->b_refcount > 0);
+	KASSERT(!b->b_busy);
+
+	b->b_busy = true;
+	lock_release(sc->sc_lock);
+
+	if (rw == UIO_READ) {
+		result = sfs_devread(sfs, b->b_block, b->b_data);
+	}
+	else {
+		result = sfs_devwrite(sfs, b->b_block, b->b_data);
+	}
+
+	lock_acquire(sc->sc_lock);
+	b->b_busy = false;
+	cv_broadcast(sc->sc_cv, sc->sc_lock);
+	return result;
+}
+
+static
+void
+sfs_cache_freebuf(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	kfree(b->b_data);
+	kfree(b);
+	sc->sc_nbufs--;
+}
+
+/*
+ * Get an unused buffer: a new one if we're below the limit, otherwise
+ * the least recently used one, written back first if it's dirty.
+ * Returns with the buffer out of the hash table and referenced.
+ */
+static
+int
+sfs_cache_getfree(struct sfs_fs *sfs, struct sfs_buf **ret)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+	struct sfs_buf *b;
+	int result;
+
+	if (sc->sc_nbufs < SFS_CACHE_NBUFS) {
+		b = kmalloc(sizeof(*b));
+		if (b != NULL) {
+			b->b_data = kmalloc(SFS_BLOCKSIZE);
+			if (b->b_data == NULL) {
+				kfree(b);
+				b = NULL;
+			}
+		}
+		if (b != NULL) {
+			sc->sc_nbufs++;
+			b->b_refcount = 1;
+			b->b_dirty = false;
+			b->b_busy = false;
+			b->b_async = false;
+			b->b_writing = false;
+			b->b_hashnext = NULL;
+			b->b_lruprev = b->b_lrunext = NULL;
+			b->b_dirtyprev = b->b_dirtynext = NULL;
+			*ret = b;
+			return 0;
+		}
+	}
+
+	while (1) {
+		b = sc->sc_lruhead;
+		if (b == NULL) {
+			/* everything is in use */
+			return ENOMEM;
+		}
+
+		sfs_cache_ref(sc, b);
+		if (b->b_dirty) {
+			sfs_cache_startwrite(sc, b);
+			result = sfs_cache_io(sfs, b, UIO_WRITE);
+			sfs_cache_endwrite(sc, b, result != 0);
+			if (result) {
+				sfs_cache_unref(sc, b);
+				return result;
+			}
+		}
+
+		/* someone may have found it while we were writing it */
+		if (b->b_refcount == 1 && !b->b_dirty) {
+			break;
+		}
+		sfs_cache_unref(sc, b);
+	}
+
+	sfs_cache_unhash(sc, b);
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Common code for sfs_bread and sfs_bget.
+ */
+static
+int
+sfs_cache_get(struct sfs_fs *sfs, daddr_t block, bool doread,
+	      struct sfs_buf **ret)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+	struct sfs_buf *b;
+	int result;
+
+	lock_acquire(sc->sc_lock);
+	sfs_cache_reap(sc);
+
+	b = sfs_cache_lookup(sc, block);
+	if (b != NULL) {
+		sfs_cache_ref(sc, b);
+		sc->sc_hits++;
+	}
+	else {
+		result = sfs_cache_getfree(sfs, &b);
+		if (result) {
+			lock_release(sc->sc_lock);
+			return result;
+		}
+
+		/* getfree may have slept; someone else may have loaded it */
+		if (sfs_cache_lookup(sc, block) != NULL) {
+			sfs_cache_freebuf(sc, b);
+			lock_release(sc->sc_lock);
+			return sfs_cache_get(sfs, block, doread, ret);
+		}
+
+		b->b_block = block;
+		b->b_valid = false;
+		b->b_hashnext = sc->sc_hash[SFS_CACHE_HASH(block)];
+		sc->sc_hash[SFS_CACHE_HASH(block)] = b;
+		sc->sc_misses++;
+	}
+
+	if (!b->b_valid) {
+		if (doread) {
+			result = sfs_cache_io(sfs, b, UIO_READ);
+			if (result) {
+				sfs_cache_unref(sc, b);
+				lock_release(sc->sc_lock);
+				return result;
+			}
+		}
+		else {
+			/*
+			 * The caller is about to fill it. Don't let it
+			 * see the block that was here before if it fails
+			 * part way.
+			 */
+			bzero(b->b_data, SFS_BLOCKSIZE);
+		}
+		b->b_valid = true;
+	}
+
+	lock_release(sc->sc_lock);
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get the buffer for BLOCK, reading it from disk if it isn't cached.
+ */
+int
+sfs_bread(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	return sfs_cache_get(sfs, block, true, ret);
+}
+
+/*
+ * Get the buffer for BLOCK without reading it, for a caller that is
+ * going to overwrite the whole block.
+ */
+int
+sfs_bget(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	return sfs_cache_get(sfs, block, false, ret);
+}
+
+void *
+sfs_bdata(struct sfs_buf *b)
+{
+	return b->b_data;
+}
+
+/*
+ * Mark B as modified. It will be written back later.
+ */
+void
+sfs_bdirty(struct sfs_fs *sfs, struct sfs_buf *b)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+
+	KASSERT(b->b_refcount > 0);
+
+	lock_acquire(sc->sc_lock);
+	sfs_cache_setdirty(sc, b);
+	lock_release(sc->sc_lock);
+}
+
+/*
+ * Drop a reference obtained from sfs_bread or sfs_bget.
+ */
+void
+sfs_brelse(struct sfs_fs *sfs, struct sfs_buf *b)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+
+	lock_acquire(sc->sc_lock);
+	sfs_cache_unref(sc, b);
+	lock_release(sc->sc_lock);
+}
+
+/*
+ * BLOCK has been freed: there's no point writing back whatever we
+ * have cached for it.
+ */
+void
+sfs_binval(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+	struct sfs_buf *b;
+
+	lock_acquire(sc->sc_lock);
+	b = sfs_cache_lookup(sc, block);
+	if (b != NULL && !b->b_busy) {
+		sfs_cache_setclean(sc, b);
+	}
+	lock_release(sc->sc_lock);
+}
+
+/*
+ * Read-ahead completion, called by the device, maybe from its
+ * interrupt handler: no sleeping, so no cache lock. Queue RA for
+ * sfs_cache_reap and wake anyone waiting for one of its buffers.
+ */
+static
+void
+sfs_cache_radone(void *arg, int result)
+{
+	struct sfs_raio *ra = arg;
+	struct sfs_cache *sc = ra->ra_cache;
+
+	spinlock_acquire(&sc->sc_ralock);
+	ra->ra_result = result;
+	ra->ra_next = sc->sc_radone;
+	sc->sc_radone = ra;
+	wchan_wakeall(sc->sc_rawchan, &sc->sc_ralock);
+	spinlock_release(&sc->sc_ralock);
+}
+
+/*
+ * Start the read-ahead read RA, without the cache lock. If the device
+ * won't take it asynchronously, do it now instead.
+ */
+static
+void
+sfs_cache_rastart(struct sfs_fs *sfs, struct sfs_raio *ra)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+	void *data[SFS_RA_MAXBLOCKS];
+	daddr_t block = ra->ra_bufs[0]->b_block;
+	unsigned i;
+	int result;
+
+	for (i=0; i<ra->ra_nbufs; i++) {
+		data[i] = ra->ra_bufs[i]->b_data;
+	}
+
+	spinlock_acquire(&sc->sc_ralock);
+	sc->sc_rapending++;
+	spinlock_release(&sc->sc_ralock);
+
+	result = sfs_devreadv_async(sfs, block, data, ra->ra_nbufs,
+				    ra->ra_iov, &ra->ra_uio,
+				    sfs_cache_radone, ra);
+	if (result) {
+		result = sfs_devreadv(sfs, block, data, ra->ra_nbufs);
+		sfs_cache_radone(ra, result);
+	}
+}
+
+/*
+ * Start loading the N blocks in BLOCKS into the cache if they aren't
+ * there already, for read-ahead. Zero entries (holes) are skipped.
+ * Runs of consecutive blocks are read with one request each, and we
+ * don't wait for them: the device queues them behind reads someone
+ * is waiting for, and the buffers stay busy until they arrive.
+ *
+ * Once read, the buffers are left unreferenced, so they stay only if
+ * someone uses them before they reach the head of the LRU list.
+ * Errors are dropped; whoever wants a block that failed will read it
+ * again.
+ */
+void
+sfs_bprefetch(struct sfs_fs *sfs, const daddr_t *blocks, unsigned n)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+	struct sfs_raio *runs, *ra;
+	struct sfs_buf *b;
+	unsigned i;
+
+	KASSERT(n <= SFS_RA_MAXBLOCKS);
+
+	/* Set up busy buffers for whatever isn't cached, grouped in runs */
+	lock_acquire(sc->sc_lock);
+	sfs_cache_reap(sc);
+	runs = ra = NULL;
+	for (i=0; i<n; i++) {
+		if (blocks[i] == 0 || sfs_cache_lookup(sc, blocks[i]) != NULL) {
+			continue;
+		}
+		if (ra != NULL && ra->ra_nbufs > 0 &&
+		    blocks[i] != ra->ra_bufs[ra->ra_nbufs - 1]->b_block + 1) {
+			ra = NULL;
+		}
+		if (ra == NULL) {
+			ra = kmalloc(sizeof(*ra));
+			if (ra == NULL) {
+				break;
+			}
+			ra->ra_cache = sc;
+			ra->ra_nbufs = 0;
+			ra->ra_next = runs;
+			runs = ra;
+		}
+		if (sfs_cache_getfree(sfs, &b)) {
+			break;
+		}
+		if (sfs_cache_lookup(sc, blocks[i]) != NULL) {
+			/* someone loaded it while getfree slept */
+			sfs_cache_freebuf(sc, b);
+			continue;
+		}
+		b->b_block = blocks[i];
+		b->b_valid = false;
+		b->b_busy = true;
+		b->b_async = true;
+		b->b_hashnext = sc->sc_hash[SFS_CACHE_HASH(b->b_block)];
+		sc->sc_hash[SFS_CACHE_HASH(b->b_block)] = b;
+		sc->sc_readahead++;
+		ra->ra_bufs[ra->ra_nbufs++] = b;
+	}
+	lock_release(sc->sc_lock);
+
+	while ((ra = runs) != NULL) {
+		runs = ra->ra_next;
+		if (ra->ra_nbufs == 0) {
+			kfree(ra);
+			continue;
+		}
+		sfs_cache_rastart(sfs, ra);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Whole cache
+
+/*
+ * Claim dirty buffer B, which the caller references and which isn't
+ * busy, for writing: mark it busy and start the write-back.
+ */
+static
+void
+sfs_cache_claim(struct sfs_cache *sc, struct sfs_buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	KASSERT(!b->b_busy);
+
+	b->b_busy = true;
+	sfs_cache_startwrite(sc, b);
+}
+
+/*
+ * Check whether any buffer that was dirty as of sync pass GEN is
+ * still being written back by someone else.
+ */
+static
+bool
+sfs_cache_writing(struct sfs_cache *sc, unsigned gen)
+{
+	struct sfs_buf *b;
+	unsigned i;
+
+	for (i=0; i<SFS_CACHE_HASHSIZE; i++) {
+		for (b = sc->sc_hash[i]; b != NULL; b = b->b_hashnext) {
+			if (b->b_writing && (int)(b->b_writegen - gen) <= 0) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ * Write the N buffers in BUFS, which the caller has claimed. They're
+ * sorted first, and each run of adjacent blocks goes out in one
+ * request. The cache lock is dropped during the I/O. Buffers that
+ * fail to write are put back on the dirty list (see endwrite). The
+ * references are released.
+ */
+static
+int
+sfs_cache_writebatch(struct sfs_fs *sfs, struct sfs_buf **bufs, unsigned n)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+	void *data[SFS_MAXCLUSTER];
+	bool failed[SFS_MAXCLUSTER];
+	struct sfs_buf *b;
+	unsigned i, j;
+	int result, ret = 0;
+
+	KASSERT(n <= SFS_MAXCLUSTER);
+
+	/* Insertion sort by block number; N is small */
+	for (i=1; i<n; i++) {
+		b = bufs[i];
+		for (j=i; j>0 && bufs[j-1]->b_block > b->b_block; j--) {
+			bufs[j] = bufs[j-1];
+		}
+		bufs[j] = b;
+	}
+
+	lock_release(sc->sc_lock);
+	for (i=0; i<n; i=j) {
+		data[0] = bufs[i]->b_data;
+		for (j=i+1; j<n; j++) {
+			if (bufs[j]->b_block != bufs[j-1]->b_block + 1) {
+				break;
+			}
+			data[j-i] = bufs[j]->b_data;
+		}
+		result = sfs_devwritev(sfs, bufs[i]->b_block, data, j-i);
+		if (result) {
+			ret = result;
+		}
+		while (i < j) {
+			failed[i++] = (result != 0);
+		}
+	}
+	lock_acquire(sc->sc_lock);
+
+	for (i=0; i<n; i++) {
+		bufs[i]->b_busy = false;
+		sfs_cache_endwrite(sc, bufs[i], failed[i]);
+		sfs_cache_unref(sc, bufs[i]);
+	}
+	cv_broadcast(sc->sc_cv, sc->sc_lock);
+	return ret;
+}
+
+/*
+ * Write back every buffer that was dirty when we started, and wait
+ * for any of those someone else is already writing (which might
+ * fail and come back). Buffers dirtied while we're at it are left
+ * for next time, so a steady writer can't keep us here forever.
+ */
+int
+sfs_cache_sync(struct sfs_fs *sfs)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+	struct sfs_buf *bufs[SFS_MAXCLUSTER];
+	struct sfs_buf *b;
+	unsigned i, n, gen;
+	bool waiting;
+	int result = 0;
+
+	lock_acquire(sc->sc_lock);
+	gen = sc->sc_syncgen++;
+	while (1) {
+		/* Skip buffers someone else is doing I/O on */
+		n = 0;
+		waiting = false;
+		for (b = sc->sc_dirty; b != NULL && n < SFS_MAXCLUSTER;
+		     b = b->b_dirtynext) {
+			if ((int)(b->b_dirtygen - gen) > 0) {
+				/* dirtied since we started */
+				continue;
+			}
+			if (b->b_busy) {
+				waiting = true;
+				continue;
+			}
+			if (b->b_refcount == 0) {
+				sfs_cache_lru_remove(sc, b);
+			}
+			b->b_refcount++;
+			bufs[n++] = b;
+		}
+		if (n == 0) {
+			if (!waiting && !sfs_cache_writing(sc, gen)) {
+				break;
+			}
+			/* The rest are busy; wait and look again */
+			cv_wait(sc->sc_cv, sc->sc_lock);
+			continue;
+		}
+		/* (claiming takes them off the list, so do it after) */
+		for (i=0; i<n; i++) {
+			sfs_cache_claim(sc, bufs[i]);
+		}
+
+		result = sfs_cache_writebatch(sfs, bufs, n);
+		if (result) {
+			break;
+		}
+	}
+	lock_release(sc->sc_lock);
+
+	return result;
+}
+
+/*
+ * Write back whichever of the N blocks in BLOCKS are dirty, for
+ * fsync. BLOCKS is sorted in place; zero entries are skipped.
+ */
+int
+sfs_bflush(struct sfs_fs *sfs, daddr_t *blocks, unsigned n)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+	struct sfs_buf *bufs[SFS_MAXCLUSTER];
+	struct sfs_buf *b;
+	unsigned i, j, nbufs;
+	daddr_t block;
+	int result, ret = 0;
+
+	for (i=1; i<n; i++) {
+		block = blocks[i];
+		for (j=i; j>0 && blocks[j-1] > block; j--) {
+			blocks[j] = blocks[j-1];
+		}
+		blocks[j] = block;
+	}
+
+	lock_acquire(sc->sc_lock);
+	nbufs = 0;
+	for (i=0; i<n; i++) {
+		if (blocks[i] == 0) {
+			continue;
+		}
+		b = sfs_cache_lookup(sc, blocks[i]);
+		/* One being written back might fail, so wait for it */
+		if (b == NULL || (!b->b_dirty && !b->b_writing)) {
+			continue;
+		}
+		if (b->b_busy && nbufs > 0) {
+			/*
+			 * Don't wait for it while holding busy buffers
+			 * of our own; whoever has it may be waiting for
+			 * one of those.
+			 */
+			result = sfs_cache_writebatch(sfs, bufs, nbufs);
+			if (result) {
+				ret = result;
+			}
+			nbufs = 0;
+		}
+		sfs_cache_ref(sc, b);
+		if (!b->b_dirty) {
+			/* someone wrote it while we waited */
+			sfs_cache_unref(sc, b);
+			continue;
+		}
+		sfs_cache_claim(sc, b);
+		bufs[nbufs++] = b;
+		if (nbufs == SFS_MAXCLUSTER) {
+			result = sfs_cache_writebatch(sfs, bufs, nbufs);
+			if (result) {
+				ret = result;
+			}
+			nbufs = 0;
+		}
+	}
+	if (nbufs > 0) {
+		result = sfs_cache_writebatch(sfs, bufs, nbufs);
+		if (result) {
+			ret = result;
+		}
+	}
+	lock_release(sc->sc_lock);
+
+	return ret;
+}
+
+int
+sfs_cache_create(struct sfs_fs *sfs)
+{
+	struct sfs_cache *sc;
+	unsigned i;
+
+	sc = kmalloc(sizeof(*sc));
+	if (sc == NULL) {
+		return ENOMEM;
+	}
+
+	sc->sc_lock = lock_create("sfs_cache");
+	if (sc->sc_lock == NULL) {
+		kfree(sc);
+		return ENOMEM;
+	}
+	sc->sc_cv = cv_create("sfs_cache");
+	if (sc->sc_cv == NULL) {
+		lock_destroy(sc->sc_lock);
+		kfree(sc);
+		return ENOMEM;
+	}
+	sc->sc_rawchan = wchan_create("sfs_cache");
+	if (sc->sc_rawchan == NULL) {
+		cv_destroy(sc->sc_cv);
+		lock_destroy(sc->sc_lock);
+		kfree(sc);
+		return ENOMEM;
+	}
+	spinlock_init(&sc->sc_ralock);
+	sc->sc_radone = NULL;
+	sc->sc_rapending = 0;
+
+	for (i=0; i<SFS_CACHE_HASHSIZE; i++) {
+		sc->sc_hash[i] = NULL;
+	}
+	sc->sc_lruhead = sc->sc_lrutail = NULL;
+	sc->sc_dirty = NULL;
+	sc->sc_syncgen = 0;
+	sc->sc_nbufs = 0;
+	sc->sc_hits = 0;
+	sc->sc_misses = 0;
+	sc->sc_readahead = 0;
+
+	sfs->sfs_cache = sc;
+	return 0;
+}
+
+/*
+ * Free the cache. It must have been synced and nothing may still
+ * reference any buffer.
+ */
+void
+sfs_cache_destroy(struct sfs_fs *sfs)
+{
+	struct sfs_cache *sc = sfs->sfs_cache;
+	struct sfs_buf *b;
+
+	KASSERT(sc->sc_dirty == NULL);
+
+	/* Wait out any read-ahead still in flight */
+	lock_acquire(sc->sc_lock);
+	while (1) {
+		sfs_cache_reap(sc);
+		spinlock_acquire(&sc->sc_ralock);
+		if (sc->sc_rapending == 0) {
+			spinlock_release(&sc->sc_ralock);
+			break;
+		}
+		while (sc->sc_radone == NULL) {
+			wchan_sleep(sc->sc_rawchan, &sc->sc_ralock);
+		}
+		spinlock_release(&sc->sc_ralock);
+	}
+	lock_release(sc->sc_lock);
+
+	DEBUG(DB_SFS, "sfs: buffer cache: %u hits, %u misses, "
+	      "%u blocks read ahead\n",
+	      sc->sc_hits, sc->sc_misses, sc->sc_readahead);
+
+	while ((b = sc->sc_lruhead) != NULL) {
+		KASSERT(b->b_refcount == 0);
+		sfs_cache_lru_remove(sc, b);
+		sfs_cache_freebuf(sc, b);
+	}
+	KASSERT(sc->sc_nbufs == 0);
+
+	spinlock_cleanup(&sc->sc_ralock);
+	wchan_destroy(sc->sc_rawchan);
+	cv_destroy(sc->sc_cv);
+	lock_destroy(sc->sc_lock);
+	kfree(sc);
+	sfs->sfs_cache = NULL;
+}
@@ -96,13 +96,88 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * How many blocks past its home block an insert into a hashed
+ * directory may go before the directory is grown instead.
+ */
+#define SFS_DIRHASH_MAXPROBE 4
+
+/*
+ * A linear directory that is full and at least this many blocks long
+ * is converted to a hashed one instead of being extended.
+ */
+#define SFS_DIRHASH_MINBLOCKS 1
+
+/* The largest a directory can be, in blocks. */
+#define SFS_DIR_MAXBLOCKS (SFS_NDIRECT + SFS_NINDIRECT * SFS_DBPERIDB)
+
+/*
+ * Hash a name (see <kern/sfs.h>).
+ */
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_BASIS;
+
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * SFS_DIRHASH_PRIME;
+	}
+	return h;
+}
+
+/*
+ * Check if a directory entry (which might not be null-terminated)
+ * has the name NAME.
+ */
+static
+bool
+sfs_dir_namematch(const struct sfs_direntry *sd, const char *name)
+{
+	size_t i;
+
+	for (i=0; i<sizeof(sd->sfd_name); i++) {
+		if (sd->sfd_name[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Get block BLOCK of directory SV from the buffer cache. If the block
+ * is a hole (and DOALLOC is false), hand back NULL.
  */
+static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_getblock(struct sfs_vnode *sv, uint32_t block, bool doalloc,
+		 struct sfs_buf **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t diskblock;
+	int result;
+
+	result = sfs_bmap(sv, block, doalloc, &diskblock);
+	if (result) {
+		return result;
+	}
+	if (diskblock == 0) {
+		*ret = NULL;
+		return 0;
+	}
+	return sfs_bread(sfs, diskblock, ret);
+}
+
+/*
+ * Search a linear directory. This is the original SFS directory
+ * format; see sfs_dir_findname.
+ */
+static
+int
+sfs_dir_linearfind(struct sfs_vnode *sv, const char *name,
+		   uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
@@ -146,14 +221,261 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Search a hashed directory. Only the name's home block and the
+ * sfi_dirprobe blocks after it can hold the name; when looking for
+ * an empty slot we may go up to SFS_DIRHASH_MAXPROBE blocks.
+ */
+static
+int
+sfs_dir_hashfind(struct sfs_vnode *sv, const char *name,
+		 uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	struct sfs_direntry *sds;
+	uint32_t nblocks, home, block, probe, maxprobe, limit, i;
+	bool found, haveempty;
+	int result;
+
+	nblocks = sv->sv_i.sfi_size / SFS_BLOCKSIZE;
+	if (nblocks == 0 || sv->sv_i.sfi_size % SFS_BLOCKSIZE != 0) {
+		panic("sfs: %s: hashed directory %u: Invalid size %u\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino,
+		      sv->sv_i.sfi_size);
+	}
+
+	home = sfs_dirhash(name) % nblocks;
+	maxprobe = sv->sv_i.sfi_dirprobe;
+	limit = maxprobe;
+	if (emptyslot != NULL) {
+		if (nblocks >= SFS_DIR_MAXBLOCKS) {
+			/* Can't grow any more; use any free slot */
+			limit = nblocks - 1;
+		}
+		else if (limit < SFS_DIRHASH_MAXPROBE) {
+			limit = SFS_DIRHASH_MAXPROBE;
+		}
+	}
+	if (limit >= nblocks) {
+		limit = nblocks - 1;
+	}
+
+	found = haveempty = false;
+	for (probe = 0; probe <= limit; probe++) {
+		if (probe > maxprobe && (emptyslot == NULL || haveempty)) {
+			break;
+		}
+
+		block = (home + probe) % nblocks;
+		result = sfs_dir_getblock(sv, block, false, &buf);
+		if (result) {
+			return result;
+		}
+		if (buf == NULL) {
+			/* A hole is all free slots */
+			if (emptyslot != NULL && !haveempty) {
+				*emptyslot = block * SFS_DIRENTRIES_PER_BLOCK;
+				haveempty = true;
+			}
+			continue;
+		}
+
+		sds = sfs_bdata(buf);
+		for (i=0; i<SFS_DIRENTRIES_PER_BLOCK; i++) {
+			if (sds[i].sfd_ino == SFS_NOINO) {
+				if (emptyslot != NULL && !haveempty) {
+					*emptyslot = block *
+						SFS_DIRENTRIES_PER_BLOCK + i;
+					haveempty = true;
+				}
+			}
+			else if (probe <= maxprobe &&
+				 sfs_dir_namematch(&sds[i], name)) {
+				found = true;
+				if (slot != NULL) {
+					*slot = block *
+						SFS_DIRENTRIES_PER_BLOCK + i;
+				}
+				if (ino != NULL) {
+					*ino = sds[i].sfd_ino;
+				}
+			}
+		}
+		sfs_brelse(sfs, buf);
+
+		if (found) {
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	if (sv->sv_i.sfi_dirformat == SFS_DIR_HASHED) {
+		return sfs_dir_hashfind(sv, name, ino, slot, emptyslot);
+	}
+	return sfs_dir_linearfind(sv, name, ino, slot, emptyslot);
+}
+
+/*
+ * Put entry SD into the (hashed) directory being rebuilt by
+ * sfs_dir_rehash, in the first free slot from its home block on.
+ */
+static
+int
+sfs_dir_place(struct sfs_vnode *sv, uint32_t nblocks,
+	      const struct sfs_direntry *sd)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	struct sfs_direntry *sds;
+	uint32_t home, probe, i;
+	int result;
+
+	home = sfs_dirhash(sd->sfd_name) % nblocks;
+	for (probe = 0; probe < nblocks; probe++) {
+		result = sfs_dir_getblock(sv, (home + probe) % nblocks,
+					  false, &buf);
+		if (result) {
+			return result;
+		}
+		KASSERT(buf != NULL);
+
+		sds = sfs_bdata(buf);
+		for (i=0; i<SFS_DIRENTRIES_PER_BLOCK; i++) {
+			if (sds[i].sfd_ino == SFS_NOINO) {
+				sds[i] = *sd;
+				sfs_bdirty(sfs, buf);
+				sfs_brelse(sfs, buf);
+				if (probe > sv->sv_i.sfi_dirprobe) {
+					sv->sv_i.sfi_dirprobe = probe;
+				}
+				return 0;
+			}
+		}
+		sfs_brelse(sfs, buf);
+	}
+
+	/* sfs_dir_rehash always makes room */
+	panic("sfs: %s: directory %u: no room while rehashing\n",
+	      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	return ENOSPC;
+}
+
+/*
+ * Rebuild directory SV as a hashed directory of twice its current
+ * size (capped at SFS_DIR_MAXBLOCKS). This is also how a linear
+ * directory gets converted.
+ */
+static
+int
+sfs_dir_rehash(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry *entries;
+	struct sfs_buf *buf;
+	struct sfs_direntry *sds;
+	uint32_t oldblocks, nblocks, nslots, nlive, block, i;
+	int result;
+
+	nslots = sfs_dir_nentries(sv);
+	oldblocks = DIVROUNDUP(nslots, SFS_DIRENTRIES_PER_BLOCK);
+	nblocks = oldblocks * 2;
+	if (nblocks < 2) {
+		nblocks = 2;
+	}
+	if (nblocks > SFS_DIR_MAXBLOCKS) {
+		nblocks = SFS_DIR_MAXBLOCKS;
+	}
+	if (nblocks <= oldblocks && sv->sv_i.sfi_dirformat == SFS_DIR_HASHED) {
+		/* Already as big as it gets */
+		return ENOSPC;
+	}
+
+	/* Collect the live entries. */
+	entries = kmalloc(nslots * sizeof(struct sfs_direntry));
+	if (entries == NULL) {
+		return ENOMEM;
+	}
+	nlive = 0;
+	for (i=0; i<nslots; i++) {
+		result = sfs_readdir(sv, i, &entries[nlive]);
+		if (result) {
+			kfree(entries);
+			return result;
+		}
+		if (entries[nlive].sfd_ino != SFS_NOINO) {
+			entries[nlive].sfd_name[SFS_NAMELEN-1] = 0;
+			nlive++;
+		}
+	}
+	KASSERT(nlive < nblocks * SFS_DIRENTRIES_PER_BLOCK);
+
+	/*
+	 * Allocate all the blocks first, so running out of space
+	 * leaves the directory as it was.
+	 */
+	for (block = 0; block < nblocks; block++) {
+		result = sfs_dir_getblock(sv, block, true, &buf);
+		if (result) {
+			kfree(entries);
+			return result;
+		}
+		sfs_brelse(sfs, buf);
+	}
+
+	/* Now wipe them and put the entries back in their new places. */
+	for (block = 0; block < nblocks; block++) {
+		result = sfs_dir_getblock(sv, block, false, &buf);
+		if (result) {
+			kfree(entries);
+			return result;
+		}
+		sds = sfs_bdata(buf);
+		bzero(sds, SFS_BLOCKSIZE);
+		sfs_bdirty(sfs, buf);
+		sfs_brelse(sfs, buf);
+	}
+	sv->sv_i.sfi_size = nblocks * SFS_BLOCKSIZE;
+	sv->sv_i.sfi_dirformat = SFS_DIR_HASHED;
+	sv->sv_i.sfi_dirprobe = 0;
+	sv->sv_dirty = true;
+
+	for (i=0; i<nlive; i++) {
+		result = sfs_dir_place(sv, nblocks, &entries[i]);
+		if (result) {
+			kfree(entries);
+			return result;
+		}
+	}
+
+	kfree(entries);
+	return 0;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
+ *
+ * Note that this may rebuild the directory, moving other entries to
+ * different slots.
  */
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
 	int emptyslot = -1;
+	int nentries;
+	uint32_t nblocks, home, probe;
 	int result;
 	struct sfs_direntry sd;
 
@@ -170,9 +492,41 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
+	/*
+	 * If we didn't get an empty slot, a hashed directory (or a
+	 * linear one that's getting big) needs to be rebuilt larger.
+	 * A small linear directory just gets the entry at the end.
+	 */
+	nentries = sfs_dir_nentries(sv);
+	if (emptyslot < 0 &&
+	    (sv->sv_i.sfi_dirformat == SFS_DIR_HASHED ||
+	     nentries >= SFS_DIRHASH_MINBLOCKS * SFS_DIRENTRIES_PER_BLOCK)) {
+		result = sfs_dir_rehash(sv);
+		if (result) {
+			return result;
+		}
+		result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+		if (result!=0 && result!=ENOENT) {
+			return result;
+		}
+		if (emptyslot < 0) {
+			return ENOSPC;
+		}
+	}
 	if (emptyslot < 0) {
-		emptyslot = sfs_dir_nentries(sv);
+		emptyslot = nentries;
+	}
+
+	/* Keep track of how far from home hashed entries end up. */
+	if (sv->sv_i.sfi_dirformat == SFS_DIR_HASHED) {
+		nblocks = sv->sv_i.sfi_size / SFS_BLOCKSIZE;
+		home = sfs_dirhash(name) % nblocks;
+		probe = (emptyslot / SFS_DIRENTRIES_PER_BLOCK + nblocks - home)
+			% nblocks;
+		if (probe > sv->sv_i.sfi_dirprobe) {
+			sv->sv_i.sfi_dirprobe = probe;
+			sv->sv_dirty = true;
+		}
 	}
 
 	/* Set up the entry. */
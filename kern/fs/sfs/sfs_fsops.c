@@ -39,6 +39,7 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -112,15 +113,55 @@ static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
+	struct vnodearray *vnodes;
+	struct vnode *v;
+	struct sfs_vnode *sv;
 	unsigned i, num;
+	int result, ret = 0;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Take a reference to each loaded vnode under the table lock,
+	 * then sync them without it: the vnode lock comes before the
+	 * table lock.
+	 *
+	 * This allocates blocks for file data still waiting for them
+	 * and puts that and the inodes in the buffer cache, unlike
+	 * VOP_FSYNC, which would also flush each file's blocks on its
+	 * own; sfs_sync flushes the whole cache at once afterwards.
+	 */
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
+	result = sfs_vnhash_getall(sfs, vnodes);
+	if (result) {
+		vnodearray_destroy(vnodes);
+		return result;
+	}
+
+	/*
+	 * Go over the array of loaded vnodes, syncing as we go. If one
+	 * fails (allocating its delayed blocks can run out of space),
+	 * carry on with the rest and report the first error.
+	 */
+	num = vnodearray_num(vnodes);
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		v = vnodearray_get(vnodes, i);
+		sv = v->vn_data;
+		rwlock_acquire_write(sv->sv_rwlock);
+		result = sfs_delay_flush(sv);
+		if (result == 0) {
+			result = sfs_sync_inode(sv);
+		}
+		rwlock_release_write(sv->sv_rwlock);
+		if (result && ret == 0) {
+			ret = result;
+		}
+		VOP_DECREF(v);
 	}
-	return 0;
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
+	return ret;
 }
 
 /*
@@ -132,17 +173,48 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
 
+/*
+ * Write the freemap all the way to disk, for fsync.
+ */
+int
+sfs_flush_freemap(struct sfs_fs *sfs)
+{
+	daddr_t blocks[SFS_MAXCLUSTER];
+	uint32_t freemapblocks, i, n;
+	int result;
+
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+
+	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
+	for (i=0; i<freemapblocks; i+=n) {
+		for (n=0; n<SFS_MAXCLUSTER && i+n<freemapblocks; n++) {
+			blocks[n] = SFS_FREEMAP_START + i + n;
+		}
+		result = sfs_bflush(sfs, blocks, n);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
 /*
  * Sync routine for the superblock.
  */
@@ -152,14 +224,17 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -172,7 +247,7 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs;
-	int result;
+	int result, vnresult;
 
 	vfs_biglock_acquire();
 
@@ -208,12 +283,12 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* If any vnodes need to be written, write them. */
-	result = sfs_sync_vnodes(sfs);
-	if (result) {
-		vfs_biglock_release();
-		return result;
-	}
+	/*
+	 * If any vnodes need to be written, write them. If some of
+	 * them couldn't be, still write out everything else, and
+	 * report the failure at the end.
+	 */
+	vnresult = sfs_sync_vnodes(sfs);
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
@@ -230,7 +305,15 @@ sfs_sync(struct fs *fs)
 	}
 
 	vfs_biglock_release();
-	return 0;
+
+	/*
+	 * All of the above only went into the buffer cache; flush it.
+	 * The cache has its own locking, so this doesn't need the big
+	 * lock, and holding it through the writes would stall every
+	 * directory operation until they finish.
+	 */
+	result = sfs_cache_sync(sfs);
+	return vnresult ? vnresult : result;
 }
 
 /*
@@ -262,7 +345,11 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_cache_destroy(sfs);
+	lock_destroy(sfs->sfs_freemaplock);
+	cv_destroy(sfs->sfs_vncv);
+	lock_destroy(sfs->sfs_vnlock);
+	sfs_vnhash_cleanup(sfs);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -281,7 +368,7 @@ sfs_unmount(struct fs *fs)
 	vfs_biglock_acquire();
 
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+	if (sfs->sfs_nvnodes > 0) {
 		vfs_biglock_release();
 		return EBUSY;
 	}
@@ -351,17 +438,41 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	if (sfs_vnhash_init(sfs)) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_vnodes;
+	}
+	sfs->sfs_vncv = cv_create("sfs_vncv");
+	if (sfs->sfs_vncv == NULL) {
+		goto cleanup_vnlock;
+	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vncv;
+	}
+
+	/* buffer cache */
+	if (sfs_cache_create(sfs)) {
+		goto cleanup_freemaplock;
+	}
 
 	return sfs;
 
+cleanup_freemaplock:
+	lock_destroy(sfs->sfs_freemaplock);
+cleanup_vncv:
+	cv_destroy(sfs->sfs_vncv);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
+cleanup_vnodes:
+	sfs_vnhash_cleanup(sfs);
 cleanup_object:
 	kfree(sfs);
 fail:
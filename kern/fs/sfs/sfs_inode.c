@@ -35,13 +35,202 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* Initial number of vnode hash buckets; the table doubles as it fills. */
+#define SFS_VNHASH_INITSIZE 64
+
+#define SFS_VNHASH(sfs, ino) ((ino) & ((sfs)->sfs_vnhashsize - 1))
+
+////////////////////////////////////////////////////////////
+//
+// Table of loaded vnodes
+//
+// Resident vnodes are kept in a chained hash table keyed by inode
+// number, protected by sfs_vnlock. The table grows when the number
+// of vnodes exceeds the number of buckets, so chains stay short no
+// matter how many files are open. A vnode whose inode is being read
+// in or written back is marked sv_busy; lookups wait on sfs_vncv.
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Set up an empty table. Called from sfs_fs_create.
+ */
+int
+sfs_vnhash_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INITSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNHASH_INITSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_nvnodes = 0;
+	return 0;
+}
+
+/*
+ * Free the table, which must be empty.
+ */
+void
+sfs_vnhash_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = NULL;
+}
+
+/*
+ * Find the vnode for inode INO, or return NULL.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[SFS_VNHASH(sfs, ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the number of buckets. If we can't get the memory, carry on
+ * with longer chains.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **newhash, **oldhash;
+	struct sfs_vnode *sv;
+	unsigned i, oldsize, newsize;
+
+	oldsize = sfs->sfs_vnhashsize;
+	newsize = oldsize * 2;
+	newhash = kmalloc(newsize * sizeof(struct sfs_vnode *));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+
+	oldhash = sfs->sfs_vnhash;
+	sfs->sfs_vnhash = newhash;
+	sfs->sfs_vnhashsize = newsize;
+
+	for (i=0; i<oldsize; i++) {
+		while ((sv = oldhash[i]) != NULL) {
+			oldhash[i] = sv->sv_hashnext;
+			sv->sv_hashnext = newhash[SFS_VNHASH(sfs, sv->sv_ino)];
+			newhash[SFS_VNHASH(sfs, sv->sv_ino)] = sv;
+		}
+	}
+	kfree(oldhash);
+}
+
+/*
+ * Add SV to the table.
+ */
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned bucket;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sfs->sfs_nvnodes >= sfs->sfs_vnhashsize) {
+		sfs_vnhash_grow(sfs);
+	}
+
+	bucket = SFS_VNHASH(sfs, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[bucket];
+	sfs->sfs_vnhash[bucket] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+/*
+ * Remove SV from the table.
+ */
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (svp = &sfs->sfs_vnhash[SFS_VNHASH(sfs, sv->sv_ino)];
+	     *svp != NULL; svp = &(*svp)->sv_hashnext) {
+		if (*svp == sv) {
+			*svp = sv->sv_hashnext;
+			sv->sv_hashnext = NULL;
+			sfs->sfs_nvnodes--;
+			return;
+		}
+	}
+	panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+	      sfs->sfs_sb.sb_volname, sv->sv_ino);
+}
+
+/*
+ * Take a reference to every loaded vnode and put it in VNODES, so the
+ * caller can work on them without holding the table lock. Vnodes
+ * still being loaded or already being reclaimed are skipped.
+ */
+int
+sfs_vnhash_getall(struct sfs_fs *sfs, struct vnodearray *vnodes)
+{
+	struct sfs_vnode *sv;
+	unsigned i, n;
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	result = vnodearray_setsize(vnodes, sfs->sfs_nvnodes);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		return result;
+	}
+	n = 0;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			if (sv->sv_busy) {
+				/* Being loaded, or reclaim syncs it */
+				continue;
+			}
+			VOP_INCREF(&sv->sv_absvn);
+			vnodearray_set(vnodes, n++, &sv->sv_absvn);
+		}
+	}
+	KASSERT(n <= sfs->sfs_nvnodes);
+	lock_release(sfs->sfs_vnlock);
+	vnodearray_setsize(vnodes, n);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Inodes
+
+/*
+ * Write an on-disk inode structure back out to disk. The caller holds
+ * sv_rwlock exclusively, or is reclaiming the vnode.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -70,16 +259,20 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. sfs_loadvnode only hands out
+	 * references with the vnode table lock held, so checking the
+	 * count under it and then marking the vnode busy closes that
+	 * race. A reload of the same inode waits for the busy flag to
+	 * clear, so it can't read the inode before we've written it
+	 * back; meanwhile the table lock is free for other inodes.
 	 */
+	lock_acquire(sfs->sfs_vnlock);
+	KASSERT(!sv->sv_busy);
+
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
@@ -88,104 +281,121 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
+	sv->sv_busy = true;
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * If there are no on-disk references to the file either, erase
+	 * it. Otherwise give disk blocks to whatever was written to it
+	 * without one.
+	 */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
-			return result;
+			goto fail;
 		}
 	}
+	else {
+		result = sfs_delay_flush(sv);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	/* Give back any blocks set aside for writes that won't come now */
+	sfs_prealloc_release(sv);
 
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto fail;
 	}
 
+	lock_acquire(sfs->sfs_vnlock);
+
 	/* If there are no on-disk references, discard the inode */
 	if (sv->sv_i.sfi_linkcount==0) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vnhash_remove(sfs, sv);
 
-	vnode_cleanup(&sv->sv_absvn);
+	/* Anyone waiting on it will now load a fresh copy */
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
 
-	vfs_biglock_release();
+	vnode_cleanup(&sv->sv_absvn);
+	rwlock_destroy(sv->sv_rwlock);
+	spinlock_cleanup(&sv->sv_ralock);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
 
 	/* Done */
 	return 0;
+
+ fail:
+	/* Leave the vnode loaded; the reference stays with it. */
+	lock_acquire(sfs->sfs_vnlock);
+	sv->sv_busy = false;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
+	return result;
 }
 
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * The new vnode goes in the table marked busy before the inode is
+ * read, so two threads can't load the same inode twice, but the
+ * table lock isn't held across the disk read.
  */
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	while ((sv = sfs_vnhash_find(sfs, ino)) != NULL && sv->sv_busy) {
+		/*
+		 * Half loaded or on its way out. It may be gone when
+		 * we wake up, so look it up again from scratch.
+		 */
+		cv_wait(sfs->sfs_vncv, sfs->sfs_vnlock);
+	}
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: %s: Found inode %u in unallocated block\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -195,16 +405,29 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      "unallocated block\n", sfs->sfs_sb.sb_volname, ino);
 	}
 
+	/* Claim the inode number, then do the rest unlocked */
+	sv->sv_ino = ino;
+	sv->sv_busy = true;
+	sfs_vnhash_add(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
+
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No allocation history */
+	sv->sv_goal = 0;
+	sv->sv_nextfileblock = 0;
+	sv->sv_prealloc = 0;
+	sv->sv_npreallocs = 0;
+	sv->sv_delayed = NULL;
+	sv->sv_ndelayed = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
@@ -232,27 +455,42 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino, sv->sv_i.sfi_type);
 	}
 
+	sv->sv_rwlock = rwlock_create("sfs_vnode");
+	if (sv->sv_rwlock == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
-		return result;
+		rwlock_destroy(sv->sv_rwlock);
+		goto fail;
 	}
 
-	/* Set the other fields in our vnode structure */
-	sv->sv_ino = ino;
+	/* No read pattern yet */
+	spinlock_init(&sv->sv_ralock);
+	sv->sv_ranext = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = SFS_RA_MINBLOCKS;
 
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	/* Ready; let anyone waiting for it have it too */
+	lock_acquire(sfs->sfs_vnlock);
+	sv->sv_busy = false;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
 	return 0;
+
+ fail:
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnhash_remove(sfs, sv);
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
+	kfree(sv);
+	return result;
 }
 
 /*
@@ -269,7 +507,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -49,7 +49,7 @@
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
- * except sfs_device.
+ * except sfs_device and sfs_cache.
  */
 
 /*
@@ -62,8 +62,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -102,35 +100,152 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block from the device. Only the buffer cache should call
+ * this; everything else goes through the cache.
  */
 int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_devread(struct sfs_fs *sfs, daddr_t block, void *data)
 {
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
-
 	SFSUIO(&iov, &ku, data, block, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Set up KU and the N iovecs in IOV to cover N consecutive blocks
+ * starting at BLOCK and the N buffers in DATA.
  */
+static
+void
+sfs_devuio(struct iovec *iov, struct uio *ku, daddr_t block, void **data,
+	   unsigned n, enum uio_rw rw)
+{
+	unsigned i;
+
+	KASSERT(n > 0 && n <= SFS_MAXCLUSTER);
+
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = data[i];
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ku->uio_iov = iov;
+	ku->uio_iovcnt = n;
+	ku->uio_offset = (off_t)block * SFS_BLOCKSIZE;
+	ku->uio_resid = n * SFS_BLOCKSIZE;
+	ku->uio_segflg = UIO_SYSSPACE;
+	ku->uio_rw = rw;
+	ku->uio_space = NULL;
+}
+
+/*
+ * Transfer N consecutive blocks starting at BLOCK to or from the N
+ * buffers in DATA, as one request to the device.
+ */
+static
 int
-sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_devrwv(struct sfs_fs *sfs, daddr_t block, void **data, unsigned n,
+	   enum uio_rw rw)
 {
-	struct iovec iov;
+	struct iovec iov[SFS_MAXCLUSTER];
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	sfs_devuio(iov, &ku, block, data, n, rw);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Clustered reads and writes, for the buffer cache.
+ */
+int
+sfs_devreadv(struct sfs_fs *sfs, daddr_t block, void **data, unsigned n)
+{
+	return sfs_devrwv(sfs, block, data, n, UIO_READ);
+}
+
+int
+sfs_devwritev(struct sfs_fs *sfs, daddr_t block, void **data, unsigned n)
+{
+	return sfs_devrwv(sfs, block, data, n, UIO_WRITE);
+}
+
+/*
+ * Start reading N consecutive blocks starting at BLOCK into the N
+ * buffers in DATA without waiting, for read-ahead. DONE(ARG, result)
+ * is called when the read finishes, maybe from an interrupt handler.
+ * IOV (N entries) and KU are set up here and must stay valid until
+ * then. Fails if the device can't take the request right now; there
+ * are no retries.
+ */
+int
+sfs_devreadv_async(struct sfs_fs *sfs, daddr_t block, void **data,
+		   unsigned n, struct iovec *iov, struct uio *ku,
+		   void (*done)(void *, int), void *arg)
+{
+	struct device *dev = sfs->sfs_device;
+
+	if (dev->d_ops->devop_aio == NULL) {
+		return ENOSYS;
+	}
+	sfs_devuio(iov, ku, block, data, n, UIO_READ);
+	return dev->d_ops->devop_aio(dev, ku, done, arg);
+}
+
+/*
+ * Write a block to the device. Likewise only for the buffer cache.
+ */
+int
+sfs_devwrite(struct sfs_fs *sfs, daddr_t block, void *data)
+{
+	struct iovec iov;
+	struct uio ku;
 
 	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
 
+/*
+ * Read a block (through the buffer cache).
+ */
+int
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+
+	result = sfs_bread(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, sfs_bdata(buf), len);
+	sfs_brelse(sfs, buf);
+	return 0;
+}
+
+/*
+ * Write a block (into the buffer cache; it goes to disk later).
+ */
+int
+sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+
+	result = sfs_bget(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(sfs_bdata(buf), data, len);
+	sfs_bdirty(sfs, buf);
+	sfs_brelse(sfs, buf);
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
@@ -150,33 +265,21 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 
-	/* Allocate missing blocks if and only if we're writing */
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
+	void *data;
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/* Get the disk block number; missing ones are allocated later */
+	result = sfs_bmap(sv, fileblock, false, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -184,40 +287,44 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
+		 * Writes go to (and reads come from) the copy waiting
+		 * for delayed allocation; with no copy, read zeros.
 		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
+		if (uio->uio_rw == UIO_WRITE) {
+			result = sfs_delay_get(sv, fileblock, &data);
+			if (result) {
+				return result;
+			}
+		}
+		else {
+			data = sfs_delay_lookup(sv, fileblock);
+			if (data == NULL) {
+				return uiomovezeros(len, uio);
+			}
 		}
+		return uiomove((char *)data + skipstart, len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_bread(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the buffer is now dirty (even if uiomove
+	 * failed part way, since some of it may have been changed).
 	 */
+	result = uiomove((char *)sfs_bdata(buf) + skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		sfs_bdirty(sfs, buf);
 	}
+	sfs_brelse(sfs, buf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -228,63 +335,147 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	void *data;
 	int result;
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/* Look up the disk block number; don't allocate one yet */
+	result = sfs_bmap(sv, fileblock, false, &diskblock);
 	if (result) {
 		return result;
 	}
 
 	if (diskblock == 0) {
 		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
+		 * No block - use the copy waiting for delayed
+		 * allocation, or if reading and there is none, fill
+		 * with zeros.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		if (uio->uio_rw == UIO_WRITE) {
+			result = sfs_delay_get(sv, fileblock, &data);
+			if (result) {
+				return result;
+			}
+		}
+		else {
+			data = sfs_delay_lookup(sv, fileblock);
+			if (data == NULL) {
+				return uiomovezeros(SFS_BLOCKSIZE, uio);
+			}
+		}
+		return uiomove(data, SFS_BLOCKSIZE, uio);
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache so that the block is seen the
+	 * same way by everyone. A block being completely overwritten
+	 * doesn't need to be read first.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_bread(sfs, diskblock, &buf);
+	}
+	else {
+		result = sfs_bget(sfs, diskblock, &buf);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = uiomove(sfs_bdata(buf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		sfs_bdirty(sfs, buf);
+	}
+	sfs_brelse(sfs, buf);
 
 	return result;
 }
 
+/*
+ * Read-ahead. Called before reading file blocks FIRST through LAST.
+ *
+ * If the reader is carrying on where it left off, reads of the next
+ * sv_rawindow blocks past LAST are started in the buffer cache (which
+ * reads runs of adjacent blocks in one request, without waiting) so
+ * they're there when it gets to them. This is topped up whenever the reader
+ * gets within half a window of the end of what was read ahead.
+ *
+ * The window doubles, up to SFS_RA_MAXBLOCKS, each time the reader
+ * uses up everything read ahead for it, and halves, down to
+ * SFS_RA_MINBLOCKS, when it jumps away leaving blocks unread.
+ *
+ * Read-ahead is only a hint, so errors are ignored. The caller holds
+ * sv_rwlock, at least shared.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t first, uint32_t last)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t blocks[SFS_RA_MAXBLOCKS];
+	uint32_t start, end, fileblocks, i;
+	bool sequential;
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+
+	spinlock_acquire(&sv->sv_ralock);
+
+	/* Small reads may come back to the block they last ended in */
+	sequential = (first == sv->sv_ranext || first + 1 == sv->sv_ranext);
+	if (!sequential) {
+		if (sv->sv_raend > sv->sv_ranext &&
+		    sv->sv_rawindow > SFS_RA_MINBLOCKS) {
+			sv->sv_rawindow /= 2;
+		}
+		sv->sv_raend = 0;
+		sv->sv_ranext = last + 1;
+		spinlock_release(&sv->sv_ralock);
+		return;
+	}
+
+	if (sv->sv_raend != 0 && last + 1 >= sv->sv_raend &&
+	    sv->sv_rawindow < SFS_RA_MAXBLOCKS) {
+		sv->sv_rawindow *= 2;
+	}
+	sv->sv_ranext = last + 1;
+
+	start = end = 0;
+	if (last + 1 + sv->sv_rawindow / 2 >= sv->sv_raend) {
+		start = last + 1 > sv->sv_raend ? last + 1 : sv->sv_raend;
+		end = last + 1 + sv->sv_rawindow;
+		if (end > fileblocks) {
+			end = fileblocks;
+		}
+		if (end > start) {
+			sv->sv_raend = end;
+		}
+	}
+
+	spinlock_release(&sv->sv_ralock);
+
+	if (end <= start) {
+		return;
+	}
+	if (end - start > SFS_RA_MAXBLOCKS) {
+		end = start + SFS_RA_MAXBLOCKS;
+	}
+
+	for (i = start; i < end; i++) {
+		if (sfs_bmap(sv, i, false, &blocks[i - start])) {
+			end = i;
+			break;
+		}
+	}
+	if (end > start) {
+		sfs_bprefetch(sfs, blocks, end - start);
+	}
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -317,6 +508,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		if (uio->uio_resid > 0) {
+			sfs_readahead(sv, uio->uio_offset / SFS_BLOCKSIZE,
+				      (uio->uio_offset + uio->uio_resid - 1)
+				      / SFS_BLOCKSIZE);
+		}
 	}
 
 	/*
@@ -407,6 +604,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	char *blockdata;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,18 +613,6 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
 	blockoffset = actualpos % SFS_BLOCKSIZE;
@@ -446,26 +633,23 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block from the buffer cache */
+	result = sfs_bread(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	blockdata = sfs_bdata(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, blockdata + blockoffset, len);
+		sfs_brelse(sfs, buf);
 	}
 	else {
-		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* Update the selected region; it's written back later */
+		memcpy(blockdata + blockoffset, data, len);
+		sfs_bdirty(sfs, buf);
+		sfs_brelse(sfs, buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
@@ -38,6 +38,7 @@
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -102,9 +103,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	rwlock_acquire_read(sv->sv_rwlock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_read(sv->sv_rwlock);
 
 	return result;
 }
@@ -121,9 +122,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_rwlock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_rwlock);
 
 	return result;
 }
@@ -164,8 +165,10 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	rwlock_acquire_read(sv->sv_rwlock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	rwlock_release_read(sv->sv_rwlock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -185,16 +188,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once the vnode is loaded; no lock needed */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -214,20 +214,61 @@ sfs_isseekable(struct vnode *v)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Called for fsync().
+ *
+ * File writes only go as far as the buffer cache, or for blocks with
+ * no disk block yet, the vnode. So this allocates blocks for those,
+ * writes the inode to the cache, and then forces out the inode, the
+ * file's data and indirect blocks, and the freemap (in case the file
+ * grew). Volume
+ * sync and unmount don't come through here; see sfs_sync.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	daddr_t *blocks;
+	uint32_t nfileblocks, n, i;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_rwlock);
+	result = sfs_delay_flush(sv);
+	if (result) {
+		goto out;
+	}
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	if (result) {
+		goto out;
+	}
 
+	nfileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	blocks = kmalloc((nfileblocks + 2) * sizeof(daddr_t));
+	if (blocks == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+	n = 0;
+	blocks[n++] = sv->sv_ino;
+	blocks[n++] = sv->sv_i.sfi_indirect;
+	for (i=0; i<nfileblocks; i++) {
+		result = sfs_bmap(sv, i, false, &blocks[n]);
+		if (result) {
+			break;
+		}
+		n++;
+	}
+	if (result == 0) {
+		result = sfs_bflush(sfs, blocks, n);
+	}
+	kfree(blocks);
+	if (result == 0) {
+		result = sfs_flush_freemap(sfs);
+	}
+
+ out:
+	rwlock_release_write(sv->sv_rwlock);
 	return result;
 }
 
@@ -250,8 +291,13 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	rwlock_acquire_write(sv->sv_rwlock);
+	result = sfs_itrunc(sv, len);
+	rwlock_release_write(sv->sv_rwlock);
 
-	return sfs_itrunc(sv, len);
+	return result;
 }
 
 /*
@@ -290,16 +336,19 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	int result;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_rwlock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
+		rwlock_release_write(sv->sv_rwlock);
 		vfs_biglock_release();
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
+		rwlock_release_write(sv->sv_rwlock);
 		vfs_biglock_release();
 		return EEXIST;
 	}
@@ -307,6 +356,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	if (result==0) {
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		rwlock_release_write(sv->sv_rwlock);
 		if (result) {
 			vfs_biglock_release();
 			return result;
@@ -319,6 +369,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
+		rwlock_release_write(sv->sv_rwlock);
 		vfs_biglock_release();
 		return result;
 	}
@@ -329,16 +380,24 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		rwlock_release_write(sv->sv_rwlock);
 		VOP_DECREF(&newguy->sv_absvn);
 		vfs_biglock_release();
 		return result;
 	}
 
+	/* Forget any negative name cache entry */
+	vfs_nc_remove(v, name);
+
 	/* Update the linkcount of the new file */
+	rwlock_acquire_write(newguy->sv_rwlock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	rwlock_release_write(newguy->sv_rwlock);
+
+	rwlock_release_write(sv->sv_rwlock);
 
 	*ret = &newguy->sv_absvn;
 
@@ -370,16 +429,23 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	}
 
 	/* Create the link */
+	rwlock_acquire_write(sv->sv_rwlock);
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
+		rwlock_release_write(sv->sv_rwlock);
 		vfs_biglock_release();
 		return result;
 	}
 
+	vfs_nc_remove(dir, name);
+
 	/* and update the link count, marking the inode dirty */
+	rwlock_acquire_write(f->sv_rwlock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	rwlock_release_write(f->sv_rwlock);
 
+	rwlock_release_write(sv->sv_rwlock);
 	vfs_biglock_release();
 	return 0;
 }
@@ -397,10 +463,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int result;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_rwlock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
+		rwlock_release_write(sv->sv_rwlock);
 		vfs_biglock_release();
 		return result;
 	}
@@ -408,11 +476,17 @@ sfs_remove(struct vnode *dir, const char *name)
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
+		/* The name cache may hold a reference; drop it */
+		vfs_nc_remove(dir, name);
+
 		/* If we succeeded, decrement the link count. */
+		rwlock_acquire_write(victim->sv_rwlock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		rwlock_release_write(victim->sv_rwlock);
 	}
+	rwlock_release_write(sv->sv_rwlock);
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_absvn);
@@ -443,9 +517,12 @@ sfs_rename(struct vnode *d1, const char *n1,
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
 
+	rwlock_acquire_write(sv->sv_rwlock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
+		rwlock_release_write(sv->sv_rwlock);
 		vfs_biglock_release();
 		return result;
 	}
@@ -467,8 +544,19 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 
 	/* Increment the link count, and mark inode dirty */
+	rwlock_acquire_write(g1->sv_rwlock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	rwlock_release_write(g1->sv_rwlock);
+
+	/*
+	 * Adding the link may have rebuilt the directory, so find
+	 * the old name's slot again before unlinking it.
+	 */
+	result = sfs_dir_findname(sv, n1, NULL, &slot1, NULL);
+	if (result) {
+		goto puke_harder;
+	}
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -476,13 +564,20 @@ sfs_rename(struct vnode *d1, const char *n1,
 		goto puke_harder;
 	}
 
+	vfs_nc_remove(d1, n1);
+	vfs_nc_remove(d2, n2);
+
 	/*
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	rwlock_acquire_write(g1->sv_rwlock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	rwlock_release_write(g1->sv_rwlock);
+
+	rwlock_release_write(sv->sv_rwlock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
@@ -503,8 +598,11 @@ sfs_rename(struct vnode *d1, const char *n1,
 		panic("sfs: %s: rename: Cannot recover\n",
 		      sfs->sfs_sb.sb_volname);
 	}
+	rwlock_acquire_write(g1->sv_rwlock);
 	g1->sv_i.sfi_linkcount--;
+	rwlock_release_write(g1->sv_rwlock);
  puke:
+	rwlock_release_write(sv->sv_rwlock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 	vfs_biglock_release();
@@ -557,21 +655,39 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *final;
+	struct vnode *cached;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
+	/* Try the name cache before scanning the directory. */
+	if (vfs_nc_lookup(v, path, &cached)) {
+		if (cached == NULL) {
+			return ENOENT;
+		}
+		*ret = cached;
+		return 0;
+	}
+
+	vfs_biglock_acquire();
+
 	result = sfs_lookonce(sv, path, &final, NULL);
 	if (result) {
+		if (result == ENOENT) {
+			vfs_nc_enter(v, path, NULL);
+		}
 		vfs_biglock_release();
 		return result;
 	}
 
+	/*
+	 * Entering under the big lock keeps this from racing with
+	 * creat/remove/etc., which invalidate under it.
+	 */
+	vfs_nc_enter(v, path, &final->sv_absvn);
+
 	*ret = &final->sv_absvn;
 
 	vfs_biglock_release();
@@ -42,8 +42,22 @@ extern const struct vnode_ops sfs_dirops;
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
 
+/* Most blocks moved in one device request */
+#define SFS_MAXCLUSTER 32
+
+/* Read-ahead window limits, in blocks */
+#define SFS_RA_MINBLOCKS 4
+#define SFS_RA_MAXBLOCKS SFS_MAXCLUSTER
+
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
+int sfs_balloc_file(struct sfs_vnode *sv, uint32_t fileblock,
+		    daddr_t *diskblock);
+void sfs_prealloc_release(struct sfs_vnode *sv);
+void *sfs_delay_lookup(struct sfs_vnode *sv, uint32_t fileblock);
+int sfs_delay_get(struct sfs_vnode *sv, uint32_t fileblock, void **ret);
+int sfs_delay_flush(struct sfs_vnode *sv);
+void sfs_delay_trunc(struct sfs_vnode *sv, uint32_t blocklen);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
@@ -62,7 +76,28 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_cache.c */
+struct sfs_buf;
+int sfs_cache_create(struct sfs_fs *sfs);
+void sfs_cache_destroy(struct sfs_fs *sfs);
+int sfs_cache_sync(struct sfs_fs *sfs);
+int sfs_bread(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+int sfs_bget(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+void *sfs_bdata(struct sfs_buf *buf);
+void sfs_bdirty(struct sfs_fs *sfs, struct sfs_buf *buf);
+void sfs_brelse(struct sfs_fs *sfs, struct sfs_buf *buf);
+void sfs_binval(struct sfs_fs *sfs, daddr_t block);
+void sfs_bprefetch(struct sfs_fs *sfs, const daddr_t *blocks, unsigned n);
+int sfs_bflush(struct sfs_fs *sfs, daddr_t *blocks, unsigned n);
+
+/* Functions in sfs_fsops.c */
+int sfs_flush_freemap(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
+struct vnodearray;
+int sfs_vnhash_init(struct sfs_fs *sfs);
+void sfs_vnhash_cleanup(struct sfs_fs *sfs);
+int sfs_vnhash_getall(struct sfs_fs *sfs, struct vnodearray *vnodes);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
@@ -71,6 +106,13 @@ int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_devread(struct sfs_fs *sfs, daddr_t block, void *data);
+int sfs_devwrite(struct sfs_fs *sfs, daddr_t block, void *data);
+int sfs_devreadv(struct sfs_fs *sfs, daddr_t block, void **data, unsigned n);
+int sfs_devwritev(struct sfs_fs *sfs, daddr_t block, void **data, unsigned n);
+int sfs_devreadv_async(struct sfs_fs *sfs, daddr_t block, void **data,
+		       unsigned n, struct iovec *iov, struct uio *ku,
+		       void (*done)(void *, int), void *arg);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
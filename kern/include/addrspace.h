@@ -39,10 +39,7 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
-
-#define STACKPAGES 801
-#define LPAGES 128
-#define HEAPPAGES 256
+struct pagetable;
 
 struct dregion {
     int dr_numpages;
@@ -50,18 +47,23 @@ struct dregion {
 };
 
 /*
- * Region - a collection of pages. Each page is indexed by its position
- * in the region.
+ * Region - a range of pages defined by the executable. The pages
+ * themselves live in the address space's page table; regions are only
+ * consulted on the first touch of a page.
  *
- * We use this region to create a page table. Indexing within the region
- * is O(1), but finding the correct region takes O(n) time.
+ * A region loaded from the executable remembers where its data is in
+ * the file, and vm_fault reads each page from there the first time it
+ * is touched. The rest of the region (BSS) is zero-filled on demand.
  */
 
 struct region {
     unsigned r_permissions:3;
     vaddr_t r_startaddr;
     unsigned r_numpages;
-    struct lpage **r_pages;
+    struct vnode *r_vnode;      /* backing file, or NULL */
+    vaddr_t r_filevaddr;        /* where the file data starts */
+    off_t r_fileoffset;         /* ...its offset in the file */
+    size_t r_filesize;          /* ...and its length */
 };
 
 /*
@@ -88,8 +90,7 @@ struct addrspace {
     vaddr_t as_heapbrk;
     vaddr_t as_heapmax;
     int as_heapidx;
-    struct lpage *as_stack[LPAGES];
-    struct lpage *as_heap[HEAPPAGES];
+    struct pagetable *as_pt;    /* regions, heap and stack pages */
 #endif
 };
 
@@ -120,6 +121,9 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file - back the region at VADDR with part of a file,
+ *                to be paged in on demand.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -145,6 +149,9 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *v, off_t offset,
+                                 size_t filesize);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
@@ -159,7 +166,4 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
-/* Other functions (vm.c) */
-int as_define_stack2(struct addrspace *as, vaddr_t *stackptr);
-
 #endif /* _ADDRSPACE_H_ */
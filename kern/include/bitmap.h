@@ -38,6 +38,9 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_run - locate a run of up to MAXLEN cleared bits at or
+ *                      after GOAL (wrapping around), set them, and
+ *                      return the first index and the run length.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
@@ -50,6 +53,9 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_run(struct bitmap *, unsigned goal,
+                                unsigned maxlen, unsigned *index,
+                                unsigned *len);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
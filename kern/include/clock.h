@@ -45,9 +45,22 @@
 /* hardclocks per second */
 #define HZ  100
 
+/* longest a cpu's hardclock may be deferred, in ticks */
+#define HARDCLOCK_MAXDEFER  HZ
+
 void hardclock_bootstrap(void);
 void hardclock(void);
 
+/*
+ * Dynamic ticks. A cpu with nothing to preempt for calls
+ * hardclock_defer (with its runqueue lock held) to skip the next
+ * NTICKS-1 hardclocks. hardclock_kick, on that cpu, brings the next
+ * one back to a tick from now; it's used when a thread is made
+ * runnable there.
+ */
+void hardclock_defer(unsigned nticks);
+void hardclock_kick(void);
+
 /*
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
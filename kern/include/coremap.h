@@ -3,18 +3,31 @@
 
 #include <vm.h>
 
+struct addrspace;
+
 struct cm_entry **coremap;
 struct spinlock coremap_lock;
 
 struct cm_entry {
     struct lpage *cme_page;
+    /*
+     * Address space that last faulted the page in. Only compared, to
+     * find neighbouring pages to evict with it; never followed.
+     */
+    struct addrspace *cme_as;
+    int cme_next;               /* free list links, -1 terminated */
+    int cme_prev;
     unsigned cme_cpu_id:4;
     int cme_tlb_index:7;
     /* pid_t cme_pid; */
     bool cme_is_last_page:1;
     bool cme_is_allocated:1;
     bool cme_is_pinned:1;
-    bool cme_is_refd:1;
+    /*
+     * Reference bit for the clock. Set by vm_fault without
+     * coremap_lock, so it gets its own byte rather than a bitfield.
+     */
+    bool cme_is_refd;
 };
 
 
@@ -23,15 +36,22 @@ int cm_numpages;
 int cm_start_page;
 int cm_first_free_page;
 unsigned int cm_used_bytes;
-int cm_last_refd_page;
+int cm_last_refd_page;         /* clock hand */
 
 void coremap_init(void);
 paddr_t coremap_alloc_npages(unsigned n);
 paddr_t coremap_alloc_page(void);
+paddr_t coremap_try_alloc_page(void);
 void coremap_free_kpages(paddr_t paddr);
+void coremap_free_page(paddr_t paddr);
 void coremap_set_lastrefd(paddr_t paddr);
 void coremap_set_lpage(paddr_t paddr, struct lpage *lpage);
 paddr_t coremap_choose_victim(void);
 int coremap_choose_nvictims(unsigned n);
 
+/* pageout daemon */
+void coremap_pageout_init(void);
+void coremap_pageout_wait(void);
+bool coremap_pageout(void);
+
 #endif  /* _COREMAP_H_ */
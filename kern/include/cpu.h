@@ -31,12 +31,16 @@
 #define _CPU_H_
 
 
+#include <kern/time.h>
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 extern unsigned num_cpus;
 
+#define CPU_FRAMES_MAX   32	/* frames cached per cpu */
+#define CPU_FRAMES_BATCH 16	/* frames moved to/from the coremap at once */
+
 /*
  * Per-cpu structure
  *
@@ -60,17 +64,34 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
-	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_hardclocks;		/* Ticks elapsed (see hardclock()) */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_clockintrs;		/* Timer interrupts taken */
+	unsigned c_intrs;		/* Interrupts taken, of all kinds */
+	unsigned c_switches;		/* Context switches */
+	struct timespec c_clockdeferred; /* When the hardclock was deferred */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
+	bool c_tickless;		/* True if next hardclock is deferred */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Free page frames cached by the coremap allocator, so that
+	 * most single-page allocations and frees don't take
+	 * coremap_lock. Frames move to and from the coremap
+	 * CPU_FRAMES_BATCH at a time. Normally used by this cpu only;
+	 * other cpus drain it when the coremap runs dry.
+	 * Protected by c_frames_lock.
+	 */
+	paddr_t c_frames[CPU_FRAMES_MAX];
+	unsigned c_numframes;
+	struct spinlock c_frames_lock;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -110,6 +131,18 @@ struct cpu {
  */
 struct cpu *cpu_create(unsigned hardware_number);
 void cpu_machdep_init(struct cpu *);
+
+/*
+ * Look up cpus by software number (c_number). cpu_count returns the
+ * number of cpus created so far.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned number);
+
+/*
+ * Print each cpu's tick, interrupt, and context switch counters.
+ */
+void cpu_printstats(void);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
@@ -56,11 +56,22 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_printstats - print whatever statistics the device keeps;
+ *                      NULL if it keeps none
+ *      devop_aio - start I/O to or from kernel memory without waiting
+ *                      for it; DONE(DATA, result) is called when it
+ *                      finishes, possibly from an interrupt handler.
+ *                      The uio and its iovecs must stay valid until
+ *                      then, and the uio is not advanced. NULL if the
+ *                      device can't do this.
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	void (*devop_printstats)(struct device *);
+	int (*devop_aio)(struct device *, struct uio *,
+			 void (*done)(void *data, int result), void *data);
 };
 
 /*
@@ -67,6 +67,28 @@
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
+/* Directory formats for sfi_dirformat */
+#define SFS_DIR_LINEAR    0       /* entries in any order; scan them all */
+#define SFS_DIR_HASHED    1       /* entries placed by name hash */
+
+/* Directory entries in one block */
+#define SFS_DIRENTRIES_PER_BLOCK (SFS_BLOCKSIZE / sizeof(struct sfs_direntry))
+
+/*
+ * Hashed directories use the same entries as linear ones, but the
+ * directory is a whole number of blocks ("buckets") and the entry for
+ * a name lives in block hash(name) % nblocks or, if that block was
+ * full when it was added, in one of the next sfi_dirprobe blocks
+ * (wrapping around to block 0). A lookup thus reads at most
+ * sfi_dirprobe+1 blocks. Free slots are all zeros as usual, so tools
+ * that only understand linear directories can still read them.
+ *
+ * The hash is 32-bit FNV-1a over the bytes of the name:
+ *	h = SFS_DIRHASH_BASIS; for each byte c: h = (h ^ c) * SFS_DIRHASH_PRIME
+ */
+#define SFS_DIRHASH_BASIS 2166136261U
+#define SFS_DIRHASH_PRIME 16777619U
+
 /*
  * On-disk superblock
  */
@@ -86,7 +108,9 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint16_t sfi_dirformat;			/* Dirs: one of SFS_DIR_* */
+	uint16_t sfi_dirprobe;			/* Hashed dirs: probe length */
+	uint32_t sfi_waste[128-4-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
 /*
@@ -58,6 +58,13 @@ void mainbus_send_ipi(struct cpu *target);
 /* Request breaking into the debugger, where available. */
 void mainbus_debugger(void);
 
+/*
+ * Make the current cpu's next hardclock come NTICKS ticks after its
+ * last one instead of one, or right away if that time has passed. The
+ * timer goes back to one tick per interrupt on its own.
+ */
+void mainbus_set_hardclock(unsigned nticks);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
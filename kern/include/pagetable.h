@@ -0,0 +1,35 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+#include <vm.h>
+
+/*
+ * Two-level page table mapping user virtual pages to lpages.
+ *
+ * The top 10 bits of a virtual address index the directory, the next
+ * 10 bits index a second-level table of PT_L2_ENTRIES lpage pointers
+ * (exactly one page). Second-level tables are allocated on first use,
+ * so a lookup is two array references no matter how many pages the
+ * address space has.
+ */
+
+#define PT_L1_SHIFT 22
+#define PT_L2_SHIFT 12
+#define PT_L2_ENTRIES 1024
+#define PT_L1_ENTRIES (MIPS_KSEG0 >> PT_L1_SHIFT) /* user space only */
+
+#define PT_L1_INDEX(va) ((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va) (((va) >> PT_L2_SHIFT) & (PT_L2_ENTRIES - 1))
+
+struct pagetable {
+    struct lpage **pt_dir[PT_L1_ENTRIES];
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+int pt_copy(struct pagetable *old, struct pagetable *new);
+
+struct lpage **pt_getslot(struct pagetable *pt, vaddr_t vaddr, bool create);
+void pt_unmap(struct pagetable *pt, vaddr_t start, vaddr_t end);
+
+#endif  /* _PAGETABLE_H_ */
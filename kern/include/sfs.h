@@ -48,27 +48,63 @@
  */
 #include <kern/sfs.h>
 
+struct sfs_dblock; /* in sfs_balloc.c */
+
 /*
  * In-memory inode
+ *
+ * sv_rwlock protects sv_i, sv_dirty, and the file's data and
+ * indirect blocks. read() holds it shared; everything that changes
+ * the inode holds it exclusive.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct rwlock *sv_rwlock;       /* inode lock */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash chain */
+	bool sv_busy;                   /* loading or reclaiming; sfs_vnlock */
+
+	/* Block placement; under sv_rwlock */
+	daddr_t sv_goal;                /* disk block to try next, or 0 */
+	uint32_t sv_nextfileblock;      /* file block expected next */
+	daddr_t sv_prealloc;            /* first block reserved ahead */
+	unsigned sv_npreallocs;         /* number of blocks reserved */
+
+	/* Delayed allocation; under sv_rwlock */
+	struct sfs_dblock *sv_delayed;  /* written blocks with no disk block */
+	unsigned sv_ndelayed;           /* number of them */
+
+	/* Read-ahead; under sv_ralock */
+	struct spinlock sv_ralock;
+	uint32_t sv_ranext;             /* file block expected next */
+	uint32_t sv_raend;              /* end of blocks read ahead */
+	uint32_t sv_rawindow;           /* blocks to read ahead */
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * Lock ordering: the vfs big lock (still taken for directory
+ * operations, sync, and mount), then sv_rwlock (a directory's before
+ * a file's), then sfs_vnlock, then sfs_freemaplock, then the buffer
+ * cache lock.
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded, hashed by ino */
+	unsigned sfs_vnhashsize;        /* buckets in sfs_vnhash (2^n) */
+	unsigned sfs_nvnodes;           /* vnodes in sfs_vnhash */
+	struct lock *sfs_vnlock;        /* protects sfs_vnhash */
+	struct cv *sfs_vncv;            /* wait for sv_busy to clear */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct lock *sfs_freemaplock;   /* protects freemap and superblock */
+	struct sfs_cache *sfs_cache;    /* buffer cache (sfs_cache.c) */
 };
 
 /*
@@ -35,6 +35,7 @@
  */
 
 
+#include <kern/time.h>
 #include <spinlock.h>
 
 /*
@@ -71,14 +72,27 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: a thread that finds the lock held spins as long
+ * as the holder is running on another cpu, and only sleeps once the
+ * holder has blocked or been preempted. Taking a free lock, and
+ * releasing one nobody is waiting for, is a single compare-and-swap
+ * on lk_word; lk_spinlock and the wait channel are only used under
+ * contention.
  */
+struct lockstat;
+
 struct lock {
     char *lk_name;
     HANGMAN_LOCKABLE(lk_hangman);   /* Deadlock detector hook. */
     struct wchan *lk_wchan;
-    struct thread *lk_holder;
+    struct thread *volatile lk_holder;
     struct spinlock lk_spinlock;
-    volatile short lk_var;
+    volatile spinlock_data_t lk_word;  /* Held and waiter bits */
+    unsigned lk_nwaiters;           /* Threads asleep on lk_wchan */
+    struct lockstat *lk_stat;       /* Stats entry, once first counted */
+    bool lk_timed;                  /* lk_acquired is valid */
+    struct timespec lk_acquired;    /* When the holder got the lock */
 };
 
 struct lock *lock_create(const char *name);
@@ -88,6 +102,8 @@ void lock_destroy(struct lock *);
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
  *                   same time.
+ *    lock_tryacquire - Get the lock if nobody holds it and return true;
+ *                   otherwise return false at once.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
@@ -96,9 +112,18 @@ void lock_destroy(struct lock *);
  * These operations must be atomic. You get to write them.
  */
 void lock_acquire(struct lock *);
+bool lock_tryacquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Lock contention statistics, kept per lock name: acquires, how many
+ * of those had to spin or sleep, and total hold time. Collection is
+ * off until lockstat_enable(true), which also clears the counters.
+ */
+void lockstat_enable(bool on);
+void lockstat_print(void);
+
 
 /*
  * Condition variable.
@@ -155,12 +180,12 @@ struct rwlock {
     char *rwlock_name;
     struct cv *rwlock_cv;
     struct cv *rwlock_wcv;
-    struct lock *rwlock_lk;
-    struct lock *rwlock_wlk;
+    struct lock *rwlock_lk;         /* Protects everything below */
     int rwlock_wlocked;
     int rwlock_numreaders;
     int rwlock_rwaiting;
     int rwlock_wwaiting;
+    bool rwlock_readturn;           /* Waiting readers go ahead of writers */
     // add what you need here
     // (don't forget to mark things volatile as needed)
 };
@@ -118,6 +118,12 @@ int kmalloctest4(int, char **);
 int kmalloctest5(int, char **);
 int nettest(int, char **);
 
+/* benchmarks */
+int coremapbench(int, char **);
+int openbench(int, char **);
+int schedbench(int, char **);
+int lockbench(int, char **);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 
@@ -184,6 +190,11 @@ int ll16test(int, char **);
 void random_yielder(uint32_t);
 void random_spinner(uint32_t);
 
+/* Benchmark timing helpers */
+struct timespec;
+uint64_t bench_nsecs(const struct timespec *duration);
+unsigned bench_rate(unsigned count, const struct timespec *duration);
+
 /*
  * kprintf variants that do not (or only) print during automated testing.
  */
@@ -57,6 +57,9 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/* Number of scheduler priority levels. */
+#define THREAD_NPRIO 4
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -95,6 +98,17 @@ struct thread {
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler state. The run queue is a multi-level feedback
+	 * queue; level 0 is the highest priority. A thread drops a
+	 * level each time it uses up its quantum and rises one each
+	 * time it blocks. Changed only by the thread itself or with
+	 * t_cpu's runqueue lock held.
+	 */
+	unsigned t_priority;		/* Current level, 0..THREAD_NPRIO-1 */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_lastrun;		/* t_cpu's c_hardclocks when last run */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -168,6 +182,14 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for TICKS ticks, and preempt it if its
+ * quantum is used up or a higher-priority thread is waiting. Also
+ * decides when this cpu next needs a hardclock. Called from the timer
+ * interrupt.
+ */
+void thread_tick(unsigned ticks);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -164,6 +164,12 @@ int vfs_getcwd(struct uio *buf);
  *                    decref'd first. Similar to vfs_unmount.
  *
  *    vfs_unmountall - Unmount all mounted filesystems.
+ *
+ *    vfs_syncer_start - Start the thread that runs vfs_sync every few
+ *                    seconds. Call once threads can be created.
+ *
+ *    vfs_printdevstats - Have each device that keeps statistics print
+ *                    them.
  */
 
 void vfs_bootstrap(void);
@@ -182,6 +188,8 @@ int vfs_unmount(const char *devname);
 int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
 int vfs_unmountall(void);
+void vfs_syncer_start(void);
+void vfs_printdevstats(void);
 
 /*
  * Array of vnodes.
@@ -193,6 +201,30 @@ int vfs_unmountall(void);
 DECLARRAY(vnode, VFSINLINE);
 DEFARRAY(vnode, VFSINLINE);
 
+/*
+ * Directory name lookup cache (vfsnamecache.c)
+ *
+ *    vfs_nc_lookup  - Look up NAME in directory DIR. Returns true if
+ *                     the cache knows the answer: *RET is then the
+ *                     vnode (referenced), or NULL if there's no such
+ *                     name.
+ *
+ *    vfs_nc_enter   - Remember that NAME in DIR is VN, or (VN NULL)
+ *                     that it doesn't exist.
+ *
+ *    vfs_nc_remove  - Forget NAME in DIR. Filesystems that use the
+ *                     cache must call this whenever a name is created,
+ *                     removed, or renamed.
+ *
+ *    vfs_nc_purgefs - Forget everything on FS. Done before unmount.
+ */
+void vfs_nc_bootstrap(void);
+bool vfs_nc_lookup(struct vnode *dir, const char *name, struct vnode **ret);
+void vfs_nc_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void vfs_nc_remove(struct vnode *dir, const char *name);
+void vfs_nc_purgefs(struct fs *fs);
+void vfs_nc_printstats(void);
+
 /*
  * Global one-big-lock for all filesystem operations.
  * You must remove this for the filesystem assignment.
@@ -51,17 +51,34 @@ struct vpage {
     struct spinlock vp_lock;
 };
 
+/*
+ * Logical page. After fork an lpage may be shared copy-on-write by
+ * several address spaces; lp_refcount counts them, and the page is
+ * mapped read-only in the TLB until the count drops to one.
+ *
+ * A resident page keeps its swap slot after being swapped in. While
+ * lp_dirty is clear the slot holds an up-to-date copy, so evicting the
+ * page needs no I/O. Clean pages are mapped read-only so the first
+ * write faults and sets lp_dirty.
+ */
 struct lpage {
     vaddr_t lp_startaddr;
     paddr_t lp_paddr;
-    bool lp_freed:1;
-    int lp_slot:14;             /* 8192 slots, -1 for in-memory page */
+    int lp_slot:14;             /* swap slot, -1 if no swap copy */
+    bool lp_dirty:1;            /* modified since last written to swap */
+    unsigned lp_refcount;       /* address spaces sharing this page */
     struct lock *lp_lock;
 };
 
 
 /* swap disk name */
 #define SWAP_FILE "lhd0raw:"
+/* most swap slots used; the largest lp_slot can hold */
+#define SWP_MAXSLOTS (1 << 13)
+/* most pages moved in one swap transfer */
+#define SWP_CLUSTER 8
+/* swapped-in frames kept from read-ahead */
+#define SWP_RACACHE 16
 /* number of slots in swap space */
 unsigned swp_numslots;
 /* vnode for the swap file */
@@ -72,19 +89,35 @@ bool vm_swap_enabled;
 struct bitmap *swp_bitmap;
 /* lock for swap bitmap */
 struct lock *swp_lock;
+/* pages read from and written to swap; protected by swp_lock */
+unsigned swp_swapins;
+unsigned swp_swapouts;
+/* pages evicted without a write because their swap copy was clean */
+unsigned swp_cleanouts;
+/* swap transfers, and swap-ins satisfied from read-ahead */
+unsigned swp_reads;
+unsigned swp_writes;
+unsigned swp_rahits;
 
 /* PTE */
 struct lpage *vm_create_lpage(paddr_t paddr, vaddr_t faultaddress);
 void vm_destroy_lpage(struct lpage *lpage);
+void vm_decref_lpage(struct lpage *lpage);
 
 /* Initialization functions */
 void vm_bootstrap(void);
 
 /* Swap functions */
-void vm_swapin(struct lpage *lpage);
+int vm_swapin(struct lpage *lpage);
 paddr_t vm_swapout(struct lpage *lpage);
+int vm_swapout_cluster(struct lpage **lpages, paddr_t *paddrs, unsigned n);
 
-int swp_get_slot(void);
+int swp_alloc(unsigned n, int *slotp);
+void swp_free(int slot);
+
+/* Swap statistics, for comparing workloads from the kernel menu */
+void vm_printstats(void);
+void vm_zerostats(void);
 
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
@@ -103,6 +136,9 @@ unsigned int coremap_used_bytes(void);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Drop up to TLBSHOOTDOWN_MAX pages from every cpu's TLB */
+void vm_tlbinvalidate(const vaddr_t *vaddrs, unsigned n);
+
 void vm_cleartlb(void);
 
 #endif /* _VM_H_ */
@@ -168,6 +168,57 @@ bitmap_isset(struct bitmap *b, unsigned index)
         return (b->v[ix] & mask);
 }
 
+int
+bitmap_alloc_run(struct bitmap *b, unsigned goal, unsigned maxlen,
+                 unsigned *index, unsigned *len)
+{
+        unsigned ix, bitno, seen, step, n;
+        WORD_TYPE mask;
+
+        KASSERT(maxlen > 0);
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+
+        /* Find the first clear bit at or after GOAL, skipping full words. */
+        bitno = goal;
+        for (seen = 0; seen < b->nbits; seen += step) {
+                bitmap_translate(bitno, &ix, &mask);
+                if ((b->v[ix] & mask)==0) {
+                        break;
+                }
+                step = 1;
+                if (b->v[ix]==WORD_ALLBITS) {
+                        step = BITS_PER_WORD - bitno % BITS_PER_WORD;
+                        if (bitno + step > b->nbits) {
+                                step = b->nbits - bitno;
+                        }
+                }
+                bitno += step;
+                if (bitno >= b->nbits) {
+                        bitno = 0;
+                }
+        }
+        if (seen >= b->nbits) {
+                return ENOSPC;
+        }
+
+        /* Take as much of the run starting there as we're allowed. */
+        for (n = 0; n < maxlen && bitno + n < b->nbits; n++) {
+                bitmap_translate(bitno + n, &ix, &mask);
+                if ((b->v[ix] & mask)!=0) {
+                        break;
+                }
+                b->v[ix] |= mask;
+        }
+        KASSERT(n > 0);
+
+        *index = bitno;
+        *len = n;
+        return 0;
+}
+
 void
 bitmap_destroy(struct bitmap *b)
 {
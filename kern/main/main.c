@@ -131,6 +131,7 @@ boot(void)
 	vm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+	vfs_syncer_start();
 	test161_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -35,11 +35,13 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpu.h>
 #include <mainbus.h>
 #include <synch.h>
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <vm.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -516,6 +518,86 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_ncstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_nc_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_printdevstats();
+
+	return 0;
+}
+
+static
+int
+cmd_cpustats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cpu_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockstat_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		lockstat_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		lockstat_enable(false);
+	}
+	else {
+		kprintf("Usage: lks [on|off]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmzerostats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_zerostats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -595,6 +677,7 @@ static const char *testmenu[] = {
 	"[lt3]  Lock test 3           (1*)   ",
 	"[lt4]  Lock test 4           (1*)   ",
 	"[lt5]  Lock test 5           (1*)   ",
+	"[ltb]  Lock acquire/release bench   ",
 	"[cvt1] CV test 1             (1)    ",
 	"[cvt2] CV test 2             (1)    ",
 	"[cvt3] CV test 3             (1*)   ",
@@ -617,6 +700,9 @@ static const char *testmenu[] = {
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
 	"[hm1] HMAC unit test                ",
+	"[cmb] Coremap allocation benchmark  ",
+	"[fsb] FS open/lookup benchmark      ",
+	"[sb]  Scheduler wakeup latency bench",
 	NULL
 };
 
@@ -667,6 +753,12 @@ static const char *mainmenu[] = {
 	"[khu] Kernel heap usage             ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vm] VM swap statistics             ",
+	"[vmz] Zero VM swap statistics       ",
+	"[nc] Name cache statistics          ",
+	"[ds] Disk queue statistics          ",
+	"[cs] CPU tick/interrupt statistics  ",
+	"[lks] Lock contention stats [on|off]",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -722,6 +814,12 @@ static struct {
 	{ "khu",        cmd_kheapused },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vm",         cmd_vmstats },
+	{ "vmz",        cmd_vmzerostats },
+	{ "nc",         cmd_ncstats },
+	{ "ds",         cmd_diskstats },
+	{ "cs",         cmd_cpustats },
+	{ "lks",        cmd_lockstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -747,6 +845,7 @@ static struct {
 	{ "lt3",	locktest3 },
 	{ "lt4", 	locktest4 },
 	{ "lt5", 	locktest5 },
+	{ "ltb",	lockbench },
 	{ "cvt1",	cvtest },
 	{ "cvt2",	cvtest2 },
 	{ "cvt3",	cvtest3 },
@@ -797,6 +896,11 @@ static struct {
 	/* HMAC unit tests */
 	{ "hm1",	hmacu1 },
 
+	/* benchmarks */
+	{ "cmb",	coremapbench },
+	{ "fsb",	openbench },
+	{ "sb",		schedbench },
+
 #if OPT_AUTOMATIONTEST
 	/* automation tests */
 	{ "dl",	dltest },
@@ -69,81 +69,38 @@
  * FILESIZE may be less than MEMSIZE; if so the remaining portion of
  * the in-memory segment should be zero-filled.
  *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * Nothing is read here. The segment's region remembers where its data
+ * is in the file and vm_fault reads each page the first time it is
+ * touched, so exec doesn't pay for pages that are never used. Pages
+ * past FILESIZE are zero-filled on demand like any other new page.
+ *
+ * Since the data no longer goes through uiomove, we have to check
+ * here that the segment doesn't reach into kernel space.
  */
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
 	     off_t offset, vaddr_t vaddr,
-	     size_t memsize, size_t filesize,
-	     int is_executable)
+	     size_t memsize, size_t filesize)
 {
-	struct iovec iov;
-	struct uio u;
-	int result;
-
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
 		filesize = memsize;
 	}
 
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
-	      (unsigned long) filesize, (unsigned long) vaddr);
-
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = as;
-
-	result = VOP_READ(v, &u);
-	if (result) {
-		return result;
+	if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+		return EFAULT;
 	}
-    /* kprintf("VOP_READ\n"); */
 
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on segment - file truncated?\n");
-		return ENOEXEC;
+	if (filesize == 0) {
+		/* all BSS */
+		return 0;
 	}
 
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
 
-	return result;
+	return as_define_file(as, vaddr, v, offset, filesize);
 }
 
 /*
@@ -292,8 +249,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		}
 
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
+				      ph.p_memsz, ph.p_filesz);
 		if (result) {
 			return result;
 		}
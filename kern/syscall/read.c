@@ -1,5 +1,4 @@
 #include <types.h>
-#include <copyinout.h>
 #include <current.h>
 #include <kern/fcntl.h>
 #include <kern/errno.h>
@@ -17,7 +16,6 @@ ssize_t
 sys_read(int fd, userptr_t user_buf, size_t buflen, int *retval)
 {
     int result;
-    char *kbuffer;
     struct uio uio;
     struct iovec iov;
     struct vnode *vnode;
@@ -34,15 +32,19 @@ sys_read(int fd, userptr_t user_buf, size_t buflen, int *retval)
         return -1;
     }
 
-    /* initialize buffer */
-    kbuffer = kmalloc(buflen * sizeof(char));
-    if (kbuffer == NULL) {
-        *retval = ENOSPC;
-        return -1;
-    }
-
-    /* create a uio for vop_read */
-    uio_kinit(&iov, &uio, kbuffer, buflen, 0, UIO_READ);
+    /*
+     * Read straight into the user's buffer: uiomove copies out one
+     * piece at a time, so no kernel buffer is needed and any size
+     * works.
+     */
+    iov.iov_ubase = user_buf;
+    iov.iov_len = buflen;
+    uio.uio_iov = &iov;
+    uio.uio_iovcnt = 1;
+    uio.uio_resid = buflen;
+    uio.uio_segflg = UIO_USERSPACE;
+    uio.uio_rw = UIO_READ;
+    uio.uio_space = proc_getas();
 
     /* lock current process to get its filetable */
     spinlock_acquire(&curproc->p_lock);
@@ -52,7 +54,6 @@ sys_read(int fd, userptr_t user_buf, size_t buflen, int *retval)
     /* get fd's entry from filetable */
     fentry = filetable_get(filetable, fd);
     if (fentry == NULL || fentry->f_mode == O_WRONLY) {
-        kfree(kbuffer);
         *retval = EBADF;
         return -1;
     }
@@ -64,15 +65,6 @@ sys_read(int fd, userptr_t user_buf, size_t buflen, int *retval)
     /* do the read */
     result = VOP_READ(vnode, &uio);
     if (result) {
-        kfree(kbuffer);
-        lock_release(fentry->f_lk);
-        return result;
-    }
-
-    /* send read data into user's buffer */
-    result = copyout(kbuffer, user_buf, buflen);
-    if (result) {
-        kfree(kbuffer);
         lock_release(fentry->f_lk);
         *retval = result;
         return -1;
@@ -80,9 +72,8 @@ sys_read(int fd, userptr_t user_buf, size_t buflen, int *retval)
 
     /* store return value, update offset */
     result = uio.uio_offset - fentry->f_offset;
-    fentry->f_offset += uio.uio_offset;
+    fentry->f_offset = uio.uio_offset;
     lock_release(fentry->f_lk);
 
-    kfree(kbuffer);
     return result;
 }
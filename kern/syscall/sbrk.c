@@ -7,7 +7,7 @@
 #include <proc.h>
 #include <syscall.h>
 #include <addrspace.h>
-#include <coremap.h>
+#include <pagetable.h>
 
 
 int
@@ -46,21 +46,9 @@ sys_sbrk(intptr_t amount, int *retval)
         return -1;
     }
 
-    /* free pages */
+    /* free pages; they may still be shared copy-on-write with a child */
     if (brk < as->as_heapbrk) {
-        for (i = 0; i < HEAPPAGES; i++) {
-            if (as->as_heap[i] != NULL && as->as_heap[i]->lp_freed == 0) {
-                if (as->as_heap[i]->lp_startaddr >= brk &&
-                    as->as_heap[i]->lp_startaddr < as->as_heapbrk) {
-
-                    spinlock_acquire(&coremap_lock);
-                    coremap_free_kpages(as->as_heap[i]->lp_paddr);
-                    spinlock_release(&coremap_lock);
-
-                    as->as_heap[i]->lp_freed = 1;
-                }
-            }
-        }
+        pt_unmap(as->as_pt, brk, as->as_heapbrk);
 
         spl = splhigh();
         for (i = 0; i < NUM_TLB; i++) {
@@ -1,5 +1,4 @@
 #include <types.h>
-#include <copyinout.h>
 #include <current.h>
 #include <kern/fcntl.h>
 #include <kern/errno.h>
@@ -16,7 +15,7 @@ ssize_t
 sys_write(int fd, const_userptr_t user_buf, size_t buflen, int *retval)
 {
     int result;
-    char *kbuffer;
+    size_t resid;
     struct uio uio;
     struct iovec iov;
     struct vnode *vnode;
@@ -33,23 +32,19 @@ sys_write(int fd, const_userptr_t user_buf, size_t buflen, int *retval)
         return -1;
     }
 
-    /* initialize buffer */
-    kbuffer = kmalloc(buflen * sizeof(char));
-    if (kbuffer == NULL) {
-        *retval = ENOSPC;
-        return -1;
-    }
-
-    /* load data into buffer */
-    result = copyin(user_buf, kbuffer, buflen);
-    if (result) {
-        kfree(kbuffer);
-        *retval = result;
-        return -1;
-    }
-
-    /* create a uio for vop_write */
-    uio_kinit(&iov, &uio, kbuffer, buflen, 0, UIO_WRITE);
+    /*
+     * Write straight from the user's buffer: uiomove copies in one
+     * piece at a time, so no kernel buffer is needed and any size
+     * works.
+     */
+    iov.iov_ubase = (userptr_t)user_buf;
+    iov.iov_len = buflen;
+    uio.uio_iov = &iov;
+    uio.uio_iovcnt = 1;
+    uio.uio_resid = buflen;
+    uio.uio_segflg = UIO_USERSPACE;
+    uio.uio_rw = UIO_WRITE;
+    uio.uio_space = proc_getas();
 
     /* check if fd has an entry in the filetable */
     spinlock_acquire(&curproc->p_lock);
@@ -59,7 +54,6 @@ sys_write(int fd, const_userptr_t user_buf, size_t buflen, int *retval)
     /* get fd's entry from filetable */
     fentry = filetable_get(filetable, fd);
     if (fentry == NULL || fentry->f_mode == O_RDONLY) {
-        kfree(kbuffer);
         *retval = EBADF;
         return -1;
     }
@@ -68,25 +62,21 @@ sys_write(int fd, const_userptr_t user_buf, size_t buflen, int *retval)
     vnode = fentry->f_node;
     uio.uio_offset = fentry->f_offset;
 
-    /* do the write */
-write:
-    result = VOP_WRITE(vnode, &uio);
-    if (result) {
-        kfree(kbuffer);
-        *retval = result;
-        lock_release(fentry->f_lk);
-        return -1;
-    }
-
-    /* make sure we wrote everything */
-    if (buflen != (uio.uio_offset - fentry->f_offset)) {
-        goto write;
-    }
+    /* do the write; go again if it stopped short but made progress */
+    do {
+        resid = uio.uio_resid;
+        result = VOP_WRITE(vnode, &uio);
+        if (result) {
+            *retval = result;
+            lock_release(fentry->f_lk);
+            return -1;
+        }
+    } while (uio.uio_resid > 0 && uio.uio_resid != resid);
 
     /* update offset */
-    fentry->f_offset += buflen;
+    result = uio.uio_offset - fentry->f_offset;
+    fentry->f_offset = uio.uio_offset;
     lock_release(fentry->f_lk);
 
-    kfree(kbuffer);
-    return buflen;
+    return result;
 }
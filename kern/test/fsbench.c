@@ -0,0 +1,117 @@
+/*
+ * Filesystem benchmarks.
+ *
+ * Like the VM benchmarks, these report numbers rather than checking
+ * behaviour. Run them on a scratch volume, e.g. "fsb lhd1:".
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define FSB_PASSES 8
+#define FSB_NAMELEN 48
+
+static const unsigned fsb_levels[] = { 16, 64, 256, 512 };
+
+static void
+fsb_makename(char *buf, const char *fs, unsigned num)
+{
+	snprintf(buf, FSB_NAMELEN, "%s:fsbench.%u", fs, num);
+}
+
+/*
+ * Open file NUM with FLAGS. vfs_open eats its path, so work on a copy.
+ */
+static int
+fsb_open(const char *fs, unsigned num, int flags, struct vnode **ret)
+{
+	char name[FSB_NAMELEN];
+
+	fsb_makename(name, fs, num);
+	return vfs_open(name, flags, 0664, ret);
+}
+
+/*
+ * Open-by-name rate with increasing numbers of resident vnodes. Each
+ * file is held open so its vnode stays loaded, then every file is
+ * opened and closed again FSB_PASSES times.
+ */
+int
+openbench(int nargs, char **args)
+{
+	char name[FSB_NAMELEN];
+	char *fs;
+	struct vnode **held, *vn;
+	struct timespec before, after, duration;
+	unsigned i, pass, level, nheld, maxfiles, failed;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: fsb filesystem:\n");
+		return EINVAL;
+	}
+	fs = args[1];
+	/* Allow (but do not require) colon after device name */
+	if (fs[strlen(fs) - 1] == ':') {
+		fs[strlen(fs) - 1] = 0;
+	}
+
+	maxfiles = fsb_levels[sizeof(fsb_levels) / sizeof(fsb_levels[0]) - 1];
+	held = kmalloc(maxfiles * sizeof(struct vnode *));
+	if (held == NULL) {
+		kprintf("fsb: out of memory\n");
+		return ENOMEM;
+	}
+	nheld = 0;
+	result = 0;
+
+	for (level = 0; level < sizeof(fsb_levels) / sizeof(fsb_levels[0]);
+		 level++) {
+		while (nheld < fsb_levels[level]) {
+			result = fsb_open(fs, nheld, O_RDWR|O_CREAT, &held[nheld]);
+			if (result) {
+				kprintf("fsb: creating file %u: %s\n", nheld,
+						strerror(result));
+				goto done;
+			}
+			nheld++;
+		}
+
+		failed = 0;
+		gettime(&before);
+		for (pass = 0; pass < FSB_PASSES; pass++) {
+			for (i = 0; i < nheld; i++) {
+				if (fsb_open(fs, i, O_RDONLY, &vn)) {
+					failed++;
+					continue;
+				}
+				vfs_close(vn);
+			}
+		}
+		gettime(&after);
+		timespec_sub(&after, &before, &duration);
+
+		kprintf("fsb: %u files: %u lookups/sec", nheld,
+				bench_rate(FSB_PASSES * nheld, &duration));
+		if (failed > 0) {
+			kprintf(" (%u failed)", failed);
+		}
+		kprintf("\n");
+	}
+
+ done:
+	for (i = 0; i < nheld; i++) {
+		vfs_close(held[i]);
+		fsb_makename(name, fs, i);
+		vfs_remove(name);
+	}
+	kfree(held);
+
+	return result;
+}
@@ -1,5 +1,6 @@
 #include <types.h>
 #include <thread.h>
+#include <clock.h>
 #include <test.h>
 #include <lib.h>
 
@@ -26,3 +27,27 @@ random_spinner(uint32_t max_spin_count)
 		spin += i;
 	}
 }
+
+/*
+ * Helpers for the benchmarks.
+ */
+
+/* DURATION in nanoseconds. */
+uint64_t
+bench_nsecs(const struct timespec *duration)
+{
+	return (uint64_t)duration->tv_sec * 1000000000ULL + duration->tv_nsec;
+}
+
+/* Rate per second of COUNT operations that took DURATION. */
+unsigned
+bench_rate(unsigned count, const struct timespec *duration)
+{
+	uint64_t nsecs;
+
+	nsecs = bench_nsecs(duration);
+	if (nsecs == 0) {
+		return 0;
+	}
+	return (unsigned)((uint64_t)count * 1000000000ULL / nsecs);
+}
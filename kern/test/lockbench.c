@@ -0,0 +1,118 @@
+/*
+ * Lock benchmark.
+ *
+ * Times lock_acquire/lock_release pairs, first on an uncontended lock
+ * in a single thread and then with several threads sharing one lock.
+ * Like the other benchmarks this reports numbers; the only thing it
+ * checks is that the shared counter came out right.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define LB_PAIRS 100000
+#define LB_THREADSPERCPU 2
+
+static struct lock *lb_lock;
+static struct semaphore *lb_done;
+static volatile unsigned lb_counter;
+
+static void
+lb_report(const char *what, unsigned pairs, const struct timespec *duration)
+{
+	uint64_t nsecs;
+
+	nsecs = bench_nsecs(duration);
+	kprintf("ltb: %s: %u pairs, %llu nsec/pair, %u pairs/sec\n", what,
+			pairs, nsecs / pairs, bench_rate(pairs, duration));
+}
+
+static void
+lb_thread(void *p, unsigned long pairs)
+{
+	unsigned long i;
+
+	(void)p;
+
+	for (i = 0; i < pairs; i++) {
+		lock_acquire(lb_lock);
+		lb_counter++;
+		lock_release(lb_lock);
+	}
+	V(lb_done);
+}
+
+int
+lockbench(int nargs, char **args)
+{
+	struct timespec before, after, duration;
+	unsigned i, nthreads, started, perthread;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	lb_lock = lock_create("ltb");
+	lb_done = sem_create("ltb_done", 0);
+	if (lb_lock == NULL || lb_done == NULL) {
+		kprintf("ltb: out of memory\n");
+		result = ENOMEM;
+		goto out;
+	}
+	result = 0;
+
+	/* Uncontended: every acquire and release takes the fast path. */
+	gettime(&before);
+	for (i = 0; i < LB_PAIRS; i++) {
+		lock_acquire(lb_lock);
+		lock_release(lb_lock);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+	lb_report("uncontended", LB_PAIRS, &duration);
+
+	/* Contended: all the threads fight over the one lock. */
+	nthreads = LB_THREADSPERCPU * cpu_count();
+	perthread = LB_PAIRS / nthreads;
+	lb_counter = 0;
+	started = 0;
+	gettime(&before);
+	for (i = 0; i < nthreads; i++) {
+		result = thread_fork("ltb", NULL, lb_thread, NULL, perthread);
+		if (result) {
+			kprintf("ltb: thread_fork: %s\n", strerror(result));
+			break;
+		}
+		started++;
+	}
+	for (i = 0; i < started; i++) {
+		P(lb_done);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	if (result == 0) {
+		kprintf("ltb: %u threads\n", nthreads);
+		lb_report("contended", perthread * nthreads, &duration);
+		if (lb_counter != perthread * nthreads) {
+			kprintf("ltb: counter is %u, expected %u\n", lb_counter,
+					perthread * nthreads);
+			result = EINVAL;
+		}
+	}
+
+ out:
+	if (lb_lock != NULL) {
+		lock_destroy(lb_lock);
+	}
+	if (lb_done != NULL) {
+		sem_destroy(lb_done);
+	}
+	return result;
+}
@@ -0,0 +1,182 @@
+/*
+ * Scheduler benchmark.
+ *
+ * Measures how long an interactive thread waits between being woken
+ * and actually running, first on an otherwise idle system and then
+ * with CPU-bound hog threads competing for the processors. Two
+ * threads ping-pong on a pair of semaphores; each one timestamps the
+ * wakeup it posts and the other measures the delay when it runs.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define SB_ROUNDS 200
+#define SB_HOGSPERCPU 2
+
+static volatile bool sb_stop;
+static struct semaphore *sb_ping;
+static struct semaphore *sb_pong;
+static struct semaphore *sb_done;
+
+/* When the pending wakeup was posted. */
+static struct timespec sb_posted;
+
+/* Wakeup latency, in nanoseconds. */
+static uint64_t sb_total;
+static uint64_t sb_min;
+static uint64_t sb_max;
+static unsigned sb_count;
+
+/*
+ * Record the latency of the wakeup we just got. Only one of the two
+ * ping-pong threads is ever between its P and its next V, so no lock
+ * is needed.
+ */
+static void
+sb_record(void)
+{
+	struct timespec now, delta;
+	uint64_t nsecs;
+
+	gettime(&now);
+	timespec_sub(&now, &sb_posted, &delta);
+	nsecs = bench_nsecs(&delta);
+
+	sb_total += nsecs;
+	if (sb_count == 0 || nsecs < sb_min) {
+		sb_min = nsecs;
+	}
+	if (nsecs > sb_max) {
+		sb_max = nsecs;
+	}
+	sb_count++;
+}
+
+static void
+sb_hog(void *p, unsigned long n)
+{
+	volatile unsigned spins = 0;
+
+	(void)p;
+	(void)n;
+
+	while (!sb_stop) {
+		spins++;
+	}
+	V(sb_done);
+}
+
+static void
+sb_ponger(void *p, unsigned long rounds)
+{
+	unsigned long i;
+
+	(void)p;
+
+	for (i = 0; i < rounds; i++) {
+		P(sb_ping);
+		sb_record();
+		gettime(&sb_posted);
+		V(sb_pong);
+	}
+	V(sb_done);
+}
+
+/*
+ * Ping-pong SB_ROUNDS times against NHOGS hogs and print the wakeup
+ * latency.
+ */
+static int
+sb_run(unsigned nhogs)
+{
+	unsigned i, nthreads;
+	int result;
+
+	sb_stop = false;
+	sb_total = sb_min = sb_max = 0;
+	sb_count = 0;
+	nthreads = 0;
+
+	for (i = 0; i < nhogs; i++) {
+		result = thread_fork("sb_hog", NULL, sb_hog, NULL, 0);
+		if (result) {
+			kprintf("sb: thread_fork: %s\n", strerror(result));
+			goto done;
+		}
+		nthreads++;
+	}
+	result = thread_fork("sb_ponger", NULL, sb_ponger, NULL, SB_ROUNDS);
+	if (result) {
+		kprintf("sb: thread_fork: %s\n", strerror(result));
+		goto done;
+	}
+	nthreads++;
+
+	for (i = 0; i < SB_ROUNDS; i++) {
+		gettime(&sb_posted);
+		V(sb_ping);
+		P(sb_pong);
+		sb_record();
+	}
+
+	kprintf("sb: %u hogs: wakeup latency min %llu avg %llu max %llu usec\n",
+			nhogs, sb_min / 1000, sb_total / sb_count / 1000, sb_max / 1000);
+
+ done:
+	sb_stop = true;
+	for (i = 0; i < nthreads; i++) {
+		P(sb_done);
+	}
+	return result;
+}
+
+int
+schedbench(int nargs, char **args)
+{
+	unsigned nhogs;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: sb [nhogs]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		nhogs = atoi(args[1]);
+	}
+	else {
+		nhogs = SB_HOGSPERCPU * cpu_count();
+	}
+
+	sb_ping = sem_create("sb_ping", 0);
+	sb_pong = sem_create("sb_pong", 0);
+	sb_done = sem_create("sb_done", 0);
+	if (sb_ping == NULL || sb_pong == NULL || sb_done == NULL) {
+		kprintf("sb: out of memory\n");
+		result = ENOMEM;
+		goto out;
+	}
+
+	result = sb_run(0);
+	if (result == 0 && nhogs > 0) {
+		result = sb_run(nhogs);
+	}
+
+ out:
+	if (sb_ping != NULL) {
+		sem_destroy(sb_ping);
+	}
+	if (sb_pong != NULL) {
+		sem_destroy(sb_pong);
+	}
+	if (sb_done != NULL) {
+		sem_destroy(sb_done);
+	}
+	return result;
+}
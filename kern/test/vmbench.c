@@ -0,0 +1,101 @@
+/*
+ * VM benchmarks.
+ *
+ * These report numbers rather than checking behaviour; compare runs
+ * before and after a change to the VM system.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <mainbus.h>
+#include <test.h>
+
+#define CMB_ITERATIONS 10000
+#define CMB_RUNPAGES 4
+
+static const unsigned cmb_levels[] = { 25, 50, 90 };
+
+/*
+ * Time CMB_ITERATIONS alloc/free pairs of NPAGES pages. Returns the
+ * rate, and the number of failed allocations in *FAILED.
+ */
+static unsigned
+cmb_time(unsigned npages, unsigned *failed)
+{
+	unsigned i;
+	vaddr_t addr;
+	struct timespec before, after, duration;
+
+	*failed = 0;
+	gettime(&before);
+	for (i = 0; i < CMB_ITERATIONS; i++) {
+		addr = alloc_kpages(npages);
+		if (addr == 0) {
+			(*failed)++;
+			continue;
+		}
+		free_kpages(addr);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	return bench_rate(CMB_ITERATIONS, &duration);
+}
+
+/*
+ * Coremap allocation rate at increasing memory occupancy.
+ */
+int
+coremapbench(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	unsigned i, level, total_pages, target, nfill, rate1, raten;
+	unsigned failed1, failedn;
+	vaddr_t *fill;
+
+	total_pages = mainbus_ramsize() / PAGE_SIZE;
+
+	fill = kmalloc(total_pages * sizeof(vaddr_t));
+	if (fill == NULL) {
+		kprintf("cmb: out of memory\n");
+		return ENOMEM;
+	}
+	nfill = 0;
+
+	for (level = 0; level < sizeof(cmb_levels) / sizeof(cmb_levels[0]);
+		 level++) {
+		target = total_pages * cmb_levels[level] / 100;
+
+		while (coremap_used_bytes() / PAGE_SIZE < target) {
+			fill[nfill] = alloc_kpages(1);
+			if (fill[nfill] == 0) {
+				break;
+			}
+			nfill++;
+		}
+
+		rate1 = cmb_time(1, &failed1);
+		raten = cmb_time(CMB_RUNPAGES, &failedn);
+
+		kprintf("cmb: %u%% used (%u/%u pages): %u page allocs/sec, "
+				"%u %u-page allocs/sec",
+				cmb_levels[level], coremap_used_bytes() / PAGE_SIZE,
+				total_pages, rate1, raten, CMB_RUNPAGES);
+		if (failed1 > 0 || failedn > 0) {
+			kprintf(" (%u/%u failed)", failed1, failedn);
+		}
+		kprintf("\n");
+	}
+
+	for (i = 0; i < nfill; i++) {
+		free_kpages(fill[i]);
+	}
+	kfree(fill);
+
+	return 0;
+}
@@ -34,6 +34,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
@@ -50,9 +51,11 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	HZ	/* Reset priorities once a second. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
+#define NSEC_PER_TICK		(1000000000 / HZ)
+
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
@@ -86,24 +89,92 @@ timerclock(void)
 }
 
 /*
- * This is called HZ times a second (on each processor) by the timer
- * code.
+ * Dynamic ticks.
+ *
+ * An idle cpu, or one with a single thread to run, has no use for a
+ * timer interrupt every tick: the scheduler (thread_tick) says how
+ * many ticks it can go without one, and the next hardclock is put off
+ * that long. If a thread is made runnable on the cpu in the meantime,
+ * the cpu is kicked back to the next tick. Either way, hardclock then
+ * works out from the time of day how many ticks really went by.
+ *
+ * c_tickless is protected by the runqueue lock, because other cpus
+ * check it to see whether to kick this one; c_clockdeferred is only
+ * touched by this cpu with interrupts off.
+ */
+void
+hardclock_defer(unsigned nticks)
+{
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (nticks > HARDCLOCK_MAXDEFER) {
+		nticks = HARDCLOCK_MAXDEFER;
+	}
+	if (nticks <= 1) {
+		/* The timer was already reset for one tick. */
+		curcpu->c_tickless = false;
+		return;
+	}
+	gettime(&curcpu->c_clockdeferred);
+	mainbus_set_hardclock(nticks);
+	curcpu->c_tickless = true;
+}
+
+/*
+ * Bring a deferred hardclock back to the next tick. If a tick has
+ * already gone by since the last one, it fires at once.
+ */
+void
+hardclock_kick(void)
+{
+	if (curcpu->c_tickless) {
+		mainbus_set_hardclock(1);
+	}
+}
+
+/*
+ * Number of ticks this hardclock stands for.
+ */
+static
+unsigned
+hardclock_elapsed(void)
+{
+	struct timespec now, delta;
+	unsigned ticks;
+
+	if (!curcpu->c_tickless) {
+		return 1;
+	}
+	gettime(&now);
+	timespec_sub(&now, &curcpu->c_clockdeferred, &delta);
+	ticks = delta.tv_sec * HZ +
+		(delta.tv_nsec + NSEC_PER_TICK / 2) / NSEC_PER_TICK;
+	return ticks > 0 ? ticks : 1;
+}
+
+/*
+ * This is called by the timer code on each processor, HZ times a
+ * second unless the hardclock has been deferred. c_hardclocks counts
+ * ticks, not calls, so the periodic work below is done whenever a
+ * multiple of its period has gone by.
  */
 void
 hardclock(void)
 {
-	/*
-	 * Collect statistics here as desired.
-	 */
+	unsigned then, now;
+
+	then = curcpu->c_hardclocks;
+	now = then + hardclock_elapsed();
+	curcpu->c_hardclocks = now;
+	curcpu->c_clockintrs++;
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
+	if (then / MIGRATE_HARDCLOCKS != now / MIGRATE_HARDCLOCKS) {
 		thread_consider_migration();
 	}
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+	if (then / SCHEDULE_HARDCLOCKS != now / SCHEDULE_HARDCLOCKS) {
 		schedule();
 	}
-	thread_yield();
+	thread_tick(now - then);
 }
 
 /*
@@ -39,6 +39,8 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
+#include <membar.h>
 #include <cpu.h>
 
 ////////////////////////////////////////////////////////////
@@ -139,6 +141,242 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Longest a thread spins waiting for a running holder, in iterations
+ * of lock_spin, before it gives up and sleeps anyway.
+ */
+#define LOCK_MAXSPIN		10000
+
+/*
+ * Contention statistics. Locks with the same name share an entry, so
+ * e.g. all the per-page lp_locks add up together. A lock's name is
+ * looked up the first time it's acquired with counting on, so locks
+ * that come and go while it's off never touch the table. Once the
+ * table is full, new names all share lockstat_other. Counting is off
+ * by default; when it's on, everything goes through lockstat_lock,
+ * which costs a little.
+ */
+#define LOCKSTAT_MAX		128	/* distinct names tracked */
+#define LOCKSTAT_NAMELEN	23	/* longer names are truncated */
+
+struct lockstat {
+	char ls_name[LOCKSTAT_NAMELEN+1];
+	unsigned ls_acquires;
+	unsigned ls_spins;		/* acquires that spun */
+	unsigned ls_sleeps;		/* acquires that slept */
+	uint64_t ls_holdtime;		/* nanoseconds */
+};
+
+static struct lockstat lockstats[LOCKSTAT_MAX];
+static unsigned lockstat_count;
+static struct lockstat lockstat_other = { .ls_name = "(other)" };
+static volatile bool lockstat_on;
+static struct spinlock lockstat_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Compare NAME, truncated the same way, to a stored name.
+ */
+static
+bool
+lockstat_namematch(const char *stored, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN; i++) {
+		if (stored[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			return true;
+		}
+	}
+	return true;
+}
+
+/*
+ * Find or make the entry for NAME.
+ */
+static
+struct lockstat *
+lockstat_find(const char *name)
+{
+	struct lockstat *ls;
+	unsigned i;
+
+	ls = NULL;
+	spinlock_acquire(&lockstat_lock);
+	for (i=0; i<lockstat_count; i++) {
+		if (lockstat_namematch(lockstats[i].ls_name, name)) {
+			ls = &lockstats[i];
+			break;
+		}
+	}
+	if (ls == NULL) {
+		if (lockstat_count < LOCKSTAT_MAX) {
+			ls = &lockstats[lockstat_count++];
+			for (i=0; i<LOCKSTAT_NAMELEN && name[i] != 0; i++) {
+				ls->ls_name[i] = name[i];
+			}
+			ls->ls_name[i] = 0;
+		}
+		else {
+			ls = &lockstat_other;
+		}
+	}
+	spinlock_release(&lockstat_lock);
+	return ls;
+}
+
+/*
+ * Record an acquire of LOCK by the current thread, and start timing
+ * the hold. Only the holder touches lk_stat, so it needs no lock.
+ */
+static
+void
+lockstat_acquired(struct lock *lock, bool spun, bool slept)
+{
+	struct lockstat *ls;
+
+	if (lock->lk_stat == NULL) {
+		lock->lk_stat = lockstat_find(lock->lk_name);
+	}
+	ls = lock->lk_stat;
+
+	gettime(&lock->lk_acquired);
+	lock->lk_timed = true;
+
+	spinlock_acquire(&lockstat_lock);
+	ls->ls_acquires++;
+	if (spun) {
+		ls->ls_spins++;
+	}
+	if (slept) {
+		ls->ls_sleeps++;
+	}
+	spinlock_release(&lockstat_lock);
+}
+
+/*
+ * LOCK is about to be released; charge its hold time.
+ */
+static
+void
+lockstat_released(struct lock *lock)
+{
+	struct timespec now, held;
+
+	lock->lk_timed = false;
+	gettime(&now);
+	timespec_sub(&now, &lock->lk_acquired, &held);
+
+	spinlock_acquire(&lockstat_lock);
+	lock->lk_stat->ls_holdtime +=
+		(uint64_t)held.tv_sec * 1000000000ULL + held.tv_nsec;
+	spinlock_release(&lockstat_lock);
+}
+
+void
+lockstat_enable(bool on)
+{
+	unsigned i;
+
+	spinlock_acquire(&lockstat_lock);
+	if (on) {
+		for (i=0; i<lockstat_count; i++) {
+			lockstats[i].ls_acquires = 0;
+			lockstats[i].ls_spins = 0;
+			lockstats[i].ls_sleeps = 0;
+			lockstats[i].ls_holdtime = 0;
+		}
+		lockstat_other.ls_acquires = 0;
+		lockstat_other.ls_spins = 0;
+		lockstat_other.ls_sleeps = 0;
+		lockstat_other.ls_holdtime = 0;
+	}
+	lockstat_on = on;
+	spinlock_release(&lockstat_lock);
+}
+
+void
+lockstat_print(void)
+{
+	struct lockstat ls;
+	unsigned i, count;
+
+	spinlock_acquire(&lockstat_lock);
+	count = lockstat_count;
+	spinlock_release(&lockstat_lock);
+
+	kprintf("lockstat: collection is %s\n", lockstat_on ? "on" : "off");
+	/* The last one round is lockstat_other. */
+	for (i=0; i<=count; i++) {
+		/* Copy the entry out; can't kprintf holding a spinlock. */
+		spinlock_acquire(&lockstat_lock);
+		ls = i < count ? lockstats[i] : lockstat_other;
+		spinlock_release(&lockstat_lock);
+
+		if (ls.ls_acquires == 0) {
+			continue;
+		}
+		kprintf("%-24s %8u acquires %8u spun %8u slept "
+			"%8llu usec avg hold\n", ls.ls_name,
+			ls.ls_acquires, ls.ls_spins, ls.ls_sleeps,
+			ls.ls_holdtime / ls.ls_acquires / 1000);
+	}
+}
+
+/*
+ * The lock word. LOCK_HELD is set while someone has the lock;
+ * LOCK_WAITERS is set while threads may be asleep on lk_wchan, and
+ * sends lock_release down the slow path to wake one. Both fast paths
+ * are a single compare-and-swap; everything else happens under
+ * lk_spinlock.
+ */
+#define LOCK_HELD	0x1
+#define LOCK_WAITERS	0x2
+
+/*
+ * Is HOLDER, which had LOCK when we last looked, running?
+ *
+ * HOLDER is read without any lock. The fast path releases without
+ * lk_spinlock, so HOLDER may have let go, exited and been freed by
+ * exorcise since lk_holder was read, and its t_state may be garbage.
+ * A thread can't exit holding a lock, though, so if lk_holder still
+ * points to HOLDER after t_state has been read, the value read was
+ * HOLDER's own.
+ */
+static
+bool
+lock_holder_running(struct lock *lock, struct thread *holder)
+{
+	threadstate_t state;
+
+	state = holder->t_state;
+	membar_load_load();
+	return lock->lk_holder == holder && state == S_RUN;
+}
+
+/*
+ * Wait for LOCK while HOLDER, which was running on another cpu, still
+ * has it. Returns when the lock looks free, changes hands, or the
+ * holder stops running, or after LOCK_MAXSPIN tries; the caller
+ * rechecks with the spinlock held.
+ */
+static
+void
+lock_spin(struct lock *lock, struct thread *holder)
+{
+	unsigned i;
+
+	for (i=0; i<LOCK_MAXSPIN; i++) {
+		membar_load_load();
+		if ((spinlock_data_get(&lock->lk_word) & LOCK_HELD) == 0 ||
+		    !lock_holder_running(lock, holder)) {
+			return;
+		}
+	}
+}
+
 struct lock *
 lock_create(const char *name)
 {
@@ -163,8 +401,11 @@ lock_create(const char *name)
 	}
 
     spinlock_init(&lock->lk_spinlock);
-    lock->lk_var = 0;
+    spinlock_data_set(&lock->lk_word, 0);
+    lock->lk_nwaiters = 0;
     lock->lk_holder = NULL;
+    lock->lk_stat = NULL;
+    lock->lk_timed = false;
 	HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
 
 	return lock;
@@ -175,6 +416,7 @@ lock_destroy(struct lock *lock)
 {
 	KASSERT(lock != NULL);
     KASSERT(lock->lk_holder == NULL);
+    KASSERT(spinlock_data_get(&lock->lk_word) == 0);
 
     spinlock_cleanup(&lock->lk_spinlock);
     wchan_destroy(lock->lk_wchan);
@@ -187,7 +429,9 @@ lock_acquire(struct lock *lock)
 {
     KASSERT(lock != NULL);
 
-    struct thread *mythread;
+    struct thread *mythread, *holder, *spunfor;
+    spinlock_data_t word;
+    bool spun, slept;
 
     if (CURCPU_EXISTS()) {
         mythread = curcpu->c_curthread;
@@ -199,15 +443,94 @@ lock_acquire(struct lock *lock)
         mythread = NULL;
     }
 
-    spinlock_acquire(&lock->lk_spinlock);
+    spun = slept = false;
     HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
-    while (lock->lk_var == 1) {
+
+    /* Fast path: the lock is free and nobody is waiting for it. */
+    if (spinlock_data_compareandswap(&lock->lk_word, 0, LOCK_HELD)) {
+        membar_any_any();
+        lock->lk_holder = mythread;
+        HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+        goto acquired;
+    }
+
+    spunfor = NULL;
+    spinlock_acquire(&lock->lk_spinlock);
+    for (;;) {
+        word = spinlock_data_get(&lock->lk_word);
+        if ((word & LOCK_HELD) == 0) {
+            /*
+             * Free. If others are still asleep, leave the waiter
+             * bit set so that our release wakes one of them.
+             */
+            if (spinlock_data_compareandswap(&lock->lk_word, word,
+                    LOCK_HELD |
+                    (lock->lk_nwaiters > 0 ? LOCK_WAITERS : 0))) {
+                break;
+            }
+            continue;
+        }
+
+        /*
+         * If the holder is running (necessarily on another cpu),
+         * it'll probably let go before a sleep and wakeup would
+         * even finish, so spin instead, once per holder. Spinners
+         * don't hold the spinlock, so the holder can get at it to
+         * release.
+         */
+        holder = lock->lk_holder;
+        if (mythread != NULL && holder != NULL && holder != spunfor &&
+            lock_holder_running(lock, holder)) {
+            spinlock_release(&lock->lk_spinlock);
+            lock_spin(lock, holder);
+            spunfor = holder;
+            spun = true;
+            spinlock_acquire(&lock->lk_spinlock);
+            continue;
+        }
+
+        /* Sleep. Set the waiter bit first so the release wakes us. */
+        if ((word & LOCK_WAITERS) == 0 &&
+            !spinlock_data_compareandswap(&lock->lk_word, word,
+                                          word | LOCK_WAITERS)) {
+            continue;
+        }
+        slept = true;
+        lock->lk_nwaiters++;
 		wchan_sleep(lock->lk_wchan, &lock->lk_spinlock);
+        lock->lk_nwaiters--;
     }
-    lock->lk_var = 1;
     lock->lk_holder = mythread;
     HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
     spinlock_release(&lock->lk_spinlock);
+
+ acquired:
+    if (lockstat_on) {
+        lockstat_acquired(lock, spun, slept);
+    }
+}
+
+/*
+ * Take LOCK if it's free, without spinning or sleeping. Since it
+ * never blocks it may be called with a spinlock held.
+ */
+bool
+lock_tryacquire(struct lock *lock)
+{
+    KASSERT(lock != NULL);
+
+    if (!spinlock_data_compareandswap(&lock->lk_word, 0, LOCK_HELD)) {
+        return false;
+    }
+    membar_any_any();
+    lock->lk_holder = CURCPU_EXISTS() ? curcpu->c_curthread : NULL;
+    HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+    HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+
+    if (lockstat_on) {
+        lockstat_acquired(lock, false, false);
+    }
+    return true;
 }
 
 void
@@ -217,15 +540,30 @@ lock_release(struct lock *lock)
 
     if (CURCPU_EXISTS()) {
         KASSERT(lock->lk_holder == curcpu->c_curthread);
-        KASSERT(lock->lk_var == 1);
+        KASSERT(spinlock_data_get(&lock->lk_word) & LOCK_HELD);
+    }
+
+    if (lock->lk_timed) {
+        lockstat_released(lock);
     }
 
-	spinlock_acquire(&lock->lk_spinlock);
-    lock->lk_var = 0;
-	KASSERT(lock->lk_var != 1);
-	wchan_wakeone(lock->lk_wchan, &lock->lk_spinlock);
     lock->lk_holder = NULL;
     HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
+    membar_any_any();
+
+    /* Fast path: nobody waiting, so no wakeup to do. */
+    if (spinlock_data_compareandswap(&lock->lk_word, LOCK_HELD, 0)) {
+        return;
+    }
+
+    /*
+     * Someone may be asleep. Sleepers only change the word with
+     * the spinlock held, and we hold the lock, so a plain store
+     * does here.
+     */
+	spinlock_acquire(&lock->lk_spinlock);
+    spinlock_data_set(&lock->lk_word, 0);
+	wchan_wakeone(lock->lk_wchan, &lock->lk_spinlock);
 	spinlock_release(&lock->lk_spinlock);
 }
 
@@ -353,18 +691,9 @@ rwlock_create(const char *name)
         return NULL;
     }
 
-    rwlock->rwlock_wlk = lock_create("rwlock_wlk");
-    if (rwlock->rwlock_wlk == NULL) {
-        lock_destroy(rwlock->rwlock_lk);
-        kfree(rwlock->rwlock_name);
-        kfree(rwlock);
-        return NULL;
-    }
-
     rwlock->rwlock_cv = cv_create("rwlock_cv");
     if (rwlock->rwlock_cv == NULL) {
         lock_destroy(rwlock->rwlock_lk);
-        lock_destroy(rwlock->rwlock_wlk);
         kfree(rwlock->rwlock_name);
         kfree(rwlock);
         return NULL;
@@ -373,7 +702,6 @@ rwlock_create(const char *name)
     rwlock->rwlock_wcv = cv_create("rwlock_wcv");
     if (rwlock->rwlock_wcv == NULL) {
         lock_destroy(rwlock->rwlock_lk);
-        lock_destroy(rwlock->rwlock_wlk);
         cv_destroy(rwlock->rwlock_cv);
         kfree(rwlock->rwlock_name);
         kfree(rwlock);
@@ -384,6 +712,7 @@ rwlock_create(const char *name)
     rwlock->rwlock_numreaders = 0;
     rwlock->rwlock_rwaiting = 0;
     rwlock->rwlock_wwaiting = 0;
+    rwlock->rwlock_readturn = false;
 
     return rwlock;
 }
@@ -393,15 +722,25 @@ rwlock_destroy(struct rwlock *rwlock)
 {
     KASSERT(rwlock != NULL);
     KASSERT(!rwlock->rwlock_wlocked && rwlock->rwlock_numreaders == 0);
+    KASSERT(rwlock->rwlock_rwaiting == 0 && rwlock->rwlock_wwaiting == 0);
 
     cv_destroy(rwlock->rwlock_cv);
     cv_destroy(rwlock->rwlock_wcv);
     lock_destroy(rwlock->rwlock_lk);
-    lock_destroy(rwlock->rwlock_wlk);
     kfree(rwlock->rwlock_name);
     kfree(rwlock);
 }
 
+/*
+ * All the state is protected by rwlock_lk. Readers wait on rwlock_cv,
+ * writers on rwlock_wcv.
+ *
+ * New readers hold off while a writer is waiting, so writers don't
+ * starve. When a writer releases the lock with readers waiting, it
+ * gives those readers a turn (rwlock_readturn) even if more writers
+ * are queued, so readers don't starve either; the turn ends when the
+ * waiting readers have all got in or a writer gets the lock.
+ */
 void
 rwlock_acquire_read(struct rwlock *rwlock)
 {
@@ -409,10 +748,14 @@ rwlock_acquire_read(struct rwlock *rwlock)
 
     lock_acquire(rwlock->rwlock_lk);
     rwlock->rwlock_rwaiting++;
-    if (rwlock->rwlock_wlocked || rwlock->rwlock_wwaiting > 0) {
+    while (rwlock->rwlock_wlocked ||
+           (rwlock->rwlock_wwaiting > 0 && !rwlock->rwlock_readturn)) {
         cv_wait(rwlock->rwlock_cv, rwlock->rwlock_lk);
     }
     rwlock->rwlock_rwaiting--;
+    if (rwlock->rwlock_rwaiting == 0) {
+        rwlock->rwlock_readturn = false;
+    }
 	rwlock->rwlock_numreaders += 1;
     lock_release(rwlock->rwlock_lk);
 }
@@ -421,18 +764,12 @@ void
 rwlock_release_read(struct rwlock *rwlock)
 {
     KASSERT(rwlock != NULL);
-    KASSERT(rwlock->rwlock_numreaders > 0);
 
     lock_acquire(rwlock->rwlock_lk);
+    KASSERT(rwlock->rwlock_numreaders > 0);
     rwlock->rwlock_numreaders -= 1;
-    if (rwlock->rwlock_numreaders == 0) {
-        if (rwlock->rwlock_wwaiting > 0) {
-            lock_acquire(rwlock->rwlock_wlk);
-            cv_signal(rwlock->rwlock_wcv, rwlock->rwlock_wlk);
-            lock_release(rwlock->rwlock_wlk);
-        } else {
-            cv_broadcast(rwlock->rwlock_cv, rwlock->rwlock_lk);
-        }
+    if (rwlock->rwlock_numreaders == 0 && rwlock->rwlock_wwaiting > 0) {
+        cv_signal(rwlock->rwlock_wcv, rwlock->rwlock_lk);
     }
     lock_release(rwlock->rwlock_lk);
 }
@@ -442,30 +779,30 @@ rwlock_acquire_write(struct rwlock *rwlock)
 {
     KASSERT(rwlock != NULL);
 
-    lock_acquire(rwlock->rwlock_wlk);
+    lock_acquire(rwlock->rwlock_lk);
     rwlock->rwlock_wwaiting += 1;
 	while (rwlock->rwlock_wlocked || rwlock->rwlock_numreaders > 0) {
-		cv_wait(rwlock->rwlock_wcv, rwlock->rwlock_wlk);
+		cv_wait(rwlock->rwlock_wcv, rwlock->rwlock_lk);
     }
     rwlock->rwlock_wwaiting -= 1;
     rwlock->rwlock_wlocked = 1;
-    lock_release(rwlock->rwlock_wlk);
+    rwlock->rwlock_readturn = false;
+    lock_release(rwlock->rwlock_lk);
 }
 
 void
 rwlock_release_write(struct rwlock *rwlock)
 {
     KASSERT(rwlock != NULL);
-    KASSERT(rwlock->rwlock_wlocked);
 
-    lock_acquire(rwlock->rwlock_wlk);
+    lock_acquire(rwlock->rwlock_lk);
+    KASSERT(rwlock->rwlock_wlocked);
     rwlock->rwlock_wlocked = 0;
 	if (rwlock->rwlock_rwaiting > 0) {
-		lock_acquire(rwlock->rwlock_lk);
+        rwlock->rwlock_readturn = true;
     	cv_broadcast(rwlock->rwlock_cv, rwlock->rwlock_lk);
-		lock_release(rwlock->rwlock_lk);
 	} else if (rwlock->rwlock_wwaiting > 0) {
-		cv_signal(rwlock->rwlock_wcv, rwlock->rwlock_wlk);
+		cv_signal(rwlock->rwlock_wcv, rwlock->rwlock_lk);
     }
-    lock_release(rwlock->rwlock_wlk);
+    lock_release(rwlock->rwlock_lk);
 }
@@ -39,6 +39,7 @@
 #include <array.h>
 #include <cpu.h>
 #include <spl.h>
+#include <clock.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
@@ -147,6 +148,11 @@ thread_create(const char *name)
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
+	/* New threads start at the top level. */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastrun = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -184,11 +190,18 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_clockintrs = 0;
+	c->c_intrs = 0;
+	c->c_switches = 0;
 
 	c->c_isidle = false;
+	c->c_tickless = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
 
+	c->c_numframes = 0;
+	spinlock_init(&c->c_frames_lock);
+
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
@@ -257,6 +270,34 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+void
+cpu_printstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	/* The counters are read unlocked; they're only statistics. */
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: %u ticks, %u timer interrupts, "
+			"%u interrupts, %u context switches\n",
+			c->c_number, c->c_hardclocks, c->c_clockintrs,
+			c->c_intrs, c->c_switches);
+	}
+}
+
+struct cpu *
+cpu_get(unsigned number)
+{
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -455,6 +496,173 @@ thread_start_cpus(void)
 	thread_count = 1;
 }
 
+/*
+ * Put T on C's run queue, behind every thread at the same or a higher
+ * priority level. The run queue is thus the concatenation of one FIFO
+ * per level, and the head is always the thread to run next. Searching
+ * from the tail makes the usual case (the lowest level) cheap.
+ *
+ * If C is idle, or has put off its hardclock because it had nothing
+ * else to run, it is kicked so it notices the new thread.
+ */
+static
+void
+thread_enqueue(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (tln = c->c_runqueue.tl_tail.tln_prev;
+	     tln->tln_self != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_priority <= t->t_priority) {
+			threadlist_insertafter(&c->c_runqueue,
+					       tln->tln_self, t);
+			goto queued;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+
+ queued:
+	if (c != curcpu->c_self) {
+		if (c->c_isidle || c->c_tickless) {
+			ipi_send(c, IPI_UNIDLE);
+		}
+	}
+	else if (c->c_tickless) {
+		hardclock_kick();
+	}
+}
+
+/*
+ * BUSY has just been handed a thread it can't run right away. Idle
+ * cpus no longer wake up every tick to look for work to steal, so
+ * poke one. c_isidle is read unlocked; it's only a hint.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * A thread that ran on C within the last THREAD_CACHEHOT_TICKS
+ * hardclocks probably still has its working set in C's cache, so
+ * moving it elsewhere costs more than usual.
+ *
+ * C's hardclock count is read without a lock; being off by a tick
+ * doesn't matter here.
+ */
+#define THREAD_CACHEHOT_TICKS	2
+
+static
+bool
+thread_cachehot(struct cpu *c, struct thread *t)
+{
+	return c->c_hardclocks - t->t_lastrun < THREAD_CACHEHOT_TICKS;
+}
+
+/*
+ * Work stealing. Called from thread_switch by a cpu that has nothing
+ * to run, before it idles, with no runqueue lock held. Looks for the
+ * busiest other cpu and moves one of its ready threads here. Returns
+ * true if it did.
+ *
+ * The run queue lengths are read without locking, as a hint, so only
+ * the one cpu we actually steal from gets locked. To avoid deadlock
+ * we never hold two runqueue locks at once; the stolen thread is off
+ * every list briefly in between, which is harmless since it is
+ * S_READY and nothing else looks for it.
+ *
+ * The victim's tail holds its lowest-priority threads, which would
+ * wait longest, so we search from there for one that isn't cache-hot.
+ * A hot thread is taken only if the victim has others waiting too,
+ * since then some of them won't run soon anyway. Threads on an idle
+ * cpu's queue are left alone: that cpu is about to run them itself.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct threadlistnode *tln;
+	struct thread *t, *fallback;
+	unsigned i, numcpus, most;
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=1; i<numcpus; i++) {
+		/* Start after ourselves, so idle cpus spread out. */
+		c = cpuarray_get(&allcpus, (curcpu->c_number + i) % numcpus);
+		if (!c->c_isidle && c->c_runqueue.tl_count > most) {
+			most = c->c_runqueue.tl_count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = fallback = NULL;
+	if (!victim->c_isidle) {
+		for (tln = victim->c_runqueue.tl_tail.tln_prev;
+		     tln->tln_self != NULL;
+		     tln = tln->tln_prev) {
+			/*
+			 * The victim's curthread can be on its run
+			 * queue while it is still unidling (see
+			 * thread_consider_migration); its stack is in
+			 * use, so never take it.
+			 */
+			if (tln->tln_self == victim->c_curthread) {
+				continue;
+			}
+			if (!thread_cachehot(victim, tln->tln_self)) {
+				t = tln->tln_self;
+				break;
+			}
+			if (fallback == NULL) {
+				fallback = tln->tln_self;
+			}
+		}
+		if (t == NULL && victim->c_runqueue.tl_count > 1) {
+			t = fallback;
+		}
+	}
+	if (t != NULL) {
+		threadlist_remove(&victim->c_runqueue, t);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return false;
+	}
+
+	KASSERT(t->t_state == S_READY);
+	t->t_cpu = curcpu->c_self;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	thread_enqueue(curcpu->c_self, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -479,14 +687,11 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	thread_enqueue(targetcpu, target);
 
-	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
+	if (!already_have_lock && !targetcpu->c_isidle) {
+		/* A wakeup on a busy cpu; maybe someone can steal it. */
+		thread_kick_idle(targetcpu);
 	}
 
 	if (!already_have_lock) {
@@ -602,6 +807,16 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/*
+	 * If yielding with nothing else to run, don't even take the
+	 * lock. The count is read unlocked, so a thread being added
+	 * right now can be missed; it'll be seen at the next tick.
+	 */
+	if (newstate == S_READY && curcpu->c_runqueue.tl_count == 0) {
+		splx(spl);
+		return;
+	}
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
@@ -621,6 +836,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+		/*
+		 * Blocking is what interactive threads do; move up a
+		 * level and start a fresh quantum.
+		 */
+		if (cur->t_priority > 0) {
+			cur->t_priority--;
+		}
+		cur->t_ticks = 0;
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -662,12 +885,20 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/* Remember when cur last had the cpu, for cache affinity. */
+	cur->t_lastrun = curcpu->c_hardclocks;
+	if (next != cur) {
+		curcpu->c_switches++;
+	}
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -850,17 +1081,95 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Ready threads are kept on the run queue in priority order (see
+ * thread_enqueue). Level N gets a quantum of THREAD_QUANTUM(N)
+ * hardclocks: short at the top, where interactive threads live, and
+ * longer further down, where CPU-bound threads sink.
  */
+#define THREAD_QUANTUM(prio)	(1U << (prio))
 
+/*
+ * Account for one hardclock of the current thread. If it has used up
+ * its quantum it drops a level and goes to the back of the new level;
+ * if a thread at a higher level has become ready, it is preempted
+ * right away.
+ */
 void
-schedule(void)
+thread_tick(unsigned ticks)
 {
+	struct thread *cur, *head;
+	bool preempt;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/*
+		 * The timer interrupted the idle loop; nobody to
+		 * charge. Sleep until there's something to do.
+		 */
+		hardclock_defer(threadlist_isempty(&curcpu->c_runqueue) ?
+				HARDCLOCK_MAXDEFER : 1);
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+
+	preempt = false;
+	cur->t_ticks += ticks;
+	if (cur->t_ticks >= THREAD_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < THREAD_NPRIO - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		preempt = true;
+	}
+	else if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		head = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+		if (head->t_priority < cur->t_priority) {
+			preempt = true;
+		}
+	}
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * A thread alone on its cpu needs no ticks until its quantum
+	 * runs out.
 	 */
+	if (threadlist_isempty(&curcpu->c_runqueue)) {
+		hardclock_defer(THREAD_QUANTUM(cur->t_priority) - cur->t_ticks);
+	}
+	else {
+		hardclock_defer(1);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * This is called periodically from hardclock(). To keep threads at
+ * the bottom levels from starving, it puts every thread on the
+ * current CPU back at the top. Sleeping threads are left alone; they
+ * are moving up anyway.
+ */
+void
+schedule(void)
+{
+	struct threadlistnode *tln;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (tln = curcpu->c_runqueue.tl_head.tln_next;
+	     tln->tln_self != NULL;
+	     tln = tln->tln_next) {
+		tln->tln_self->t_priority = 0;
+		tln->tln_self->t_ticks = 0;
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
@@ -952,18 +1261,11 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			thread_enqueue(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
 			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -976,7 +1278,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			thread_enqueue(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1227,8 +1529,10 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt. If it had put off its hardclock, bring
+		 * that back so whatever it was sent gets scheduled.
 		 */
+		hardclock_kick();
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		/*
@@ -43,6 +43,11 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <clock.h>
+#include <thread.h>
+
+/* Seconds between syncer runs */
+#define VFS_SYNCER_INTERVAL 5
 
 /*
  * Structure for a single named device.
@@ -112,6 +117,8 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_nc_bootstrap();
+
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -190,6 +197,35 @@ vfs_sync(void)
 	return 0;
 }
 
+/*
+ * Syncer thread: filesystems keep written data in memory, so push it
+ * out every VFS_SYNCER_INTERVAL seconds to bound what a crash loses.
+ */
+static
+void
+vfs_syncer(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(VFS_SYNCER_INTERVAL);
+		vfs_sync();
+	}
+}
+
+void
+vfs_syncer_start(void)
+{
+	int result;
+
+	result = thread_fork("syncer", NULL, vfs_syncer, NULL, 0);
+	if (result) {
+		panic("vfs: Could not start syncer thread: %s\n",
+		      strerror(result));
+	}
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
@@ -301,6 +337,29 @@ vfs_getdevname(struct fs *fs)
 	return NULL;
 }
 
+/*
+ * Print the statistics of every device that keeps any.
+ */
+void
+vfs_printdevstats(void)
+{
+	struct knowndev *kd;
+	unsigned i, num;
+
+	vfs_biglock_acquire();
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		kd = knowndevarray_get(knowndevs, i);
+		if (kd->kd_device != NULL &&
+		    kd->kd_device->d_ops->devop_printstats != NULL) {
+			kd->kd_device->d_ops->devop_printstats(kd->kd_device);
+		}
+	}
+
+	vfs_biglock_release();
+}
+
 /*
  * Assemble the name for a raw device from the name for the regular device.
  */
@@ -654,6 +713,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* the name cache holds vnodes; let them go before syncing */
+	vfs_nc_purgefs(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -745,6 +807,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_nc_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
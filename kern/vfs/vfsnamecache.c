@@ -0,0 +1,348 @@
+/*
+ * Directory name lookup cache.
+ *
+ * Maps (directory vnode, name) to the vnode the name refers to, or
+ * to "no such file" for a negative entry. Filesystems call
+ * vfs_nc_lookup before searching a directory and vfs_nc_enter with
+ * the answer afterwards, and must call vfs_nc_remove whenever they
+ * add, remove, or rename a name.
+ *
+ * Each entry holds a reference to its directory and (unless
+ * negative) to its target, so neither can be reclaimed and have its
+ * address reused while the entry exists. Entries are recycled in LRU
+ * order; vfs_nc_purgefs drops everything for a volume so it can be
+ * unmounted.
+ *
+ * Names longer than NC_NAMELEN aren't cached.
+ *
+ * References are dropped only after the cache lock is released,
+ * because VOP_DECREF can call into the filesystem's reclaim.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define NC_SIZE		512	/* number of entries */
+#define NC_HASHSIZE	128	/* hash buckets (power of 2) */
+#define NC_NAMELEN	31	/* longest name cached */
+
+struct nc_entry {
+	struct vnode *nc_dir;		/* directory; NULL if entry is free */
+	struct vnode *nc_vn;		/* target; NULL if negative */
+	char nc_name[NC_NAMELEN+1];
+	unsigned nc_hash;
+	struct nc_entry *nc_hashnext;
+	struct nc_entry *nc_lruprev;	/* toward least recently used */
+	struct nc_entry *nc_lrunext;	/* toward most recently used */
+};
+
+static struct nc_entry nc_entries[NC_SIZE];
+static struct nc_entry *nc_hash[NC_HASHSIZE];
+static struct nc_entry *nc_lruhead;	/* least recently used */
+static struct nc_entry *nc_lrutail;	/* most recently used */
+static struct lock *nc_lock;
+
+/* Statistics */
+static unsigned nc_hits;
+static unsigned nc_neghits;
+static unsigned nc_misses;
+static unsigned nc_enters;
+static unsigned nc_removes;
+
+static
+unsigned
+nc_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h = (unsigned)(uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h * 31 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+static
+void
+nc_lru_remove(struct nc_entry *e)
+{
+	if (e->nc_lruprev != NULL) {
+		e->nc_lruprev->nc_lrunext = e->nc_lrunext;
+	}
+	else {
+		nc_lruhead = e->nc_lrunext;
+	}
+	if (e->nc_lrunext != NULL) {
+		e->nc_lrunext->nc_lruprev = e->nc_lruprev;
+	}
+	else {
+		nc_lrutail = e->nc_lruprev;
+	}
+	e->nc_lruprev = e->nc_lrunext = NULL;
+}
+
+static
+void
+nc_lru_append(struct nc_entry *e)
+{
+	e->nc_lruprev = nc_lrutail;
+	e->nc_lrunext = NULL;
+	if (nc_lrutail != NULL) {
+		nc_lrutail->nc_lrunext = e;
+	}
+	else {
+		nc_lruhead = e;
+	}
+	nc_lrutail = e;
+}
+
+/*
+ * Find the entry for (DIR, NAME), or NULL.
+ */
+static
+struct nc_entry *
+nc_find(struct vnode *dir, const char *name, unsigned hash)
+{
+	struct nc_entry *e;
+
+	KASSERT(lock_do_i_hold(nc_lock));
+
+	for (e = nc_hash[hash % NC_HASHSIZE]; e != NULL; e = e->nc_hashnext) {
+		if (e->nc_hash == hash && e->nc_dir == dir &&
+		    !strcmp(e->nc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Unhook E and make it free. Its references are handed back in
+ * *DIR and *VN for the caller to drop once the lock is released.
+ */
+static
+void
+nc_kill(struct nc_entry *e, struct vnode **dir, struct vnode **vn)
+{
+	struct nc_entry **ep;
+
+	KASSERT(lock_do_i_hold(nc_lock));
+	KASSERT(e->nc_dir != NULL);
+
+	for (ep = &nc_hash[e->nc_hash % NC_HASHSIZE]; *ep != e;
+	     ep = &(*ep)->nc_hashnext) {
+		KASSERT(*ep != NULL);
+	}
+	*ep = e->nc_hashnext;
+	e->nc_hashnext = NULL;
+
+	*dir = e->nc_dir;
+	*vn = e->nc_vn;
+	e->nc_dir = NULL;
+	e->nc_vn = NULL;
+
+	/* Free entries go at the head so they're reused first. */
+	nc_lru_remove(e);
+	e->nc_lrunext = nc_lruhead;
+	if (nc_lruhead != NULL) {
+		nc_lruhead->nc_lruprev = e;
+	}
+	else {
+		nc_lrutail = e;
+	}
+	nc_lruhead = e;
+}
+
+static
+void
+nc_release(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Setup function.
+ */
+void
+vfs_nc_bootstrap(void)
+{
+	unsigned i;
+
+	nc_lock = lock_create("vfs_nc");
+	if (nc_lock == NULL) {
+		panic("vfs: Could not create name cache lock\n");
+	}
+	for (i=0; i<NC_HASHSIZE; i++) {
+		nc_hash[i] = NULL;
+	}
+	nc_lruhead = nc_lrutail = NULL;
+	for (i=0; i<NC_SIZE; i++) {
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_vn = NULL;
+		nc_entries[i].nc_hashnext = NULL;
+		nc_lru_append(&nc_entries[i]);
+	}
+}
+
+/*
+ * Look up NAME in DIR. Returns true on a hit; *RET is then the vnode,
+ * with a reference for the caller, or NULL if the name is known not
+ * to exist. Returns false if the cache doesn't know.
+ */
+bool
+vfs_nc_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct nc_entry *e;
+	unsigned hash;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return false;
+	}
+	hash = nc_hashfunc(dir, name);
+
+	lock_acquire(nc_lock);
+	e = nc_find(dir, name, hash);
+	if (e == NULL) {
+		nc_misses++;
+		lock_release(nc_lock);
+		return false;
+	}
+	if (e->nc_vn != NULL) {
+		nc_hits++;
+		VOP_INCREF(e->nc_vn);
+	}
+	else {
+		nc_neghits++;
+	}
+	*ret = e->nc_vn;
+	nc_lru_remove(e);
+	nc_lru_append(e);
+	lock_release(nc_lock);
+	return true;
+}
+
+/*
+ * Record that NAME in DIR is VN, or doesn't exist if VN is NULL.
+ * The caller keeps its own references.
+ */
+void
+vfs_nc_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct nc_entry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	unsigned hash;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return;
+	}
+	hash = nc_hashfunc(dir, name);
+
+	lock_acquire(nc_lock);
+	e = nc_find(dir, name, hash);
+	if (e != NULL) {
+		/* Replace whatever was there */
+		nc_kill(e, &olddir, &oldvn);
+	}
+
+	/* Take the least recently used entry, evicting it if needed. */
+	e = nc_lruhead;
+	KASSERT(e != NULL);
+	if (e->nc_dir != NULL) {
+		KASSERT(olddir == NULL);
+		nc_kill(e, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	e->nc_dir = dir;
+	e->nc_vn = vn;
+	strcpy(e->nc_name, name);
+	e->nc_hash = hash;
+	e->nc_hashnext = nc_hash[hash % NC_HASHSIZE];
+	nc_hash[hash % NC_HASHSIZE] = e;
+	nc_lru_remove(e);
+	nc_lru_append(e);
+	nc_enters++;
+	lock_release(nc_lock);
+
+	nc_release(olddir, oldvn);
+}
+
+/*
+ * Forget NAME in DIR, positive or negative.
+ */
+void
+vfs_nc_remove(struct vnode *dir, const char *name)
+{
+	struct nc_entry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return;
+	}
+
+	lock_acquire(nc_lock);
+	e = nc_find(dir, name, nc_hashfunc(dir, name));
+	if (e != NULL) {
+		nc_kill(e, &olddir, &oldvn);
+		nc_removes++;
+	}
+	lock_release(nc_lock);
+
+	nc_release(olddir, oldvn);
+}
+
+/*
+ * Drop every entry whose directory is on FS, so the references the
+ * cache holds don't keep it from being unmounted.
+ */
+void
+vfs_nc_purgefs(struct fs *fs)
+{
+	struct nc_entry *e;
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	/*
+	 * Drop one at a time: releasing a reference can reclaim a
+	 * vnode, which may take filesystem locks.
+	 */
+	for (i=0; i<NC_SIZE; i++) {
+		e = &nc_entries[i];
+		olddir = oldvn = NULL;
+
+		lock_acquire(nc_lock);
+		if (e->nc_dir != NULL && e->nc_dir->vn_fs == fs) {
+			nc_kill(e, &olddir, &oldvn);
+		}
+		lock_release(nc_lock);
+
+		nc_release(olddir, oldvn);
+	}
+}
+
+/*
+ * Print the hit/miss counters.
+ */
+void
+vfs_nc_printstats(void)
+{
+	unsigned lookups;
+
+	lock_acquire(nc_lock);
+	lookups = nc_hits + nc_neghits + nc_misses;
+	kprintf("name cache: %u lookups: %u hits, %u negative hits, "
+		"%u misses\n", lookups, nc_hits, nc_neghits, nc_misses);
+	kprintf("name cache: %u entries made, %u invalidated\n",
+		nc_enters, nc_removes);
+	lock_release(nc_lock);
+}
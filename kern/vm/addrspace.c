@@ -38,6 +38,8 @@
 #include <coremap.h>
 #include <syscall.h>
 #include <bitmap.h>
+#include <pagetable.h>
+#include <vnode.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -68,12 +70,11 @@ as_create(void)
     as->as_heapstart = 0;
     as->as_regions[0] = NULL;
 
-    for (int i = 0; i < LPAGES; i++) {
-        as->as_stack[i] = NULL;
-    }
-
-    for (int i = 0; i < HEAPPAGES; i++) {
-        as->as_heap[i] = NULL;
+    as->as_pt = pt_create();
+    if (as->as_pt == NULL) {
+        kfree(as->as_regions);
+        kfree(as);
+        return NULL;
     }
 
     return as;
@@ -86,59 +87,15 @@ as_destroy(struct addrspace *as)
 
     unsigned i;
 
-    for (i = 0; i < as->as_numregions; i++) {
-        struct region *r = as->as_regions[i];
-
-        if (r->r_pages == NULL) {
-            continue;
-        }
+    pt_destroy(as->as_pt);
 
-        for (unsigned j = 0; j < r->r_numpages; j++) {
-            if (r->r_pages[j] != NULL) {
-                lock_acquire(r->r_pages[j]->lp_lock);
-                if (r->r_pages[j]->lp_paddr != 0) {
-                    spinlock_acquire(&coremap_lock);
-                    coremap_free_kpages(r->r_pages[j]->lp_paddr);
-                    spinlock_release(&coremap_lock);
-                } else {
-                    lock_acquire(swp_lock);
-                    bitmap_unmark(swp_bitmap, r->r_pages[j]->lp_slot);
-                    lock_release(swp_lock);
-                }
-                vm_destroy_lpage(r->r_pages[j]); /* releases lock */
-            }
+    for (i = 0; i < as->as_numregions; i++) {
+        if (as->as_regions[i]->r_vnode != NULL) {
+            VOP_DECREF(as->as_regions[i]->r_vnode);
         }
-        kfree(as->as_regions[i]->r_pages);
         kfree(as->as_regions[i]);
     }
 
-    for (i = 0; i < LPAGES; i++) {
-        if (as->as_stack[i] != NULL) {
-            lock_acquire(as->as_stack[i]->lp_lock);
-            if (as->as_stack[i]->lp_paddr != 0) {
-                spinlock_acquire(&coremap_lock);
-                coremap_free_kpages(as->as_stack[i]->lp_paddr);
-                spinlock_release(&coremap_lock);
-            } else {
-                lock_acquire(swp_lock);
-                bitmap_unmark(swp_bitmap, as->as_stack[i]->lp_slot);
-                lock_release(swp_lock);
-            }
-            vm_destroy_lpage(as->as_stack[i]); /* releases lock */
-        }
-    }
-    for (i = 0; i < HEAPPAGES; i++) {
-        if (as->as_heap[i] != NULL) {
-            lock_acquire(as->as_heap[i]->lp_lock);
-            if (as->as_heap[i]->lp_freed == 0) {
-                spinlock_acquire(&coremap_lock);
-                coremap_free_kpages(as->as_heap[i]->lp_paddr);
-                spinlock_release(&coremap_lock);
-            }
-            vm_destroy_lpage(as->as_heap[i]);
-        }
-    }
-
     kfree(as->as_regions);
     kfree(as);
 }
@@ -237,39 +194,68 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 
     as->as_regions[free_region]->r_startaddr = vaddr;
     as->as_regions[free_region]->r_numpages = npages;
-    as->as_regions[free_region]->r_pages = NULL;
     as->as_regions[free_region]->r_permissions =
         readable | writeable | executable;
+    as->as_regions[free_region]->r_vnode = NULL;
+    as->as_regions[free_region]->r_filevaddr = 0;
+    as->as_regions[free_region]->r_fileoffset = 0;
+    as->as_regions[free_region]->r_filesize = 0;
     as->as_numregions++;
 
     as->as_regions[free_region+1] = NULL;
     return 0;
 }
 
+/*
+ * Back the region containing VADDR with FILESIZE bytes of V, starting
+ * at file offset OFFSET and virtual address VADDR. Nothing is read
+ * now; vm_fault reads each page when it is first touched. The region
+ * holds a reference to V.
+ */
 int
-as_prepare_load(struct addrspace *as)
+as_define_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+               off_t offset, size_t filesize)
 {
-    KASSERT(as != NULL);
+    unsigned i;
+    struct region *region;
 
-    unsigned numpages = 0;
+    KASSERT(as != NULL);
+    KASSERT(v != NULL);
 
-    /*
-     * r_numpages and r_startaddr have been marked by as_define_region.
-     * Use these values to allocate physical pages and update region
-     * information.
-     */
-    for (unsigned i = 0; i < as->as_numregions; i++) {
-        numpages = as->as_regions[i]->r_numpages;
-        as->as_regions[i]->r_pages = kmalloc(numpages * sizeof(struct lpage *));
-        if (as->as_regions[i]->r_pages == NULL) {
-            return ENOMEM;
+    for (i = 0; i < as->as_numregions; i++) {
+        region = as->as_regions[i];
+        if (vaddr >= region->r_startaddr &&
+            vaddr < region->r_startaddr + region->r_numpages * PAGE_SIZE) {
+            break;
         }
+    }
+    if (i == as->as_numregions) {
+        return EFAULT;
+    }
 
-        for (unsigned j = 0; j < numpages; j++) {
-            as->as_regions[i]->r_pages[j] = NULL;
-        }
+    KASSERT(region->r_vnode == NULL);
+    if (vaddr + filesize >
+        region->r_startaddr + region->r_numpages * PAGE_SIZE) {
+        return EFAULT;
     }
 
+    VOP_INCREF(v);
+    region->r_vnode = v;
+    region->r_filevaddr = vaddr;
+    region->r_fileoffset = offset;
+    region->r_filesize = filesize;
+    return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+    KASSERT(as != NULL);
+
+    /*
+     * Nothing to do: pages are entered in the page table as they are
+     * first touched.
+     */
     return 0;
 }
 
@@ -306,45 +292,11 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
     return 0;
 }
 
-int
-as_define_stack2(struct addrspace *as, vaddr_t *stackptr)
-{
-    KASSERT(as);
-    KASSERT(stackptr);
-
-    struct region *stack = NULL, *last_region = NULL;
-
-    int result;
-    vaddr_t vaddr = USERSTACK - STACKPAGES*PAGE_SIZE;
-    size_t memsize = STACKPAGES * PAGE_SIZE;
-
-    result = as_define_region(as, vaddr, memsize, 4, 2, 0);
-    if (result) {
-        return result;
-    }
-
-    stack = as->as_regions[as->as_numregions-1];
-    stack->r_numpages = STACKPAGES;
-    stack->r_pages = kmalloc(STACKPAGES * sizeof(struct vpage *));
-
-    for (unsigned i = 0; i < stack->r_numpages; i++) {
-        stack->r_pages[i] = NULL;
-    }
-
-    last_region = as->as_regions[as->as_numregions-1];
-    as->as_heapidx = as->as_numregions;
-    as->as_heapbrk = last_region->r_startaddr
-        + PAGE_SIZE*last_region->r_numpages;
-    as->as_heapmax = as->as_heapbrk;
-
-    for (int i = 0; i < LPAGES; i++) {
-        as->as_stack[i] = NULL;
-    }
-
-    *stackptr = USERSTACK;
-    return 0;
-}
-
+/*
+ * Copy-on-write fork: the new address space gets the same lpages as
+ * the old one (see pt_copy), so the cost is proportional to the number
+ * of regions and pages mapped, not to the amount of memory they hold.
+ */
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -352,10 +304,8 @@ as_copy(struct addrspace *old, struct addrspace **ret)
     KASSERT(ret != NULL);
 
     int result;
-    unsigned i, j;
-    paddr_t paddr;
+    unsigned i;
     struct addrspace *newas;
-    bool swapped = false;
 
     newas = as_create();
     if (newas == NULL) {
@@ -370,128 +320,38 @@ as_copy(struct addrspace *old, struct addrspace **ret)
                                   rgn->r_permissions & 2,
                                   rgn->r_permissions & 1);
         if (result) {
-            /* as_destroy(newas); */
+            as_destroy(newas);
             return result;
         }
+
+        if (rgn->r_vnode != NULL) {
+            result = as_define_file(newas, rgn->r_filevaddr, rgn->r_vnode,
+                                    rgn->r_fileoffset, rgn->r_filesize);
+            if (result) {
+                as_destroy(newas);
+                return result;
+            }
+        }
     }
 
     result = as_prepare_load(newas);
     if (result) {
-        /* as_destroy(newas); */
+        as_destroy(newas);
         return result;
     }
 
     result = as_complete_load(newas);
     if (result) {
-        /* as_destroy(newas); */
+        as_destroy(newas);
         return result;
     }
 
     KASSERT(old->as_numregions == newas->as_numregions);
 
-    for (i = 0; i < newas->as_numregions; i++) {
-        struct region *region_old = old->as_regions[i];
-        struct region *region_new = newas->as_regions[i];
-
-        KASSERT(region_old->r_numpages == region_new->r_numpages);
-        KASSERT(region_old->r_startaddr == region_new->r_startaddr);
-        KASSERT(region_old->r_permissions == region_new->r_permissions);
-
-        for (j = 0; j < region_old->r_numpages; j++) {
-            if (region_old->r_pages[j] != NULL) {
-                paddr = coremap_alloc_page();
-                if (paddr == 0) {
-                    /* as_destroy(newas); */
-                    return ENOMEM;
-                }
-
-                lock_acquire(region_old->r_pages[j]->lp_lock);
-                if (region_old->r_pages[j]->lp_slot != -1) {
-                    vm_swapin(region_old->r_pages[j]);
-                    swapped = true;
-                }
-
-                region_new->r_pages[j] =
-                    vm_create_lpage(paddr, region_old->r_pages[j]->lp_startaddr);
-                if (region_new->r_pages[j] == NULL) {
-                    lock_release(region_old->r_pages[j]->lp_lock);
-                    return ENOMEM;
-                }
-
-                memmove((void *)PADDR_TO_KVADDR(paddr),
-                        (const void *)
-                        PADDR_TO_KVADDR(region_old->r_pages[j]->lp_paddr),
-                        PAGE_SIZE);
-
-                if (swapped) {
-                    /* vm_swapout(region_old->r_pages[j]);
-                     * vm_swapout(region_new->r_pages[j]); */
-                    swapped = false;
-                }
-                lock_release(region_old->r_pages[j]->lp_lock);
-
-                spinlock_acquire(&coremap_lock);
-                coremap_set_lpage(paddr, region_new->r_pages[j]);
-                spinlock_release(&coremap_lock);
-            }
-        }
-    }
-
-    for (i = 0; i < LPAGES; i++) {
-        if (old->as_stack[i] != NULL) {
-            paddr = coremap_alloc_page();
-            if (paddr == 0) {
-                return ENOMEM;
-            }
-
-            lock_acquire(old->as_stack[i]->lp_lock);
-            if (old->as_stack[i]->lp_paddr == 0) {
-                vm_swapin(old->as_stack[i]);
-                swapped = true;
-            }
-
-            newas->as_stack[i] =
-                vm_create_lpage(paddr, old->as_stack[i]->lp_startaddr);
-            if (newas->as_stack[i] == NULL) {
-                /* as_destroy(newas); */
-                lock_release(old->as_stack[i]->lp_lock);
-                return ENOMEM;
-            }
-
-            memmove((void *)PADDR_TO_KVADDR(newas->as_stack[i]->lp_paddr),
-                    (const void *)PADDR_TO_KVADDR(old->as_stack[i]->lp_paddr),
-                    PAGE_SIZE);
-
-            if (swapped) {
-                /* vm_swapout(old->as_stack[i]);
-                 * vm_swapout(newas->as_stack[i]); */
-                swapped = false;
-            }
-            lock_release(old->as_stack[i]->lp_lock);
-
-            spinlock_acquire(&coremap_lock);
-            coremap_set_lpage(paddr, newas->as_stack[i]);
-            spinlock_release(&coremap_lock);
-        }
-    }
-    for (i = 0; i < HEAPPAGES; i++) {
-        if (old->as_heap[i] != NULL && old->as_heap[i]->lp_freed == 0) {
-            paddr = coremap_alloc_page();
-            if (paddr == 0) {
-                return ENOMEM;
-            }
-
-            newas->as_heap[i] =
-                vm_create_lpage(paddr, old->as_heap[i]->lp_startaddr);
-            if (newas->as_heap[i] == NULL) {
-                /* as_destroy(newas); */
-                return ENOMEM;
-            }
-
-            memmove((void *)PADDR_TO_KVADDR(newas->as_heap[i]->lp_paddr),
-                    (const void *)PADDR_TO_KVADDR(old->as_heap[i]->lp_paddr),
-                    PAGE_SIZE);
-        }
+    result = pt_copy(old->as_pt, newas->as_pt);
+    if (result) {
+        as_destroy(newas);
+        return result;
     }
 
     newas->as_heapidx = old->as_heapidx;
@@ -503,7 +363,9 @@ as_copy(struct addrspace *old, struct addrspace **ret)
     KASSERT(old->as_heapidx == newas->as_heapidx);
     KASSERT(old->as_heapstart == newas->as_heapstart);
 
+    /* the parent's writable TLB entries must trap from now on */
+    vm_cleartlb();
+
     *ret = newas;
     return 0;
 }
-
@@ -8,6 +8,8 @@
 #include <syscall.h>
 #include <addrspace.h>
 #include <synch.h>
+#include <wchan.h>
+#include <mips/tlb.h>
 
 
 struct cm_entry **coremap;
@@ -18,6 +20,92 @@ int cm_start_page = 0;
 int cm_last_refd_page = 0;
 bool cm_initted = false;
 
+/*
+ * Free frames are kept two ways: on a doubly-linked list threaded
+ * through the coremap entries (cme_next/cme_prev), so single pages are
+ * allocated and freed in O(1), and in a bitmap (bit set = free) that
+ * coremap_alloc_npages scans a word at a time for contiguous runs.
+ * Both are protected by coremap_lock.
+ */
+static uint32_t *cm_freemap;
+static int cm_freelist = -1;
+static unsigned cm_numfree = 0;
+
+#define CM_ISFREE(i) ((cm_freemap[(i) >> 5] >> ((i) & 31)) & 1)
+
+/*
+ * Pageout daemon. When the free list drops below cm_lowater frames the
+ * allocator wakes the daemon, which evicts pages until there are
+ * cm_hiwater free. Dirty pages get written out by the daemon rather
+ * than by whoever happens to be faulting. NULL until swap is enabled.
+ */
+static struct wchan *cm_pageout_wchan;
+static unsigned cm_lowater;
+static unsigned cm_hiwater;
+
+static void
+coremap_push_free(int i)
+{
+    KASSERT(!CM_ISFREE(i));
+
+    coremap[i]->cme_prev = -1;
+    coremap[i]->cme_next = cm_freelist;
+    if (cm_freelist != -1) {
+        coremap[cm_freelist]->cme_prev = i;
+    }
+    cm_freelist = i;
+
+    cm_freemap[i >> 5] |= (uint32_t)1 << (i & 31);
+    cm_numfree++;
+}
+
+static void
+coremap_unlink_free(int i)
+{
+    KASSERT(CM_ISFREE(i));
+
+    if (coremap[i]->cme_prev != -1) {
+        coremap[coremap[i]->cme_prev]->cme_next = coremap[i]->cme_next;
+    } else {
+        cm_freelist = coremap[i]->cme_next;
+    }
+    if (coremap[i]->cme_next != -1) {
+        coremap[coremap[i]->cme_next]->cme_prev = coremap[i]->cme_prev;
+    }
+
+    cm_freemap[i >> 5] &= ~((uint32_t)1 << (i & 31));
+    cm_numfree--;
+}
+
+/*
+ * Find N contiguous free frames. Fully allocated bitmap words are
+ * skipped 32 frames at a time. Returns the first frame, or 0.
+ */
+static int
+coremap_find_run(unsigned n)
+{
+    int i;
+    unsigned run = 0;
+
+    for (i = cm_start_page; i < cm_numpages; i++) {
+        if ((i & 31) == 0 && cm_freemap[i >> 5] == 0) {
+            run = 0;
+            i += 31;
+            continue;
+        }
+
+        if (CM_ISFREE(i)) {
+            if (++run == n) {
+                return i - n + 1;
+            }
+        } else {
+            run = 0;
+        }
+    }
+
+    return 0;
+}
+
 static int
 countpages(int entries, size_t size_per_entry)
 {
@@ -31,7 +119,7 @@ coremap_init(void)
 {
     int i;
     int kernel_pages, numpages;
-    int entries, pages_needed, ptr_pages_needed;
+    int entries, pages_needed, ptr_pages_needed, map_pages_needed;
     paddr_t ramsize, cmeaddr;
     struct cm_entry *cme = NULL;
 
@@ -40,222 +128,594 @@ coremap_init(void)
 
     pages_needed = countpages(entries, sizeof(struct cm_entry));
     ptr_pages_needed = countpages(entries, sizeof(struct cm_entry *));
+    map_pages_needed = countpages((entries + 31) / 32, sizeof(uint32_t));
 
     numpages = ram_stealmem(pages_needed);
     cmeaddr = numpages;
     kernel_pages = numpages / PAGE_SIZE;
     coremap = (struct cm_entry **)
         PADDR_TO_KVADDR(ram_stealmem(ptr_pages_needed));
+    cm_freemap = (uint32_t *)
+        PADDR_TO_KVADDR(ram_stealmem(map_pages_needed));
     numpages = kernel_pages + pages_needed
-        + ptr_pages_needed;
+        + ptr_pages_needed + map_pages_needed;
+
+    bzero(cm_freemap, map_pages_needed * PAGE_SIZE);
 
     for (i = 0; i < entries; i++) {
         cme = (struct cm_entry *) PADDR_TO_KVADDR(cmeaddr);
 		coremap[i] = cme;
+        cme->cme_page = NULL;
+        cme->cme_as = NULL;
+        cme->cme_is_last_page = 0;
+        cme->cme_is_refd = 0;
+        cme->cme_next = -1;
+        cme->cme_prev = -1;
         if (i < numpages) {
             cme->cme_is_pinned = 1;
             cme->cme_is_allocated = 1;
+        } else {
+            cme->cme_is_pinned = 0;
+            cme->cme_is_allocated = 0;
         }
         cmeaddr += sizeof(struct cm_entry);
     }
 
+	cm_numpages = i;
+
+    /* push in reverse so low frames come off the list first */
+    for (i = entries - 1; i >= numpages; i--) {
+        coremap_push_free(i);
+    }
+
     spinlock_init(&coremap_lock);
     cm_first_free_page = numpages;
     cm_start_page = numpages;
     cm_used_bytes = numpages * PAGE_SIZE;
-	cm_numpages = i;
     cm_last_refd_page = numpages;
 }
 
-static int
-coremap_nextfree(int current_index)
+/*
+ * Pages whose reference bit the clock has cleared, still to be shot
+ * down from the TLBs. Protected by coremap_lock.
+ */
+static vaddr_t cm_unref[TLBSHOOTDOWN_MAX];
+static unsigned cm_nunref;
+
+/*
+ * Send the TLB shootdowns queued by coremap_choose_victim. Called
+ * without coremap_lock.
+ */
+static void
+coremap_flush_unref(void)
 {
-    KASSERT(coremap != NULL);
-    KASSERT(current_index >= 0);
+    unsigned n;
+    vaddr_t vaddrs[TLBSHOOTDOWN_MAX];
 
-    int i;
-    bool looped = false;
-find_page:
-    for (i = current_index; i < cm_numpages; i++) {
-        if (!coremap[i]->cme_is_allocated) {
-            return i;
-        }
-    }
-    current_index = cm_start_page;
-    if (looped) {
-        return 0;
-    }
-    looped = true;
-    goto find_page;
+    spinlock_acquire(&coremap_lock);
+    n = cm_nunref;
+    memcpy(vaddrs, cm_unref, n * sizeof(vaddr_t));
+    cm_nunref = 0;
+    spinlock_release(&coremap_lock);
+
+    vm_tlbinvalidate(vaddrs, n);
 }
 
+/*
+ * Pick a page to evict with the clock (second chance) algorithm.
+ *
+ * The hand, cm_last_refd_page, sweeps over user pages. A page whose
+ * reference bit is set gets it cleared and is passed over; the first
+ * page found with the bit clear is the victim. MIPS has no hardware
+ * reference bits, so clearing one also has to drop the page's TLB
+ * entries, on every cpu, for the next access to fault and have
+ * vm_fault set the bit again. Shootdowns sleep, so the page is queued
+ * in cm_unref and the caller sends them with coremap_flush_unref once
+ * it has let go of coremap_lock. While the queue is full referenced
+ * pages are passed over without clearing their bit.
+ *
+ * The victim's lp_lock is taken with lock_tryacquire while we still
+ * hold coremap_lock, so the lpage can't be freed between choosing it
+ * and evicting it: vm_decref_lpage has to get the lock before it can
+ * unhook the page. Pages whose lock is held by anyone, us included,
+ * are being used and are passed over, and since we never wait for an
+ * lp_lock here, callers can take several victims without deadlocking.
+ *
+ * Two sweeps clear every bit, so if nothing is found by then all user
+ * pages are in use and we return 0. Otherwise the caller gets the
+ * frame with its page locked, and evicts the page.
+ */
 paddr_t
 coremap_choose_victim(void)
 {
-    bool found = false;
-    bool looped = false;
-    /* bool npages = false; */
-    int i = cm_last_refd_page;
+    int i, scanned, limit;
+    struct cm_entry *cme;
 
-search:
-    while (i < cm_numpages) {
-        if (coremap[i]->cme_page == NULL) {
-            i++;
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    i = cm_last_refd_page;
+    limit = 2 * (cm_numpages - cm_start_page);
+
+    for (scanned = 0; scanned < limit; scanned++, i++) {
+        if (i >= cm_numpages) {
+            i = cm_start_page;
+        }
+
+        cme = coremap[i];
+        if (cme->cme_page == NULL || cme->cme_is_pinned) {
+            continue;
+        }
+
+        if (cme->cme_is_refd) {
+            if (cm_nunref < TLBSHOOTDOWN_MAX) {
+                cme->cme_is_refd = 0;
+                cm_unref[cm_nunref++] = cme->cme_page->lp_startaddr;
+            }
             continue;
         }
 
-        found = true;
-        break;
-        /* if (coremap[i]->cme_is_refd == 1) {
-         *     coremap[i++]->cme_is_refd = 0;
-         * } else {
-         *     coremap[i++]->cme_is_refd = 1;
-         *     found = true;
-         *     break;
-         * } */
+        /* being faulted in, copied, freed or evicted by someone */
+        if (!lock_tryacquire(cme->cme_page->lp_lock)) {
+            continue;
+        }
+
+        cm_last_refd_page = i+1 == cm_numpages ? cm_start_page : i+1;
+        return i*PAGE_SIZE;
     }
 
-    if (!found) {
-        if (looped) {
-            return 0;
+    return 0;
+}
+
+/* Pages on each side of the victim considered for its cluster */
+#define CM_WINDOW (2 * SWP_CLUSTER - 1)
+
+/*
+ * Take the user page in frame I for eviction if it can be had without
+ * waiting. On success *LPP is the page, locked and out of the coremap.
+ */
+static bool
+coremap_take(int i, struct lpage **lpp)
+{
+    struct cm_entry *cme;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    if (i < 0) {
+        return false;
+    }
+    cme = coremap[i];
+    if (!lock_tryacquire(cme->cme_page->lp_lock)) {
+        return false;
+    }
+    *lpp = cme->cme_page;
+    cme->cme_page = NULL;
+    return true;
+}
+
+/*
+ * Choose up to MAX pages to evict together: a victim picked by the
+ * clock, plus the unreferenced resident pages at the virtual addresses
+ * around it in the same address space. Those are likely to be faulted
+ * back in together, and vm_swapout_cluster writes them to consecutive
+ * slots so that they can be.
+ *
+ * One pass over the coremap notes which frames hold the victim's
+ * neighbours; the cluster then grows outward from the victim, one
+ * page on each side in turn, until it's full or both sides hit a
+ * missing or busy page. Returns the number of pages put in LPAGES,
+ * all locked and taken out of the coremap, or 0 if there's no victim.
+ */
+static unsigned
+coremap_choose_cluster(struct lpage **lpages, unsigned max)
+{
+    int window[CM_WINDOW];
+    int i, lo, hi, mid = SWP_CLUSTER - 1;
+    unsigned n;
+    bool left, right;
+    vaddr_t va, nva;
+    paddr_t paddr;
+    struct cm_entry *cme, *victim;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    KASSERT(max > 0 && max <= SWP_CLUSTER);
+
+    paddr = coremap_choose_victim();
+    if (paddr == 0) {
+        return 0;
+    }
+    victim = coremap[paddr / PAGE_SIZE];
+    va = victim->cme_page->lp_startaddr;
+
+    for (i = 0; i < CM_WINDOW; i++) {
+        window[i] = -1;
+    }
+    for (i = cm_start_page; max > 1 && victim->cme_as != NULL &&
+             i < cm_numpages; i++) {
+        cme = coremap[i];
+        if (cme == victim || cme->cme_page == NULL ||
+            cme->cme_is_pinned || cme->cme_is_refd ||
+            cme->cme_as != victim->cme_as) {
+            continue;
+        }
+        nva = cme->cme_page->lp_startaddr;
+        if (nva + mid * PAGE_SIZE < va || nva > va + mid * PAGE_SIZE) {
+            continue;
+        }
+        window[mid + (int)(nva / PAGE_SIZE) - (int)(va / PAGE_SIZE)] = i;
+    }
+
+    lpages[0] = victim->cme_page;
+    victim->cme_page = NULL;
+    n = 1;
+
+    lo = hi = mid;
+    left = right = true;
+    while (n < max && (left || right)) {
+        if (right) {
+            if (hi + 1 < CM_WINDOW && coremap_take(window[hi + 1],
+                                                   &lpages[n])) {
+                hi++;
+                n++;
+            } else {
+                right = false;
+            }
+        }
+        if (left && n < max) {
+            if (lo > 0 && coremap_take(window[lo - 1], &lpages[n])) {
+                lo--;
+                n++;
+            } else {
+                left = false;
+            }
         }
-        looped = true;
-        i = cm_start_page;
-        goto search;
     }
 
-    cm_last_refd_page = i+1 == cm_numpages ? cm_start_page : i+1;
+    return n;
+}
+
+/* Called with coremap_lock held whenever frames leave the free list. */
+static void
+coremap_check_lowater(void)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    if (cm_pageout_wchan != NULL && cm_numfree < cm_lowater) {
+        wchan_wakeone(cm_pageout_wchan, &coremap_lock);
+    }
+}
+
+void
+coremap_pageout_init(void)
+{
+    unsigned npages = cm_numpages - cm_start_page;
 
-    if (lock_do_i_hold(coremap[i]->cme_page->lp_lock)) {
-        i++;
-        looped = false;
-        goto search;
+    /* 1/32 of user memory, plus enough to refill one cpu cache */
+    cm_lowater = npages / 32 + CPU_FRAMES_BATCH;
+    cm_hiwater = 2 * cm_lowater;
+
+    cm_pageout_wchan = wchan_create("pageout");
+    if (cm_pageout_wchan == NULL) {
+        panic("coremap: could not create pageout wchan");
     }
+}
 
-    /* kprintf("%d\n", i-1); */
-    /* return (i-1)*PAGE_SIZE; */
-    return i*PAGE_SIZE;
+/* Sleep until the free list drops below the low watermark. */
+void
+coremap_pageout_wait(void)
+{
+    spinlock_acquire(&coremap_lock);
+    while (cm_numfree >= cm_lowater) {
+        wchan_sleep(cm_pageout_wchan, &coremap_lock);
+    }
+    spinlock_release(&coremap_lock);
 }
 
+/*
+ * Evict pages until the free list reaches the high watermark. Victims
+ * are taken a cluster at a time (coremap_choose_cluster) so their
+ * writes can be clustered. The frames go straight back on the free
+ * list. Returns false if it gave up because there was nothing left to
+ * evict.
+ */
+bool
+coremap_pageout(void)
+{
+    int result;
+    unsigned i, n;
+    paddr_t paddrs[SWP_CLUSTER];
+    struct lpage *lpages[SWP_CLUSTER];
+
+    spinlock_acquire(&coremap_lock);
+    while (cm_numfree < cm_hiwater) {
+        n = cm_hiwater - cm_numfree;
+        n = coremap_choose_cluster(lpages, n < SWP_CLUSTER ? n : SWP_CLUSTER);
+        spinlock_release(&coremap_lock);
+        coremap_flush_unref();
+
+        if (n == 0) {
+            return false;
+        }
+
+        /* coremap_choose_cluster locked them */
+        result = vm_swapout_cluster(lpages, paddrs, n); /* releases locks */
+
+        spinlock_acquire(&coremap_lock);
+        for (i = 0; i < n; i++) {
+            if (paddrs[i] != 0) {
+                coremap_free_kpages(paddrs[i]);
+            }
+        }
+        if (result) {
+            /* out of swap */
+            spinlock_release(&coremap_lock);
+            return false;
+        }
+    }
+    spinlock_release(&coremap_lock);
+
+    return true;
+}
+
+/*
+ * Evict N contiguous user pages to make room for a multi-page kernel
+ * allocation. As in coremap_choose_victim, each page is only taken if
+ * its lp_lock can be had at once; a run with a page in use is given up
+ * and the frames already evicted from it go back on the free list.
+ * Called with coremap_lock held, and returns with it held; the lock is
+ * dropped while pages are written out. Returns the first frame of the
+ * run, still marked allocated, or 0.
+ */
 int
 coremap_choose_nvictims(unsigned n)
 {
-    unsigned j;
-    int i = cm_start_page;
+    unsigned j, k;
+    int i;
+    paddr_t paddr;
     struct lpage *lpage;
+    struct cm_entry *cme;
 
-search:
-    while (i < cm_numpages) {
-        if (coremap[i]->cme_page == NULL) {
-            i++;
-            continue;
-        }
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
 
+    for (i = cm_start_page; i + (int)n <= cm_numpages; i += j + 1) {
         for (j = 0; j < n; j++) {
-            if (coremap[i+j]->cme_page == NULL) {
-                i = i + j + 1;
+            cme = coremap[i+j];
+            lpage = cme->cme_page;
+            if (lpage == NULL || cme->cme_is_pinned ||
+                !lock_tryacquire(lpage->lp_lock)) {
                 break;
             }
-        }
+            cme->cme_page = NULL;
+            spinlock_release(&coremap_lock);
 
-        if (j == n) {
-            for (j = 0; j < n; j++) {
-                if (!spinlock_do_i_hold(&coremap_lock)) {
-                    spinlock_acquire(&coremap_lock);
-                }
-                lpage = coremap[i+j]->cme_page;
-                coremap[i+j]->cme_page = NULL;
-                if (lpage == NULL) {
-                    cm_used_bytes -= PAGE_SIZE*(j);
-                    i = i + j + 1;
-                    goto search;
+            paddr = vm_swapout(lpage); /* releases lock */
+
+            spinlock_acquire(&coremap_lock);
+            if (paddr == 0) {
+                /* out of swap: give back the frames we did free */
+                for (k = 0; k < j; k++) {
+                    coremap_free_kpages((i+k)*PAGE_SIZE);
                 }
-                spinlock_release(&coremap_lock);
-                lock_acquire(lpage->lp_lock);
-                vm_swapout(lpage);
+                return 0;
             }
+        }
+
+        if (j == n) {
             return i;
         }
+        for (k = 0; k < j; k++) {
+            coremap_free_kpages((i+k)*PAGE_SIZE);
+        }
     }
 
     return 0;
 }
 
-/* SLOW */
+/*
+ * Per-cpu frame caches (see struct cpu).
+ *
+ * Cached frames are off the coremap free list and counted in
+ * cm_used_bytes, but they are not in use: coremap_used_bytes()
+ * subtracts them. Their coremap entries are only touched by whoever
+ * takes them out of the cache.
+ */
+
+/* Move up to CPU_FRAMES_BATCH frames from the coremap into C's cache. */
+static void
+coremap_cache_refill(struct cpu *c)
+{
+    int i;
+
+    KASSERT(spinlock_do_i_hold(&c->c_frames_lock));
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    while (c->c_numframes < CPU_FRAMES_BATCH && cm_freelist != -1) {
+        i = cm_freelist;
+        coremap_unlink_free(i);
+        cm_used_bytes += PAGE_SIZE;
+        c->c_frames[c->c_numframes++] = i*PAGE_SIZE;
+    }
+    coremap_check_lowater();
+}
+
+/* Return frames from C's cache to the coremap until KEEP are left. */
+static void
+coremap_cache_drain(struct cpu *c, unsigned keep)
+{
+    KASSERT(spinlock_do_i_hold(&c->c_frames_lock));
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    while (c->c_numframes > keep) {
+        coremap_push_free(c->c_frames[--c->c_numframes] / PAGE_SIZE);
+        cm_used_bytes -= PAGE_SIZE;
+    }
+}
+
+/*
+ * Empty every cpu's cache back into the coremap, so the frames in
+ * them can be part of a contiguous run. Called with coremap_lock
+ * held, which is dropped meanwhile: the cache locks come first.
+ */
+static void
+coremap_cache_drainall(void)
+{
+    unsigned i, n;
+    struct cpu *c;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    if (!CURCPU_EXISTS()) {
+        return;
+    }
+
+    spinlock_release(&coremap_lock);
+    n = cpu_count();
+    for (i = 0; i < n; i++) {
+        c = cpu_get(i);
+        spinlock_acquire(&c->c_frames_lock);
+        spinlock_acquire(&coremap_lock);
+        coremap_cache_drain(c, 0);
+        spinlock_release(&coremap_lock);
+        spinlock_release(&c->c_frames_lock);
+    }
+    spinlock_acquire(&coremap_lock);
+}
+
+/*
+ * Allocate N contiguous frames for the kernel. If the free list has
+ * no run long enough, the per-cpu caches are emptied into it and we
+ * look again; failing that, user pages are evicted to make one.
+ * Called with coremap_lock held; it may be dropped and retaken.
+ */
 paddr_t
 coremap_alloc_npages(unsigned n)
 {
-    /* pid_t pid = cm_initted ? sys_getpid() : 1; */
-    int i;
-    int entries = cm_numpages;
-    int start = cm_first_free_page;
-    unsigned pages_found = 0;
+    int i, start;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    start = cm_numfree >= n ? coremap_find_run(n) : 0;
+    if (start == 0) {
+        coremap_cache_drainall();
+        start = cm_numfree >= n ? coremap_find_run(n) : 0;
+    }
 
-    if (cm_used_bytes / cm_numpages == PAGE_SIZE) {
+    if (start == 0) {
         if (!vm_swap_enabled) {
             return 0;
-        } else {
-            start = coremap_choose_nvictims(n);
-            spinlock_acquire(&coremap_lock);
-            KASSERT(start != 0);
-            i = start + n - 1;
-            coremap[i]->cme_is_allocated = 1;
-            coremap[i]->cme_is_last_page = 1;
-            for (int j = start; j < i; j++) {
-                coremap[j]->cme_is_allocated = 1;
-                coremap[j]->cme_is_last_page = 0;
-            }
-            return start*PAGE_SIZE;
         }
+        start = coremap_choose_nvictims(n);
+        if (start == 0) {
+            return 0;
+        }
+        i = start + n - 1;
+        coremap[i]->cme_is_allocated = 1;
+        coremap[i]->cme_is_last_page = 1;
+        for (int j = start; j < i; j++) {
+            coremap[j]->cme_is_allocated = 1;
+            coremap[j]->cme_is_last_page = 0;
+        }
+        return start*PAGE_SIZE;
     }
 
-    for (i = start; i < entries; i++) {
-        if (coremap[i]->cme_is_allocated) {
-            pages_found = 1;
-            start = coremap_nextfree(i);
-            if (start == 0) {
-                return 0;
-             }
-            i = start;
-        } else {
-            pages_found++;
-        }
+    /* mark them all allocated */
+    for (i = start; i < start + (int)n; i++) {
+        coremap_unlink_free(i);
+        cm_used_bytes += PAGE_SIZE;
+        coremap[i]->cme_is_allocated = 1;
+        coremap[i]->cme_is_last_page = 0;
+    }
+    coremap[start + n - 1]->cme_is_last_page = 1;
 
-        if (pages_found == n) {
-            /* mark them all allocated */
-            coremap[i]->cme_is_last_page = 1;
-            for (int j = start; j <= i; j++) {
-    			cm_used_bytes += PAGE_SIZE;
-				coremap[j]->cme_is_allocated = 1;
-                /* coremap[j]->cme_pid = pid; */
-            }
-            break;
+    return start*PAGE_SIZE;
+}
+
+/*
+ * Take a frame from this cpu's cache, refilling it from the coremap if
+ * it's empty. If the coremap is empty too, take one from another cpu.
+ * Returns 0 if there are no free frames anywhere.
+ */
+static paddr_t
+coremap_cache_alloc(void)
+{
+    unsigned i, n;
+    paddr_t paddr = 0;
+    struct cpu *c;
+
+    if (!CURCPU_EXISTS()) {
+        return 0;
+    }
+
+    c = curcpu->c_self;
+    spinlock_acquire(&c->c_frames_lock);
+    if (c->c_numframes == 0) {
+        spinlock_acquire(&coremap_lock);
+        coremap_cache_refill(c);
+        spinlock_release(&coremap_lock);
+    }
+    if (c->c_numframes > 0) {
+        paddr = c->c_frames[--c->c_numframes];
+    }
+    spinlock_release(&c->c_frames_lock);
+
+    n = cpu_count();
+    for (i = 0; paddr == 0 && i < n; i++) {
+        c = cpu_get(i);
+        spinlock_acquire(&c->c_frames_lock);
+        if (c->c_numframes > 0) {
+            paddr = c->c_frames[--c->c_numframes];
         }
+        spinlock_release(&c->c_frames_lock);
     }
 
-    KASSERT(pages_found == n);
+    return paddr;
+}
 
-    if (cm_first_free_page == start) {
-        cm_first_free_page = coremap_nextfree(start);
-        if (cm_first_free_page == 0) {
-            cm_first_free_page = cm_start_page;
-        }
+/*
+ * Frames sitting in per-cpu caches. Not synchronized; like
+ * coremap_used_bytes() the answer may be stale by the time it's used.
+ */
+static unsigned
+coremap_cached_frames(void)
+{
+    unsigned i, n, total = 0;
+
+    if (!CURCPU_EXISTS()) {
+        return 0;
     }
 
-    return start*PAGE_SIZE;
+    n = cpu_count();
+    for (i = 0; i < n; i++) {
+        total += cpu_get(i)->c_numframes;
+    }
+    return total;
+}
+
+unsigned int
+coremap_used_bytes(void)
+{
+    return cm_used_bytes - coremap_cached_frames() * PAGE_SIZE;
 }
 
 paddr_t
 coremap_alloc_page(void)
 {
-    /* pid_t pid = cm_initted ? sys_getpid() : 1; */
     paddr_t paddr = 0;
-    int i, entries = cm_numpages;
+    int i;
     struct lpage *lpage;
 
 search:
+    paddr = coremap_cache_alloc();
+    if (paddr != 0) {
+        i = paddr / PAGE_SIZE;
+        coremap[i]->cme_is_allocated = 1;
+        coremap[i]->cme_is_last_page = 1;
+        coremap[i]->cme_is_refd = 1;
+        return paddr;
+    }
+
     spinlock_acquire(&coremap_lock);
-    if (cm_used_bytes / cm_numpages == PAGE_SIZE) {
+    coremap_check_lowater();
+    if (cm_numfree == 0) {
         if (vm_swap_enabled) {
             goto evict;
         } else {
@@ -264,18 +724,14 @@ search:
         }
     }
 
-    for (i = cm_start_page; i < entries; i++) {
-        if (!coremap[i]->cme_is_allocated) {
-            coremap[i]->cme_is_allocated = 1;
-            coremap[i]->cme_is_last_page = 1;
-            coremap[i]->cme_is_refd = 1;
-            paddr = i*PAGE_SIZE;
-            cm_used_bytes += PAGE_SIZE;
-            /* coremap[i]->cme_pid = pid; */
-            /* kprintf("allocated %u\n", paddr / PAGE_SIZE); */
-            break;
-        }
-    }
+    /* no cpu structure yet (early boot) */
+    i = cm_freelist;
+    coremap_unlink_free(i);
+    coremap[i]->cme_is_allocated = 1;
+    coremap[i]->cme_is_last_page = 1;
+    coremap[i]->cme_is_refd = 1;
+    paddr = i*PAGE_SIZE;
+    cm_used_bytes += PAGE_SIZE;
 
 evict:
     /* SWAP OUT HERE */
@@ -283,17 +739,15 @@ evict:
         paddr = coremap_choose_victim();
         if (paddr == 0) {
             spinlock_release(&coremap_lock);
+            coremap_flush_unref();
             goto search;
         }
+        /* locked by coremap_choose_victim */
         lpage = coremap[paddr / PAGE_SIZE]->cme_page;
         coremap[paddr / PAGE_SIZE]->cme_page = NULL;
         spinlock_release(&coremap_lock);
-        lock_acquire(lpage->lp_lock);
-        /* coremap[paddr / PAGE_SIZE]->cme_page = NULL;
-         * coremap[paddr / PAGE_SIZE]->cme_is_allocated = 0;
-         * cm_used_bytes -= PAGE_SIZE; */
+        coremap_flush_unref();
         paddr = vm_swapout(lpage);
-        /* goto search; */
     } else {
         spinlock_release(&coremap_lock);
     }
@@ -301,24 +755,108 @@ evict:
     return paddr;
 }
 
+/*
+ * Like coremap_alloc_page, but never evicts: returns 0 if no frame is
+ * free. For speculative allocations such as swap read-ahead.
+ */
+paddr_t
+coremap_try_alloc_page(void)
+{
+    int i;
+    paddr_t paddr;
+
+    paddr = coremap_cache_alloc();
+    if (paddr == 0) {
+        spinlock_acquire(&coremap_lock);
+        if (cm_freelist != -1) {
+            i = cm_freelist;
+            coremap_unlink_free(i);
+            cm_used_bytes += PAGE_SIZE;
+            paddr = i*PAGE_SIZE;
+        }
+        spinlock_release(&coremap_lock);
+        if (paddr == 0) {
+            return 0;
+        }
+    }
+
+    i = paddr / PAGE_SIZE;
+    coremap[i]->cme_is_allocated = 1;
+    coremap[i]->cme_is_last_page = 1;
+    coremap[i]->cme_is_refd = 1;
+    return paddr;
+}
+
+/*
+ * Free a single page allocated with coremap_alloc_page. It goes into
+ * this cpu's cache; the coremap lock is only taken when the cache is
+ * full, or to unhook a user page. The caller of a user page holds its
+ * lp_lock.
+ */
+void
+coremap_free_page(paddr_t paddr)
+{
+    int i = paddr / PAGE_SIZE;
+    struct cpu *c;
+
+    KASSERT(coremap[i]->cme_is_allocated);
+    KASSERT(coremap[i]->cme_is_last_page);
+
+    if (!CURCPU_EXISTS()) {
+        spinlock_acquire(&coremap_lock);
+        coremap_free_kpages(paddr);
+        spinlock_release(&coremap_lock);
+        return;
+    }
+
+    if (coremap[i]->cme_page != NULL) {
+        /*
+         * A user page: coremap_choose_victim may be looking at the
+         * entry, so take it out of the coremap under the lock before
+         * the lpage goes away. Kernel pages never have cme_page set,
+         * so freeing those stays lock-free.
+         */
+        spinlock_acquire(&coremap_lock);
+        coremap[i]->cme_is_allocated = 0;
+        coremap[i]->cme_is_last_page = 0;
+        coremap[i]->cme_page = NULL;
+        coremap[i]->cme_as = NULL;
+        spinlock_release(&coremap_lock);
+    } else {
+        coremap[i]->cme_is_allocated = 0;
+        coremap[i]->cme_is_last_page = 0;
+    }
+
+    c = curcpu->c_self;
+    spinlock_acquire(&c->c_frames_lock);
+    if (c->c_numframes == CPU_FRAMES_MAX) {
+        spinlock_acquire(&coremap_lock);
+        coremap_cache_drain(c, CPU_FRAMES_MAX - CPU_FRAMES_BATCH);
+        spinlock_release(&coremap_lock);
+    }
+    c->c_frames[c->c_numframes++] = paddr;
+    spinlock_release(&c->c_frames_lock);
+}
+
 void
 coremap_free_kpages(paddr_t paddr)
 {
     int start = paddr / PAGE_SIZE;
 
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
     for (int page_number = start; page_number < cm_numpages; page_number++) {
-        /* if (!coremap[page_number]->cme_is_allocated) {
-         *     return;
-         * } */
+        KASSERT(coremap[page_number]->cme_is_allocated);
 
         cm_used_bytes -= PAGE_SIZE;
-        /* coremap[page_number]->cme_pid = 0; */
 		coremap[page_number]->cme_is_allocated = 0;
         coremap[page_number]->cme_page = NULL;
+        coremap[page_number]->cme_as = NULL;
+        coremap_push_free(page_number);
 		if (coremap[page_number]->cme_is_last_page == 1) {
 			coremap[page_number]->cme_is_last_page = 0;
 			break;
-		}  
+		}
 	}
 }
 
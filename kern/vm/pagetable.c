@@ -0,0 +1,148 @@
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <synch.h>
+#include <vm.h>
+#include <pagetable.h>
+
+struct pagetable *
+pt_create(void)
+{
+    struct pagetable *pt;
+
+    pt = kmalloc(sizeof(struct pagetable));
+    if (pt == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < PT_L1_ENTRIES; i++) {
+        pt->pt_dir[i] = NULL;
+    }
+
+    return pt;
+}
+
+/*
+ * Drop every page mapped in PT and free the table itself.
+ */
+void
+pt_destroy(struct pagetable *pt)
+{
+    KASSERT(pt != NULL);
+
+    int i, j;
+
+    for (i = 0; i < PT_L1_ENTRIES; i++) {
+        if (pt->pt_dir[i] == NULL) {
+            continue;
+        }
+
+        for (j = 0; j < PT_L2_ENTRIES; j++) {
+            if (pt->pt_dir[i][j] != NULL) {
+                vm_decref_lpage(pt->pt_dir[i][j]);
+            }
+        }
+        kfree(pt->pt_dir[i]);
+    }
+
+    kfree(pt);
+}
+
+/*
+ * Map every page of OLD into NEW (which must be empty). The pages are
+ * shared, not copied: each gains a reference and is copied on write
+ * by vm_fault.
+ */
+int
+pt_copy(struct pagetable *old, struct pagetable *new)
+{
+    KASSERT(old != NULL);
+    KASSERT(new != NULL);
+
+    int i, j;
+    struct lpage *lpage;
+
+    for (i = 0; i < PT_L1_ENTRIES; i++) {
+        if (old->pt_dir[i] == NULL) {
+            continue;
+        }
+
+        KASSERT(new->pt_dir[i] == NULL);
+        new->pt_dir[i] = kmalloc(PT_L2_ENTRIES * sizeof(struct lpage *));
+        if (new->pt_dir[i] == NULL) {
+            return ENOMEM;
+        }
+
+        for (j = 0; j < PT_L2_ENTRIES; j++) {
+            lpage = old->pt_dir[i][j];
+            if (lpage != NULL) {
+                lock_acquire(lpage->lp_lock);
+                lpage->lp_refcount++;
+                lock_release(lpage->lp_lock);
+            }
+            new->pt_dir[i][j] = lpage;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Return the slot for VADDR. If its second-level table doesn't exist
+ * yet, allocate it when CREATE is set; otherwise (or if out of memory)
+ * return NULL.
+ */
+struct lpage **
+pt_getslot(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+    KASSERT(pt != NULL);
+    KASSERT(vaddr < MIPS_KSEG0);
+
+    struct lpage **l2;
+
+    l2 = pt->pt_dir[PT_L1_INDEX(vaddr)];
+    if (l2 == NULL) {
+        if (!create) {
+            return NULL;
+        }
+
+        l2 = kmalloc(PT_L2_ENTRIES * sizeof(struct lpage *));
+        if (l2 == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < PT_L2_ENTRIES; i++) {
+            l2[i] = NULL;
+        }
+        pt->pt_dir[PT_L1_INDEX(vaddr)] = l2;
+    }
+
+    return &l2[PT_L2_INDEX(vaddr)];
+}
+
+/*
+ * Unmap and drop the pages in [START, END).
+ */
+void
+pt_unmap(struct pagetable *pt, vaddr_t start, vaddr_t end)
+{
+    KASSERT(pt != NULL);
+    KASSERT((start & PAGE_FRAME) == start);
+
+    vaddr_t va;
+    struct lpage **lpp;
+
+    for (va = start; va < end; va += PAGE_SIZE) {
+        lpp = pt_getslot(pt, va, false);
+        if (lpp == NULL) {
+            /* no table here; skip to the next one */
+            va = ((va >> PT_L1_SHIFT) + 1) << PT_L1_SHIFT;
+            va -= PAGE_SIZE;
+            continue;
+        }
+
+        if (*lpp != NULL) {
+            vm_decref_lpage(*lpp);
+            *lpp = NULL;
+        }
+    }
+}
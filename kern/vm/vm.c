@@ -5,6 +5,9 @@
 #include <kern/errno.h>
 #include <kern/stat.h>
 #include <current.h>
+#include <cpu.h>
+#include <clock.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <vnode.h>
@@ -14,12 +17,74 @@
 #include <mips/tlb.h>
 #include <coremap.h>
 #include <bitmap.h>
+#include <pagetable.h>
 
 unsigned swp_numslots;
 struct vnode *swp_disk;
 struct bitmap *swp_bitmap;
 struct lock *swp_lock;
 bool vm_swap_enabled = false;
+unsigned swp_swapins = 0;
+unsigned swp_swapouts = 0;
+unsigned swp_cleanouts = 0;
+unsigned swp_reads = 0;
+unsigned swp_writes = 0;
+unsigned swp_rahits = 0;
+
+/*
+ * TLB shootdowns are synchronous: the sender waits on vm_ts_sem for
+ * every other cpu to drop the mapping. vm_ts_lock serializes senders so
+ * one semaphore will do.
+ */
+static struct lock *vm_ts_lock;
+static struct semaphore *vm_ts_sem;
+
+/*
+ * Swap slot allocation. The search starts from a rotating hint, just
+ * past the last slots handed out, instead of from slot 0: successive
+ * evictions land in consecutive slots, and the scan normally finds a
+ * free slot at once instead of walking over every slot in use at the
+ * front of the disk. Full bytes of the bitmap are skipped eight slots
+ * at a time, and swp_numfree means a full disk is noticed without
+ * scanning at all. Protected by swp_lock.
+ */
+static unsigned swp_numfree;
+static unsigned swp_hint;
+
+/*
+ * Swap clustering.
+ *
+ * The pageout daemon evicts up to SWP_CLUSTER pages at once: a victim
+ * chosen by the clock and the unreferenced pages next to it in the
+ * same address space (see coremap_choose_cluster). They are sorted by
+ * virtual address and the dirty ones without a slot get a contiguous
+ * run, so neighbouring pages end up next to each other on disk and
+ * runs of consecutive slots go out in one transfer.
+ *
+ * On swap-in the slots following the one wanted are read in the same
+ * transfer and their frames kept in swp_racache, where a later
+ * swap-in of those slots finds them without doing any I/O. The cache
+ * only uses frames that are free anyway; it never evicts to read
+ * ahead.
+ *
+ * Swap I/O is done without swp_lock, so swap-ins and swap-outs can
+ * be queued at the disk together. The slots being read or written
+ * are marked in swp_busy meanwhile. Read-ahead stops short of busy
+ * slots. A swap-in whose slot is being read ahead waits on swp_cv and
+ * then finds it in the cache. Freeing a busy slot, or rewriting one
+ * (its page was swapped in by someone else's read-ahead), waits for
+ * the read too, so a stale copy can't end up in the cache. Nothing
+ * that might evict (and so need swp_lock) may be called with it held.
+ */
+static struct bitmap *swp_busy;
+static struct cv *swp_cv;
+static struct {
+    int rc_slot;                /* -1 if unused */
+    paddr_t rc_paddr;
+} swp_racache[SWP_RACACHE];
+static unsigned swp_rahand;
+
+static void swp_ra_drop(int slot);
 
 struct lpage *
 vm_create_lpage(paddr_t paddr, vaddr_t faultaddress)
@@ -39,8 +104,9 @@ vm_create_lpage(paddr_t paddr, vaddr_t faultaddress)
 
     lpage->lp_paddr = paddr;
     lpage->lp_startaddr = faultaddress;
-    lpage->lp_freed = 0;
     lpage->lp_slot = -1;
+    lpage->lp_dirty = 1;
+    lpage->lp_refcount = 1;
 
     /* spinlock_acquire(&coremap_lock);
      * coremap[paddr / PAGE_SIZE]->cme_page = lpage;
@@ -60,12 +126,145 @@ vm_destroy_lpage(struct lpage *lpage)
     kfree(lpage);
 }
 
+/*
+ * Drop one address space's reference to LPAGE. The last reference
+ * releases the frame or swap slot backing the page and destroys it.
+ * If the page is being evicted this waits on lp_lock until the
+ * eviction is done; the evictor took the lock under coremap_lock, so
+ * the page can't be freed out from under it.
+ */
+void
+vm_decref_lpage(struct lpage *lpage)
+{
+    KASSERT(lpage != NULL);
+
+    lock_acquire(lpage->lp_lock);
+    KASSERT(lpage->lp_refcount > 0);
+
+    lpage->lp_refcount--;
+    if (lpage->lp_refcount > 0) {
+        lock_release(lpage->lp_lock);
+        return;
+    }
+
+    if (lpage->lp_paddr != 0) {
+        coremap_free_page(lpage->lp_paddr);
+    }
+    if (lpage->lp_slot != -1) {
+        lock_acquire(swp_lock);
+        swp_free(lpage->lp_slot);
+        swp_ra_drop(lpage->lp_slot);
+        lock_release(swp_lock);
+    }
+    vm_destroy_lpage(lpage); /* releases lock */
+}
+
+/*
+ * Allocate a zero-filled page for FAULTADDRESS.
+ */
+static struct lpage *
+vm_zerofill_lpage(vaddr_t faultaddress)
+{
+    paddr_t paddr;
+    struct lpage *lpage;
+
+    paddr = coremap_alloc_page();
+    if (paddr == 0) {
+        return NULL;
+    }
+
+    lpage = vm_create_lpage(paddr, faultaddress);
+    if (lpage == NULL) {
+        coremap_free_page(paddr);
+        return NULL;
+    }
+
+    bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+    spinlock_acquire(&coremap_lock);
+    coremap_set_lpage(paddr, lpage);
+    spinlock_release(&coremap_lock);
+
+    return lpage;
+}
+
+/*
+ * Copy-on-write: give the current address space its own copy of the
+ * shared page in *LPP. Called with the shared page's lock held and
+ * the page resident; on success the lock on the new page is held
+ * instead and *LPP points to it.
+ */
+static int
+vm_cow_copy(struct lpage **lpp)
+{
+    paddr_t paddr;
+    struct lpage *old, *new;
+
+    old = *lpp;
+    KASSERT(lock_do_i_hold(old->lp_lock));
+    KASSERT(old->lp_refcount > 1);
+    KASSERT(old->lp_paddr != 0);
+
+    /* we hold old's lock, so it can't be chosen as the victim here */
+    paddr = coremap_alloc_page();
+    if (paddr == 0) {
+        return ENOMEM;
+    }
+
+    new = vm_create_lpage(paddr, old->lp_startaddr);
+    if (new == NULL) {
+        coremap_free_page(paddr);
+        return ENOMEM;
+    }
+
+    memmove((void *)PADDR_TO_KVADDR(paddr),
+            (const void *)PADDR_TO_KVADDR(old->lp_paddr),
+            PAGE_SIZE);
+
+    lock_acquire(new->lp_lock);
+    spinlock_acquire(&coremap_lock);
+    coremap_set_lpage(paddr, new);
+    spinlock_release(&coremap_lock);
+
+    old->lp_refcount--;
+    lock_release(old->lp_lock);
+
+    *lpp = new;
+    return 0;
+}
+
+/*
+ * Pageout daemon: keeps free frames between the coremap's low and high
+ * watermarks so faults rarely have to wait for a page to be written.
+ */
+static void
+vm_pageout_thread(void *unused1, unsigned long unused2)
+{
+    (void)unused1;
+    (void)unused2;
+
+    for (;;) {
+        coremap_pageout_wait();
+        if (!coremap_pageout()) {
+            /* everything is in use; don't spin */
+            clocksleep(1);
+        }
+    }
+}
+
 void
 vm_bootstrap(void)
 {
     int result;
+    unsigned i;
     struct stat statbuf;
 
+    vm_ts_lock = lock_create("vm_ts_lock");
+    vm_ts_sem = sem_create("vm_ts_sem", 0);
+    if (vm_ts_lock == NULL || vm_ts_sem == NULL) {
+        panic("vm: could not create shootdown synchronization");
+    }
+
     result = vfs_open((char *)SWAP_FILE, O_RDWR, 0, &swp_disk);
     if (result) {
         return;
@@ -77,18 +276,38 @@ vm_bootstrap(void)
     }
 
     swp_numslots = statbuf.st_size / PAGE_SIZE;
+    if (swp_numslots > SWP_MAXSLOTS) {
+        kprintf("swap: using only %u of %u pages\n",
+                SWP_MAXSLOTS, swp_numslots);
+        swp_numslots = SWP_MAXSLOTS;
+    }
 
     swp_bitmap = bitmap_create(swp_numslots);
-    if (swp_bitmap == NULL) {
+    swp_busy = bitmap_create(swp_numslots);
+    if (swp_bitmap == NULL || swp_busy == NULL) {
         panic("swap: could not create bitmap");
     }
+    swp_numfree = swp_numslots;
+    swp_hint = 0;
 
     swp_lock = lock_create("swp_lock");
-    if (swp_lock == NULL) {
+    swp_cv = cv_create("swp_cv");
+    if (swp_lock == NULL || swp_cv == NULL) {
         panic("swap: could not create bitmap lock");
     }
 
+    for (i = 0; i < SWP_RACACHE; i++) {
+        swp_racache[i].rc_slot = -1;
+    }
+
     vm_swap_enabled = true;
+
+    coremap_pageout_init();
+    result = thread_fork("pageout", NULL, vm_pageout_thread, NULL, 0);
+    if (result) {
+        panic("vm: could not start pageout daemon");
+    }
+
     kprintf("Swap capacity: %d pages\n", swp_numslots);
     kprintf("Kernel pages used: %d\n", cm_start_page);
 }
@@ -104,203 +323,508 @@ vm_cleartlb(void) {
     splx(spl);
 }
 
+/*
+ * Reserve N contiguous free slots and return the first in *SLOTP.
+ * Returns ENOMEM if there is no such run.
+ *
+ * The scan goes once round the whole disk from the hint, and on past
+ * the hint by N-1 slots, so a run that starts before the hint and
+ * ends after it is found too. Runs can't wrap from the last slot to
+ * slot 0: they have to be contiguous on disk.
+ */
 int
-swp_get_slot(void)
+swp_alloc(unsigned n, int *slotp)
+{
+    unsigned i, j, scanned, limit, run;
+    unsigned char *map;
+
+    KASSERT(lock_do_i_hold(swp_lock));
+    KASSERT(n > 0);
+
+    if (swp_numfree < n) {
+        return ENOMEM;
+    }
+
+    map = bitmap_getdata(swp_bitmap);
+    run = 0;
+    i = swp_hint;
+    limit = swp_numslots + n - 1;
+    for (scanned = 0; scanned < limit; scanned++, i++) {
+        if (i >= swp_numslots) {
+            i = 0;
+            run = 0;
+        }
+
+        if (i % 8 == 0 && map[i / 8] == 0xff) {
+            run = 0;
+            i += 7;
+            scanned += 7;
+            continue;
+        }
+
+        if (bitmap_isset(swp_bitmap, i)) {
+            run = 0;
+        } else if (++run == n) {
+            i = i - n + 1;
+            for (j = 0; j < n; j++) {
+                bitmap_mark(swp_bitmap, i + j);
+            }
+            swp_numfree -= n;
+            swp_hint = i + n;
+            *slotp = i;
+            return 0;
+        }
+    }
+
+    return ENOMEM;
+}
+
+/* Wait until SLOT isn't being read or written. */
+static void
+swp_wait_idle(int slot)
 {
-    /* KASSERT(lock_do_i_hold(swp_lock)); */
+    KASSERT(lock_do_i_hold(swp_lock));
+
+    while (bitmap_isset(swp_busy, slot)) {
+        cv_wait(swp_cv, swp_lock);
+    }
+}
 
+/*
+ * Free SLOT. If it's being read ahead, wait for that first, or the
+ * stale copy would be cached after the caller has dropped it.
+ */
+void
+swp_free(int slot)
+{
+    KASSERT(lock_do_i_hold(swp_lock));
+    KASSERT(bitmap_isset(swp_bitmap, slot));
+
+    swp_wait_idle(slot);
+    bitmap_unmark(swp_bitmap, slot);
+    swp_numfree++;
+}
+
+static int
+swp_ra_find(int slot)
+{
     unsigned i;
 
-    for (i = 0; i < swp_numslots; i++) {
-        if (!bitmap_isset(swp_bitmap, i)) {
+    KASSERT(lock_do_i_hold(swp_lock));
+
+    for (i = 0; i < SWP_RACACHE; i++) {
+        if (swp_racache[i].rc_slot == slot) {
             return i;
         }
     }
+    return -1;
+}
+
+/* Forget the cached copy of SLOT, if any: it's being rewritten or freed. */
+static void
+swp_ra_drop(int slot)
+{
+    int i = swp_ra_find(slot);
 
-    panic("Ran out of disk");
+    if (i >= 0) {
+        coremap_free_page(swp_racache[i].rc_paddr);
+        swp_racache[i].rc_slot = -1;
+    }
 }
 
-void
+/* Take the cached copy of SLOT out of the cache. Returns 0 if none. */
+static paddr_t
+swp_ra_take(int slot)
+{
+    int i = swp_ra_find(slot);
+
+    if (i < 0) {
+        return 0;
+    }
+    swp_racache[i].rc_slot = -1;
+    return swp_racache[i].rc_paddr;
+}
+
+static void
+swp_ra_insert(int slot, paddr_t paddr)
+{
+    unsigned i = swp_rahand;
+
+    KASSERT(lock_do_i_hold(swp_lock));
+
+    if (swp_racache[i].rc_slot != -1) {
+        coremap_free_page(swp_racache[i].rc_paddr);
+    }
+    swp_racache[i].rc_slot = slot;
+    swp_racache[i].rc_paddr = paddr;
+    swp_rahand = (i + 1) % SWP_RACACHE;
+}
+
+/*
+ * Number of slots worth reading starting at SLOT: SLOT itself and the
+ * following slots that are in use, not cached and not being written,
+ * up to SWP_CLUSTER.
+ */
+static unsigned
+swp_ra_span(int slot)
+{
+    unsigned n = 1;
+
+    while (n < SWP_CLUSTER && slot + n < swp_numslots &&
+           bitmap_isset(swp_bitmap, slot + n) &&
+           !bitmap_isset(swp_busy, slot + n) &&
+           swp_ra_find(slot + n) < 0) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Transfer N pages at PADDRS to or from N consecutive slots at SLOT.
+ * Called without swp_lock, with the slots marked busy.
+ */
+static int
+swp_io(paddr_t *paddrs, unsigned n, int slot, enum uio_rw rw)
+{
+    unsigned i;
+    struct iovec iov[SWP_CLUSTER];
+    struct uio uio;
+
+    KASSERT(n > 0 && n <= SWP_CLUSTER);
+
+    for (i = 0; i < n; i++) {
+        iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(paddrs[i]);
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    uio.uio_iov = iov;
+    uio.uio_iovcnt = n;
+    uio.uio_offset = (off_t)slot * PAGE_SIZE;
+    uio.uio_resid = n * PAGE_SIZE;
+    uio.uio_segflg = UIO_SYSSPACE;
+    uio.uio_rw = rw;
+    uio.uio_space = NULL;
+
+    if (rw == UIO_READ) {
+        return VOP_READ(swp_disk, &uio);
+    }
+    return VOP_WRITE(swp_disk, &uio);
+}
+
+int
 vm_swapin(struct lpage *lpage)
 {
     KASSERT(lpage != NULL);
     KASSERT(lock_do_i_hold(lpage->lp_lock));
     KASSERT(bitmap_isset(swp_bitmap, lpage->lp_slot));
 
-    int result;
-    paddr_t paddr;
-    struct uio uio;
-    struct iovec iov;
+    int result, slot;
+    unsigned i, n;
+    paddr_t paddr, paddrs[SWP_CLUSTER];
 
-    paddr = coremap_alloc_page(); /* locks */
+    slot = lpage->lp_slot;
 
-    uio_kinit(&iov, &uio, (void *)PADDR_TO_KVADDR(paddr),
-              PAGE_SIZE, 0, UIO_READ);
-    uio.uio_offset = lpage->lp_slot * PAGE_SIZE;
+    lock_acquire(swp_lock);
+    /* if it's being read ahead, it'll be in the cache after */
+    swp_wait_idle(slot);
+    paddr = swp_ra_take(slot);
+    if (paddr != 0) {
+        swp_swapins++;
+        swp_rahits++;
+        lock_release(swp_lock);
+        goto done;
+    }
+    n = swp_ra_span(slot);
+    lock_release(swp_lock);
 
-    result = VOP_READ(swp_disk, &uio);
-    if (result) {
-        /* TODO: fail in some other way */
-        panic("error reading from swap disk");
+    /* frames first: allocating may evict, which takes swp_lock */
+    paddrs[0] = coremap_alloc_page(); /* locks */
+    if (paddrs[0] == 0) {
+        return ENOMEM;
+    }
+    for (i = 1; i < n; i++) {
+        paddrs[i] = coremap_try_alloc_page();
+        if (paddrs[i] == 0) {
+            break;
+        }
     }
+    n = i;
 
     lock_acquire(swp_lock);
-    bitmap_unmark(swp_bitmap, lpage->lp_slot);
+
+    /* someone else may have read it ahead in the meantime */
+    swp_wait_idle(slot);
+    paddr = swp_ra_take(slot);
+    if (paddr != 0) {
+        swp_rahits++;
+        for (i = 0; i < n; i++) {
+            coremap_free_page(paddrs[i]);
+        }
+    } else {
+        i = swp_ra_span(slot);
+        for (; n > i; n--) {
+            coremap_free_page(paddrs[n - 1]);
+        }
+
+        for (i = 0; i < n; i++) {
+            bitmap_mark(swp_busy, slot + i);
+        }
+        lock_release(swp_lock);
+
+        result = swp_io(paddrs, n, slot, UIO_READ);
+        if (result) {
+            /* TODO: fail in some other way */
+            panic("error reading from swap disk");
+        }
+
+        lock_acquire(swp_lock);
+        for (i = 0; i < n; i++) {
+            bitmap_unmark(swp_busy, slot + i);
+        }
+        cv_broadcast(swp_cv, swp_lock);
+        swp_reads++;
+
+        paddr = paddrs[0];
+        for (i = 1; i < n; i++) {
+            swp_ra_insert(slot + i, paddrs[i]);
+        }
+    }
+    swp_swapins++;
     lock_release(swp_lock);
 
+done:
+    /* keep the slot: it stays valid until the page is written to */
     lpage->lp_paddr = paddr;
-    lpage->lp_slot = -1;
+    lpage->lp_dirty = 0;
+
+    spinlock_acquire(&coremap_lock);
+    coremap_set_lpage(paddr, lpage);
+    spinlock_release(&coremap_lock);
 
-    /* vm_cleartlb(); */
+    return 0;
 }
 
-paddr_t
-vm_swapout(struct lpage *lpage)
+/*
+ * Remove the mappings for the N addresses in VADDRS from every TLB,
+ * waiting until the other cpus have done so. N is at most
+ * TLBSHOOTDOWN_MAX, which is as many as a cpu can have queued; senders
+ * are serialized and wait for all of theirs, so the queues are empty
+ * when we start. Before the secondary cpus are started num_cpus is
+ * zero and only the local TLB is touched.
+ *
+ * There are no ASIDs: an address may be mapped by a different process
+ * on another cpu, and that entry goes too. That only costs a fault.
+ */
+void
+vm_tlbinvalidate(const vaddr_t *vaddrs, unsigned n)
 {
-    KASSERT(lpage != NULL);
-    KASSERT(lock_do_i_hold(lpage->lp_lock));
+    unsigned i, j, sent = 0;
+    int spl, index;
+    struct cpu *c;
+    struct tlbshootdown ts;
 
-    int slot, result, index;
-    paddr_t paddr_victim;
-    struct uio uio;
-    struct iovec iov;
-
-    /* get a free disk slot */
-    lock_acquire(swp_lock);
-    slot = swp_get_slot();
-    bitmap_mark(swp_bitmap, slot);
-    lock_release(swp_lock);
+    KASSERT(n <= TLBSHOOTDOWN_MAX);
 
-    /* update slot in PTE */
-    paddr_victim = lpage->lp_paddr;
-    lpage->lp_slot = slot;
-    lpage->lp_paddr = 0;
+    if (n == 0) {
+        return;
+    }
 
-    /* write that page's data to swap file */
-    uio_kinit(&iov, &uio, (void *)PADDR_TO_KVADDR(paddr_victim),
-              PAGE_SIZE, 0, UIO_WRITE);
-    uio.uio_offset = slot*PAGE_SIZE;
+    spl = splhigh();
+    for (j = 0; j < n; j++) {
+        index = tlb_probe(vaddrs[j], 0);
+        if (index >= 0) {
+            tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+        }
+    }
+    splx(spl);
 
-    result = VOP_WRITE(swp_disk, &uio);
-    if (result) {
-        /* TODO: fail in some other way */
-        panic("error writing to swap disk");
+    if (num_cpus <= 1) {
+        return;
     }
 
-    /* vm_cleartlb(); */
-    lock_release(lpage->lp_lock);
-    if ((index = tlb_probe(lpage->lp_startaddr, 0)) != -1) {
-        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+    ts.ts_done = vm_ts_sem;
+
+    lock_acquire(vm_ts_lock);
+    for (i = 0; i < num_cpus; i++) {
+        c = cpu_get(i);
+        if (c == curcpu->c_self) {
+            continue;
+        }
+        for (j = 0; j < n; j++) {
+            ts.ts_vaddr = vaddrs[j];
+            ipi_tlbshootdown(c, &ts);
+            sent++;
+        }
+    }
+    for (i = 0; i < sent; i++) {
+        P(vm_ts_sem);
     }
-    return paddr_victim;
+    lock_release(vm_ts_lock);
 }
 
+/*
+ * Evict the N pages in LPAGES, whose locks the caller holds, and
+ * return their frames in PADDRS. Only dirty pages are written; a clean
+ * one already has a good copy in its slot. Releases the pages' locks.
+ * LPAGES is sorted by address in place.
+ *
+ * If swap is full, dirty pages without a slot stay resident, their
+ * entry in PADDRS is 0 and ENOMEM is returned.
+ */
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+vm_swapout_cluster(struct lpage **lpages, paddr_t *paddrs, unsigned n)
 {
-    unsigned i = 0;
-    struct addrspace *as;
-
-    int spl, pageno;
-    uint32_t ehi, elo;
-    vaddr_t vtop, vbase;
-    paddr_t paddr = 0;
+    int slot, result, err = 0;
+    unsigned i, j, nslots, nwrites;
+    bool run;
+    vaddr_t vaddrs[SWP_CLUSTER];
     struct lpage *lpage;
 
-    faultaddress &= PAGE_FRAME;
+    KASSERT(n > 0 && n <= SWP_CLUSTER);
 
-    if (curproc == NULL) {
-        return EFAULT;
+    for (i = 1; i < n; i++) {
+        lpage = lpages[i];
+        for (j = i; j > 0 &&
+                 lpages[j - 1]->lp_startaddr > lpage->lp_startaddr; j--) {
+            lpages[j] = lpages[j - 1];
+        }
+        lpages[j] = lpage;
     }
 
-    as = proc_getas();
-    if (as == NULL) {
-        return EFAULT;
-    }
+    nslots = 0;
+    for (i = 0; i < n; i++) {
+        lpage = lpages[i];
+        KASSERT(lock_do_i_hold(lpage->lp_lock));
+        KASSERT(lpage->lp_paddr != 0);
 
-    KASSERT(as->as_regions != NULL);
+        paddrs[i] = lpage->lp_paddr;
+        vaddrs[i] = lpage->lp_startaddr;
 
-    if (as->as_heapmax != 0 && faultaddress > as->as_heapbrk) {
-        int nullpage = 0;
-        for (i = 0; i < LPAGES; i++) {
-            if (as->as_stack[i] != NULL) {
-                lock_acquire(as->as_stack[i]->lp_lock);
-                vbase = as->as_stack[i]->lp_startaddr;
-
-                if (faultaddress == vbase) {
-                    if (as->as_stack[i]->lp_paddr == 0) {
-                        vm_swapin(as->as_stack[i]);
-                    }
-
-                    KASSERT(as->as_stack[i]->lp_paddr != 0);
-                    KASSERT(as->as_stack[i]->lp_slot == -1);
-
-                    lpage = as->as_stack[i];
-                    paddr = lpage->lp_paddr;
-                    lock_release(lpage->lp_lock);
-                    goto skip_regions;
-                }
-                lock_release(as->as_stack[i]->lp_lock);
-            } else {
-                nullpage = i;
-            }
+        if (lpage->lp_dirty && lpage->lp_slot == -1) {
+            nslots++;
         }
+    }
 
-        KASSERT(i == LPAGES);
+    /* nobody may write the frames through a stale mapping from now on */
+    vm_tlbinvalidate(vaddrs, n);
 
-        as->as_heapmax = faultaddress;
+    lock_acquire(swp_lock);
 
-        paddr = coremap_alloc_page();
+    /* get free disk slots, contiguous if we can */
+    run = nslots > 1 && swp_alloc(nslots, &slot) == 0;
+    for (i = 0; i < n && nslots > 0; i++) {
+        lpage = lpages[i];
+        if (!lpage->lp_dirty || lpage->lp_slot != -1) {
+            continue;
+        }
+        nslots--;
+        if (run) {
+            lpage->lp_slot = slot++;
+        } else if (swp_alloc(1, &slot) == 0) {
+            lpage->lp_slot = slot;
+        } else {
+            /* out of swap: this one stays in memory */
+            paddrs[i] = 0;
+            err = ENOMEM;
+        }
+    }
 
-        KASSERT(paddr != 0);
+    /*
+     * Mark the slots about to be written busy and forget any cached
+     * copies of them; then the writes can go without swp_lock. A slot
+     * being kept from an earlier swap-out may be in the middle of
+     * being read ahead; let that finish first, so the copy it caches
+     * is dropped here rather than kept.
+     */
+    for (i = 0; i < n; i++) {
+        lpage = lpages[i];
+        if (paddrs[i] == 0) {
+            continue;
+        }
+        if (!lpage->lp_dirty) {
+            KASSERT(lpage->lp_slot != -1);
+            swp_cleanouts++;
+            continue;
+        }
+        swp_wait_idle(lpage->lp_slot);
+        bitmap_mark(swp_busy, lpage->lp_slot);
+        swp_ra_drop(lpage->lp_slot);
+    }
 
-        as->as_stack[nullpage] = vm_create_lpage(paddr, faultaddress);
-        if (as->as_stack[nullpage] == NULL) {
-            return ENOMEM;
+    lock_release(swp_lock);
+
+    /* write each run of dirty pages in consecutive slots at once */
+    nwrites = 0;
+    for (i = 0; i < n; i = j) {
+        lpage = lpages[i];
+        if (paddrs[i] == 0 || !lpage->lp_dirty) {
+            j = i + 1;
+            continue;
         }
 
-        lpage = as->as_stack[nullpage];
-        bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
-        goto skip_regions;
-    } else if (faultaddress >= as->as_heapstart &&
-               faultaddress < as->as_heapbrk) {
-        int nullpage = 0;
-        for (i = 0; i < HEAPPAGES; i++) {
-            if (as->as_heap[i] != NULL && as->as_heap[i]->lp_freed == 0) {
-                vbase = as->as_heap[i]->lp_startaddr;
-
-                if (faultaddress == vbase) {
-                    paddr = as->as_heap[i]->lp_paddr;
-                    lpage = as->as_heap[i];
-                    goto skip_regions;
-                }
-            } else {
-                nullpage = i;
+        for (j = i + 1; j < n; j++) {
+            if (!lpages[j]->lp_dirty || paddrs[j] == 0 ||
+                lpages[j]->lp_slot != lpage->lp_slot + (int)(j - i)) {
+                break;
             }
         }
 
-        KASSERT(i == HEAPPAGES);
-
-        paddr = coremap_alloc_page();
+        result = swp_io(paddrs + i, j - i, lpage->lp_slot, UIO_WRITE);
+        if (result) {
+            /* TODO: fail in some other way */
+            panic("error writing to swap disk");
+        }
+        nwrites++;
+    }
 
-        KASSERT(paddr != 0);
+    lock_acquire(swp_lock);
+    for (i = 0; i < n; i++) {
+        lpage = lpages[i];
+        if (paddrs[i] != 0 && lpage->lp_dirty) {
+            bitmap_unmark(swp_busy, lpage->lp_slot);
+            swp_swapouts++;
+        }
+    }
+    cv_broadcast(swp_cv, swp_lock);
+    swp_writes += nwrites;
+    lock_release(swp_lock);
 
-        if (as->as_heap[nullpage] == NULL) {
-            as->as_heap[nullpage] = vm_create_lpage(paddr, faultaddress);
-            if (as->as_heap[nullpage] == NULL) {
-                return ENOMEM;
-            }
+    for (i = 0; i < n; i++) {
+        lpage = lpages[i];
+        if (paddrs[i] == 0) {
+            /* the caller took it out of the coremap; put it back */
+            spinlock_acquire(&coremap_lock);
+            coremap_set_lpage(lpage->lp_paddr, lpage);
+            spinlock_release(&coremap_lock);
         } else {
-            as->as_heap[nullpage]->lp_freed = 0;
-            as->as_heap[nullpage]->lp_paddr = paddr;
-            as->as_heap[nullpage]->lp_startaddr = faultaddress;
+            lpage->lp_dirty = 0;
+            lpage->lp_paddr = 0;
         }
-
-        lpage = as->as_heap[nullpage];
-        bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
-        goto skip_regions;
+        lock_release(lpage->lp_lock);
     }
 
+    return err;
+}
+
+/*
+ * Evict LPAGE and return its frame, or 0 if there's no swap space
+ * left for it. Releases the page's lock.
+ */
+paddr_t
+vm_swapout(struct lpage *lpage)
+{
+    paddr_t paddr;
+
+    vm_swapout_cluster(&lpage, &paddr, 1);
+    return paddr;
+}
+
+/* The region of AS containing FAULTADDRESS, or NULL. */
+static struct region *
+vm_find_region(struct addrspace *as, vaddr_t faultaddress)
+{
+    unsigned i;
+    vaddr_t vbase, vtop;
+
     for (i = 0; i < as->as_numregions; i++) {
         struct region *region = as->as_regions[i];
 
@@ -312,99 +836,241 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         vtop = vbase + PAGE_SIZE * region->r_numpages;
 
         if (faultaddress >= vbase && faultaddress < vtop) {
-            pageno = (faultaddress - vbase) / PAGE_SIZE;
-            if (region->r_pages[pageno] == NULL) {
-                /* OOM page, need to allocate */
-                paddr = coremap_alloc_page();
-                KASSERT(paddr != 0);
-
-                region->r_pages[pageno] = vm_create_lpage(paddr, faultaddress);
-                if (region->r_pages[pageno] == NULL) {
-                    return ENOMEM;
-                }
-
-                lpage = region->r_pages[pageno];
-                bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
-            } else {
-                lock_acquire(region->r_pages[pageno]->lp_lock);
-                if (region->r_pages[pageno]->lp_paddr == 0) {
-                    vm_swapin(region->r_pages[pageno]);
-                }
-
-                KASSERT(region->r_pages[pageno]->lp_paddr != 0);
-                KASSERT(region->r_pages[pageno]->lp_slot == -1);
-
-                lpage = region->r_pages[pageno];
-                paddr = lpage->lp_paddr;
-                lock_release(lpage->lp_lock);
-            }
+            return region;
         }
     }
 
-skip_regions:
-    if (paddr == 0) {
+    return NULL;
+}
+
+/*
+ * Is FAULTADDRESS part of AS? Only needed the first time a page is
+ * touched; afterwards the page table has an entry for it.
+ */
+static bool
+vm_valid_addr(struct addrspace *as, vaddr_t faultaddress)
+{
+    /* stack: anything above the break grows the stack down */
+    if (as->as_heapmax != 0 && faultaddress > as->as_heapbrk) {
+        return true;
+    }
+
+    /* heap */
+    if (faultaddress >= as->as_heapstart &&
+        faultaddress < as->as_heapbrk) {
+        return true;
+    }
+
+    return vm_find_region(as, faultaddress) != NULL;
+}
+
+/*
+ * Read the part of REGION's file data that falls in the resident,
+ * zero-filled page LPAGE, if any. Called with the page locked.
+ */
+static int
+vm_fill_lpage(struct region *region, struct lpage *lpage)
+{
+    int result;
+    vaddr_t start, end;
+    struct iovec iov;
+    struct uio uio;
+
+    KASSERT(lock_do_i_hold(lpage->lp_lock));
+    KASSERT(lpage->lp_paddr != 0);
+
+    start = lpage->lp_startaddr;
+    if (start < region->r_filevaddr) {
+        start = region->r_filevaddr;
+    }
+    end = lpage->lp_startaddr + PAGE_SIZE;
+    if (end > region->r_filevaddr + region->r_filesize) {
+        end = region->r_filevaddr + region->r_filesize;
+    }
+    if (start >= end) {
+        /* BSS */
+        return 0;
+    }
+
+    uio_kinit(&iov, &uio,
+              (void *)(PADDR_TO_KVADDR(lpage->lp_paddr)
+                       + (start - lpage->lp_startaddr)),
+              end - start,
+              region->r_fileoffset + (start - region->r_filevaddr),
+              UIO_READ);
+
+    result = VOP_READ(region->r_vnode, &uio);
+    if (result) {
+        return result;
+    }
+    if (uio.uio_resid != 0) {
+        /* the executable was truncated under us */
         return EFAULT;
     }
 
-    spinlock_acquire(&coremap_lock);
-    coremap_set_lpage(paddr, lpage);
-    spinlock_release(&coremap_lock);
+    /* a swap copy made before the read is stale */
+    lpage->lp_dirty = 1;
+    return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+    struct addrspace *as;
+
+    int spl, index, result;
+    uint32_t ehi, elo;
+    paddr_t paddr = 0;
+    struct lpage *lpage, **lpp;
+    struct region *region, *fill = NULL;
+
+    faultaddress &= PAGE_FRAME;
 
     switch (faulttype) {
     case VM_FAULT_READONLY:
-        if ((as->as_regions[i]->r_permissions & 2) == 0) {
-            kprintf("RDONLY\n");
-            return EFAULT;
-        }
-        break;
     case VM_FAULT_READ:
-        /* if ((as->as_regions[i]->r_permissions & 4) == 0) {
-         *     kprintf("RD\n");
-         *     return EFAULT;
-         * } */
-        break;
     case VM_FAULT_WRITE:
-        /* if ((as->as_regions[i]->r_permissions & 2) == 0) {
-         *     kprintf("WR\n");
-         *     return EFAULT;
-         * } */
         break;
     default:
         return EINVAL;
     }
 
+    if (curproc == NULL) {
+        return EFAULT;
+    }
+
+    as = proc_getas();
+    if (as == NULL) {
+        return EFAULT;
+    }
+
+    if (faultaddress >= USERSTACK) {
+        return EFAULT;
+    }
+
+    KASSERT(as->as_pt != NULL);
+
+    /* no writing to text or other segments without the write bit */
+    if (faulttype != VM_FAULT_READ) {
+        region = vm_find_region(as, faultaddress);
+        if (region != NULL && (region->r_permissions & 2) == 0) {
+            return EFAULT;
+        }
+    }
+
+    lpp = pt_getslot(as->as_pt, faultaddress, false);
+    if (lpp == NULL || *lpp == NULL) {
+        /* first touch */
+        if (!vm_valid_addr(as, faultaddress)) {
+            return EFAULT;
+        }
+
+        lpp = pt_getslot(as->as_pt, faultaddress, true);
+        if (lpp == NULL) {
+            return ENOMEM;
+        }
+
+        *lpp = vm_zerofill_lpage(faultaddress);
+        if (*lpp == NULL) {
+            return ENOMEM;
+        }
+
+        /* pages of the executable are read in below */
+        fill = vm_find_region(as, faultaddress);
+        if (fill != NULL && fill->r_vnode == NULL) {
+            fill = NULL;
+        }
+
+        /* the heap may not grow into the stack */
+        if (faultaddress > as->as_heapbrk && faultaddress < as->as_heapmax) {
+            as->as_heapmax = faultaddress;
+        }
+    }
+
+    lpage = *lpp;
+    lock_acquire(lpage->lp_lock);
+    if (lpage->lp_paddr == 0) {
+        result = vm_swapin(lpage);
+        if (result) {
+            goto fail;
+        }
+    }
+
+    if (fill != NULL) {
+        result = vm_fill_lpage(fill, lpage);
+        if (result) {
+            goto fail;
+        }
+    }
+
+    KASSERT(lpage->lp_paddr != 0);
+
+    /*
+     * A write to a page still shared with another address space
+     * (fork) gets a private copy. Reads keep using the shared frame.
+     */
+    if (faulttype != VM_FAULT_READ) {
+        if (lpage->lp_refcount > 1) {
+            result = vm_cow_copy(lpp);
+            if (result) {
+                lock_release(lpage->lp_lock);
+                return result;
+            }
+            lpage = *lpp;
+        }
+        /* its swap copy, if any, is about to be stale */
+        lpage->lp_dirty = 1;
+    }
+
+    /*
+     * The coremap already points at lpage: that was set when the
+     * frame was allocated, swapped in or copied. Mark the frame
+     * referenced for the clock, and note whose it is so pageout can
+     * evict it along with its neighbours.
+     */
+    paddr = lpage->lp_paddr;
+    coremap[paddr / PAGE_SIZE]->cme_is_refd = 1;
+    coremap[paddr / PAGE_SIZE]->cme_as = as;
+
     /* make sure it's page-aligned */
     KASSERT((paddr & PAGE_FRAME) == paddr);
 
+    /*
+     * Shared pages stay read-only so the first write traps, and so do
+     * clean ones so that the write marks them dirty.
+     */
+    elo = paddr | TLBLO_VALID;
+    if (lpage->lp_refcount == 1 && lpage->lp_dirty) {
+        elo |= TLBLO_DIRTY;
+    }
+    ehi = faultaddress;
+
     /* Disable interrupts on this CPU while frobbing the TLB. */
     spl = splhigh();
 
-/* add_to_tlb: */
-    elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-    ehi = faultaddress;
-    tlb_random(ehi, elo);
-    /* for (i=0; i<NUM_TLB; i++) {
-     *     tlb_read(&ehi, &elo, i);
-     *     if (elo & TLBLO_VALID) {
-     *         continue;
-     *     }
-     *     ehi = faultaddress;
-     *     elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-     *     DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-     *     tlb_write(ehi, elo, i);
-     *     splx(spl);
-     *     return 0;
-     * }
-     *
-     * if (i == NUM_TLB) {
-     *     for (i = 0; i < NUM_TLB; i++) {
-     *         tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-     *     }
-     *     goto add_to_tlb;
-     * } */
+    /* a READONLY fault leaves the old entry in place; overwrite it */
+    index = tlb_probe(ehi, 0);
+    if (index >= 0) {
+        tlb_write(ehi, elo, index);
+    } else {
+        tlb_random(ehi, elo);
+    }
 
     splx(spl);
+    lock_release(lpage->lp_lock);
     return 0;
+
+ fail:
+    lock_release(lpage->lp_lock);
+    if (fill != NULL) {
+        /*
+         * Don't leave a zero-filled page in place of the file data:
+         * take it out so the next fault reads it in again.
+         */
+        *lpp = NULL;
+        vm_decref_lpage(lpage);
+    }
+    return result;
 }
 
 vaddr_t
@@ -434,21 +1100,60 @@ free_kpages(vaddr_t addr)
 {
     paddr_t paddr = addr - MIPS_KSEG0;
 
+    if (coremap[paddr / PAGE_SIZE]->cme_is_last_page) {
+        coremap_free_page(paddr);
+        return;
+    }
+
     spinlock_acquire(&coremap_lock);
     coremap_free_kpages(paddr);
     spinlock_release(&coremap_lock);
 }
 
-unsigned int
-coremap_used_bytes(void)
+void
+vm_printstats(void)
+{
+    if (!vm_swap_enabled) {
+        kprintf("vm: swap is not enabled\n");
+        return;
+    }
+
+    lock_acquire(swp_lock);
+    kprintf("vm: %u swap-ins in %u reads, %u from read-ahead\n",
+            swp_swapins, swp_reads, swp_rahits);
+    kprintf("vm: %u swap-outs in %u writes, %u clean evictions\n",
+            swp_swapouts, swp_writes, swp_cleanouts);
+    lock_release(swp_lock);
+}
+
+void
+vm_zerostats(void)
 {
-    return cm_used_bytes;
+    if (!vm_swap_enabled) {
+        return;
+    }
+
+    lock_acquire(swp_lock);
+    swp_swapins = 0;
+    swp_swapouts = 0;
+    swp_cleanouts = 0;
+    swp_reads = 0;
+    swp_writes = 0;
+    swp_rahits = 0;
+    lock_release(swp_lock);
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *tlbshootdown)
 {
-    (void)tlbshootdown;
-    /* panic("vm_tlbshootdown"); */
-    as_activate();
+    int spl, index;
+
+    spl = splhigh();
+    index = tlb_probe(tlbshootdown->ts_vaddr, 0);
+    if (index >= 0) {
+        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+    }
+    splx(spl);
+
+    V(tlbshootdown->ts_done);
 }
@@ -296,15 +296,34 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	assert(fileblock == numblocks);
 }
 
+/*
+ * Name hash for hashed directories (see kern/sfs.h).
+ */
+static
+uint32_t
+dirhash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_BASIS;
+
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * SFS_DIRHASH_PRIME;
+	}
+	return h;
+}
+
+/* Shape of the hashed directory being dumped; 0 blocks if linear */
+static uint32_t hashdir_nblocks;
+static uint32_t hashdir_probe;
+
 static
 void
 dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 {
 	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
 	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	uint32_t home, dist;
 	int i;
 
-	(void)fileblock;
 	if (diskblock == 0) {
 		printf("    [block %u - empty]\n", diskblock);
 		return;
@@ -319,7 +338,17 @@ dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 		}
 		else {
 			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
-			printf("        %u %s\n", ino, sds[i].sfd_name);
+			printf("        %u %s", ino, sds[i].sfd_name);
+			if (hashdir_nblocks > 0) {
+				home = dirhash(sds[i].sfd_name)
+					% hashdir_nblocks;
+				dist = (fileblock + hashdir_nblocks - home)
+					% hashdir_nblocks;
+				printf(" (home %u%s)", home,
+				       dist > hashdir_probe ?
+				       ", MISPLACED" : "");
+			}
+			printf("\n");
 		}
 	}
 }
@@ -334,6 +363,12 @@ dumpdir(uint32_t ino, const struct sfs_dinode *sfi)
 	if (SWAP32(sfi->sfi_size) % sizeof(struct sfs_direntry) != 0) {
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
+	hashdir_nblocks = 0;
+	hashdir_probe = 0;
+	if (SWAP16(sfi->sfi_dirformat) == SFS_DIR_HASHED) {
+		hashdir_nblocks = SWAP32(sfi->sfi_size) / SFS_BLOCKSIZE;
+		hashdir_probe = SWAP16(sfi->sfi_dirprobe);
+	}
 	printf("Directory contents for inode %u: %d entries\n", ino, nentries);
 	traverse(sfi, dumpdirblock);
 }
@@ -449,6 +484,16 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR) {
+		switch (SWAP16(sfi.sfi_dirformat)) {
+		    case SFS_DIR_LINEAR: typename = "linear"; break;
+		    case SFS_DIR_HASHED: typename = "hashed"; break;
+		    default: typename = "invalid"; break;
+		}
+		dumpvalf("Dir format", "%u (%s)", SWAP16(sfi.sfi_dirformat),
+			 typename);
+		dumpvalf("Dir probe", "%u", SWAP16(sfi.sfi_dirprobe));
+	}
 	printf("\n");
 
         printf("    Direct blocks:\n");
@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <limits.h>
 #include <err.h>
@@ -166,19 +167,41 @@ writefreemap(uint32_t fsblocks)
 
 /*
  * Write out the root directory inode.
+ *
+ * If HASHBLOCKS is nonzero, make the root a hashed directory of that
+ * many (empty) blocks, taken from just past the freemap. Otherwise
+ * it's an empty linear directory.
  */
 static
 void
-writerootdir(void)
+writerootdir(uint32_t fsblocks, uint32_t hashblocks)
 {
+	char zeros[SFS_BLOCKSIZE];
 	struct sfs_dinode sfi;
+	uint32_t block, i;
 
 	/* Initialize the dinode */
 	bzero((void *)&sfi, sizeof(sfi));
-	sfi.sfi_size = SWAP32(0);
+	sfi.sfi_size = SWAP32(hashblocks * SFS_BLOCKSIZE);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(1);
 
+	if (hashblocks > 0) {
+		sfi.sfi_dirformat = SWAP16(SFS_DIR_HASHED);
+		sfi.sfi_dirprobe = SWAP16(0);
+
+		bzero(zeros, sizeof(zeros));
+		block = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(fsblocks);
+		if (block + hashblocks > fsblocks) {
+			errx(1, "Filesystem too small for the root directory");
+		}
+		for (i=0; i<hashblocks; i++) {
+			allocblock(block + i);
+			diskwrite(zeros, block + i);
+			sfi.sfi_direct[i] = SWAP32(block + i);
+		}
+	}
+
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
 }
@@ -189,15 +212,27 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, hashblocks;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	hashblocks = 0;
+	if (argc==5 && !strcmp(argv[1], "-H")) {
+		hashblocks = atoi(argv[2]);
+		if (hashblocks < 1 || hashblocks > SFS_NDIRECT) {
+			errx(1, "Hashed root directory must be 1-%u blocks",
+			     SFS_NDIRECT);
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-H dirblocks] device/diskfile "
+		     "volume-name");
 	}
 
 	check();
@@ -230,9 +265,9 @@ main(int argc, char **argv)
 
 	/* Write out the on-disk structures */
 	initfreemap(size);
+	writerootdir(size, hashblocks);
 	writesuper(volname, size);
 	writefreemap(size);
-	writerootdir();
 
 	closedisk();
 
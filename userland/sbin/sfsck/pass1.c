@@ -277,6 +277,15 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		changed = 1;
 	}
 
+	if (!isdir && (sfi->sfi_dirformat != 0 || sfi->sfi_dirprobe != 0)) {
+		warnx("Inode %lu: directory format set on a file (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_dirformat = 0;
+		sfi->sfi_dirprobe = 0;
+		changed = 1;
+	}
+
 	if (check_inode_blocks(ino, sfi, isdir)) {
 		changed = 1;
 	}
@@ -374,6 +383,30 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 					   sizeof(struct sfs_direntry));
 		ichanged = 1;
 	}
+	if (sfi.sfi_dirformat != SFS_DIR_LINEAR &&
+	    sfi.sfi_dirformat != SFS_DIR_HASHED) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s has unknown format %u (made linear)",
+		      pathsofar, sfi.sfi_dirformat);
+		sfi.sfi_dirformat = SFS_DIR_LINEAR;
+		ichanged = 1;
+	}
+	if (sfi.sfi_dirformat == SFS_DIR_HASHED &&
+	    (sfi.sfi_size == 0 || sfi.sfi_size % SFS_BLOCKSIZE != 0)) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: hashed with illegal size %lu "
+		      "(made linear)",
+		      pathsofar, (unsigned long) sfi.sfi_size);
+		sfi.sfi_dirformat = SFS_DIR_LINEAR;
+		ichanged = 1;
+	}
+	if (sfi.sfi_dirformat == SFS_DIR_LINEAR && sfi.sfi_dirprobe != 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: probe limit set on linear directory "
+		      "(fixed)", pathsofar);
+		sfi.sfi_dirprobe = 0;
+		ichanged = 1;
+	}
 	count_dirs++;
 
 	if (pass1_inode(ino, &sfi, ichanged)) {
@@ -297,6 +297,22 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	/*
+	 * In a hashed directory every entry must be within the probe
+	 * limit of its home block, or the kernel won't find it. Entries
+	 * added above went in the first free slot, so check afterwards.
+	 */
+
+	if (sfi.sfi_dirformat == SFS_DIR_HASHED &&
+	    sfsdir_hashcheck(direntries, ndirentries, sfi.sfi_dirprobe) > 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: Hashed entries misplaced (rehashed)",
+		      pathsofar);
+		sfi.sfi_dirprobe = sfsdir_rehash(direntries, ndirentries);
+		dchanged = 1;
+		ichanged = 1;
+	}
+
 	/*
 	 * Write back anything that changed, clean up, and return.
 	 */
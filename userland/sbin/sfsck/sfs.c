@@ -81,6 +81,8 @@ swapinode(struct sfs_dinode *sfi)
 	sfi->sfi_size = SWAP32(sfi->sfi_size);
 	sfi->sfi_type = SWAP16(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAP16(sfi->sfi_linkcount);
+	sfi->sfi_dirformat = SWAP16(sfi->sfi_dirformat);
+	sfi->sfi_dirprobe = SWAP16(sfi->sfi_dirprobe);
 
 	for (i=0; i<NUM_D; i++) {
 		SET_D(sfi, i) = SWAP32(GET_D(sfi, i));
@@ -462,3 +464,87 @@ sfsdir_tryadd(struct sfs_direntry *d, int nd, const char *name, uint32_t ino)
 	}
 	return -1;
 }
+
+/*
+ * Name hash for hashed directories (see kern/sfs.h).
+ */
+static
+uint32_t
+sfsdir_hash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_BASIS;
+
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * SFS_DIRHASH_PRIME;
+	}
+	return h;
+}
+
+/*
+ * Check the entries of the hashed directory D (which has ND entries,
+ * a whole number of blocks) against the probe limit PROBE.
+ *
+ * Returns the number of entries that the kernel would not find
+ * because they are more than PROBE blocks past their home block.
+ */
+unsigned
+sfsdir_hashcheck(const struct sfs_direntry *d, unsigned nd, unsigned probe)
+{
+	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	unsigned nblocks = nd / atonce;
+	unsigned i, home, dist, bad;
+
+	assert(nd % atonce == 0 && nblocks > 0);
+
+	bad = 0;
+	for (i=0; i<nd; i++) {
+		if (d[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		home = sfsdir_hash(d[i].sfd_name) % nblocks;
+		dist = (i/atonce + nblocks - home) % nblocks;
+		if (dist > probe) {
+			bad++;
+		}
+	}
+	return bad;
+}
+
+/*
+ * Rebuild the hashed directory D (which has ND entries, a whole
+ * number of blocks) by putting each entry in the first free slot
+ * at or after its home block. Returns the new probe limit.
+ */
+unsigned
+sfsdir_rehash(struct sfs_direntry *d, unsigned nd)
+{
+	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	unsigned nblocks = nd / atonce;
+	struct sfs_direntry *old;
+	unsigned i, j, home, dist, probe;
+
+	assert(nd % atonce == 0 && nblocks > 0);
+
+	old = domalloc(nd * sizeof(struct sfs_direntry));
+	memcpy(old, d, nd * sizeof(struct sfs_direntry));
+	bzero(d, nd * sizeof(struct sfs_direntry));
+
+	probe = 0;
+	for (i=0; i<nd; i++) {
+		if (old[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		home = sfsdir_hash(old[i].sfd_name) % nblocks;
+		/* There are as many slots as entries, so this terminates */
+		for (j = home*atonce; d[j].sfd_ino != SFS_NOINO; j = (j+1) % nd)
+			;
+		d[j] = old[i];
+		dist = (j/atonce + nblocks - home) % nblocks;
+		if (dist > probe) {
+			probe = dist;
+		}
+	}
+
+	free(old);
+	return probe;
+}
@@ -74,6 +74,14 @@ void sfs_writedir(const struct sfs_dinode *sfi,
 int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 		  const char *name, uint32_t ino);
 
+/*
+ * Hashed directories: count entries not reachable within PROBE blocks
+ * of their home block, and rebuild one, returning the new probe limit.
+ */
+unsigned sfsdir_hashcheck(const struct sfs_direntry *d, unsigned nd,
+			  unsigned probe);
+unsigned sfsdir_rehash(struct sfs_direntry *d, unsigned nd);
+
 /* Sort a directory by creating a permutation vector. */
 void sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector);
 